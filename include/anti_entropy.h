@@ -0,0 +1,56 @@
+#ifndef ANTI_ENTROPY_H
+#define ANTI_ENTROPY_H
+
+#include "node.h"
+
+#define ANTI_ENTROPY_INTERVAL_MS 10000 // period of the rounds comparing n->files with the replicas
+#define ANTI_ENTROPY_MAX_SUBTREES 1024 // subtrees compared with one replica per round, the rest waits for the next
+#define SYNC_LEAF_MAX 32 // a differing subtree with at most this many entries on either side is compared entry by entry
+#define INCOMPLETE_HANDOFFS 8 // handoffs that ended early remembered until a round settles their range
+
+/*
+ * Anti-entropy between a node and the k - 1 successors holding its replicas. Every
+ * ANTI_ENTROPY_INTERVAL_MS the node walks the Merkle trees of its entries in (predecessor, n]
+ * and of the replicas of that range, from the root down through the subtrees whose digests
+ * differ only, so an in-sync replica costs one round trip and d differences about d log16 N
+ * subtrees. Each SYNC_DIGEST carries the prefixes of a few subtrees and is answered with the
+ * digests and counts of their 16 children:
+ *
+ *   request  u8 from[HASH_SIZE], u8 to[HASH_SIZE], then per subtree u8 nibbles and u8 prefix[HASH_SIZE]
+ *   reply    per subtree and child, u64 digest and u32 count
+ *
+ * A differing subtree small enough is settled with a SYNC_ENTRIES, which carries the ID and digest
+ * of every entry of the node below the prefix and is answered with the IDs the replica lacks or
+ * holds differently, followed by its own extra entries as REPLICATE records:
+ *
+ *   request  u8 from[HASH_SIZE], u8 to[HASH_SIZE], u8 nibbles, u8 prefix[HASH_SIZE],
+ *            u16 count, count times u8 id[HASH_SIZE] and u64 digest
+ *   reply    u16 count, count times u8 id[HASH_SIZE], then REPLICATE records
+ *
+ * The node is authoritative: what the replica lacks or holds differently is sent to it as a
+ * REPLICATE, and its extra entries are removed. Only in the range of a handoff to this node that
+ * ended early are they taken back into n->files instead (they were lost on the way), until a
+ * round has compared the whole range with every replica.
+ */
+
+// starts the anti-entropy rounds on the event loop
+void start_anti_entropy(Node *n);
+
+// remembers that a handoff of the entries in (from, to] to this node ended early, the whole ring if from == to
+void note_incomplete_handoff(const uint8_t *from, const uint8_t *to);
+
+// handles a SYNC_DIGEST: answers the child digests of the requested subtrees of n->replicas
+void answer_sync_digest(Node *n, const Message *msg);
+
+// handles a SYNC_ENTRIES: answers which entries differ from the requester's below a prefix
+void answer_sync_entries(Node *n, const Message *msg);
+
+typedef struct {
+    unsigned long rounds;
+    unsigned long subtrees; // subtrees whose children were compared
+    unsigned long repaired; // entries sent to, removed from or taken back from replicas
+} AntiEntropyStats;
+
+void get_anti_entropy_stats(AntiEntropyStats *stats);
+
+#endif //ANTI_ENTROPY_H
@@ -0,0 +1,47 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include "file_entry.h"
+
+#define BULK_WINDOW 16 // batched requests in flight at once
+#define BULK_HASH_THREADS 8 // max threads hashing names
+#define BULK_HASH_PARALLEL_MIN 1024 // names below which they are hashed on the calling thread
+
+/*
+ * Operations on many keys at once. The names are hashed in parallel and sorted by ID, so
+ * one lookup finds the node responsible for a whole run of IDs, which then gets the run in
+ * batched requests packing as many keys as fit in a datagram, up to BULK_WINDOW of them in flight.
+ */
+
+/*
+ * Stores every regular file under dir (symbolic links are not followed) with STORE_BATCH
+ * requests. A batch is confirmed as uploaded once the responsible node acknowledges it.
+ * Returns the number of files stored, *failed is set to the number that could not be,
+ * or -1 if dir could not be walked.
+ */
+int store_tree(Node *n, const char *dir, size_t *failed);
+
+/*
+ * Adds the entries of a STORE_BATCH request to n->files, each a u8 id[HASH_SIZE] followed by
+ * a u16 path_len and the path, all uploaded by the sender. Returns the number added.
+ */
+uint32_t apply_store_batch(Node *n, const Message *msg);
+
+// result of one name looked up by find_many, info is NULL if the file was not found or the lookup failed
+typedef void (*FindCallback)(const char *filename, const FileInfo *info, bool failed, void *arg);
+
+/*
+ * Looks up count filenames with FIND_BATCH requests. cb is called once per name as the results
+ * arrive, one call at a time but not necessarily on the calling thread, so it must not block.
+ * Returns the number of files found, *failed is set to the number of names whose lookup failed.
+ */
+int find_many(Node *n, const char *const *filenames, size_t count, FindCallback cb, void *arg, size_t *failed);
+
+/*
+ * Answers a FIND_BATCH request (a u8 name_len and the name per key) from n->files. The reply
+ * starts with a u16 count of the names answered, as many as fit, each followed by a u8 found
+ * flag and, if found, the u32 IPv4 address and u16 port of the owner, a u16 path_len and the path.
+ */
+void answer_find_batch(Node *n, const Message *request, Message *response);
+
+#endif //BULK_H
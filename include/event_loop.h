@@ -0,0 +1,36 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+
+#define EVENT_LOOP_MAX_EVENTS 64 // ready descriptors handled per epoll_wait() call
+
+typedef void (*FdCallback)(int fd, uint32_t events, void *arg);
+
+typedef void (*TimerCallback)(void *arg);
+
+typedef struct Timer Timer;
+
+/*
+ * Single-threaded event loop multiplexing descriptors and timers with epoll.
+ * Callbacks run on the loop thread and must not block: anything that waits
+ * for the network either uses the async RPC API or runs on a worker pool.
+ */
+int event_loop_init();
+
+// watches fd for events (EPOLLIN, EPOLLOUT, ...), cb runs on the loop thread whenever it is ready
+int event_loop_add_fd(int fd, uint32_t events, FdCallback cb, void *arg);
+
+// stops watching fd, must be called from the loop thread (or before the loop runs)
+void event_loop_remove_fd(int fd);
+
+// runs cb once after delay_ms milliseconds, callable from any thread
+Timer *add_timer(uint64_t delay_ms, TimerCallback cb, void *arg);
+
+// cancels a timer that has not fired yet, must be called from the loop thread
+void cancel_timer(Timer *timer);
+
+// dispatches events and timers forever
+void event_loop_run();
+
+#endif //EVENT_LOOP_H
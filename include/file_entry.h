@@ -2,21 +2,43 @@
 #define FILE_ENTRY_H
 
 #include <stdint.h>
+#include "peer.h"
 
 #define MAX_FILENAME 256
 #define MAX_FILEPATH 4096
 
+/*
+ * Metadata of one stored file, sized to its path: a single allocation holding the ID,
+ * the uploader's interned peer record and the path, whose last component is the filename.
+ */
 typedef struct FileEntry {
     uint8_t id[20]; // hash key of the file (used for lookup)
+    uint16_t name_offset; // the filename starts at path + name_offset
+    uint16_t path_len;
+    Peer *owner; // node the file was uploaded from
+    char path[]; // NUL-terminated filepath on the owner
+} FileEntry;
+
+// a FileEntry expanded into fixed fields, for callers that outlive the files lock
+typedef struct {
+    uint8_t id[20];
     char filename[MAX_FILENAME];
     char filepath[MAX_FILEPATH];
     char owner_ip[16];
     int owner_port;
-    struct FileEntry *next;
-} FileEntry;
+} FileInfo;
 
 #include "node.h"
 
+// allocates an entry for filepath, returns NULL if the path is too long or memory ran out
+FileEntry *create_file_entry(const uint8_t *id, const char *filepath, Peer *owner);
+
+// returns the filename of entry (the last component of its path)
+const char *file_entry_name(const FileEntry *entry);
+
+// copies entry into info
+void expand_file_entry(const FileEntry *entry, FileInfo *info);
+
 extern char outdir[MAX_FILEPATH];
 
 int set_outdir(const char *new_outdir);
@@ -25,16 +47,23 @@ int store_file(Node *n, const char *filepath);
 
 void confirm_file_stored(Node *node, const char *filepath);
 
-int internal_store_file(Node *n, const char *filename, const char *filepath, const uint8_t *file_id,
-                        const char *uploader_ip, int uploader_port);
+int internal_store_file(Node *n, const char *filepath, const uint8_t *file_id, const char *uploader_ip,
+                        int uploader_port);
+
+// returns the metadata of filename (to be freed by the caller), or NULL if it is not in the network
+FileInfo *find_file(Node *n, const char *filename);
+
+// like find_file, but always asks the responsible node instead of trusting cached locations
+FileInfo *locate_file(Node *n, const char *filename);
 
-FileEntry *find_file(Node *n, const char *filename);
+// returns a copy of the entry of file_id held by this node, as responsible node or replica (to be freed by the caller), or NULL
+FileInfo *find_local_file(Node *n, const uint8_t *file_id);
 
+// returns the entry in the uploaded files table, n->files_lock must be held while it is used
 FileEntry *find_uploaded_file(const Node *n, const char *filepath);
 
-int download_file(const Node *n, const FileEntry *file_entry);
+int download_file(const Node *n, const FileInfo *file_info);
 
-int delete_file_entry(FileEntry **pFiles, const uint8_t *id);
 
 int delete_file(Node *n, const char *filename);
 
@@ -0,0 +1,72 @@
+#ifndef FILE_TABLE_H
+#define FILE_TABLE_H
+
+#include "key_index.h"
+#include "merkle.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILE_TABLE_INITIAL_CAPACITY 64 // slots of an empty table (power of two)
+#define FILE_TABLE_MAX_LOAD 70 // percentage of used slots that makes the table double
+
+struct FileEntry;
+
+// one open-addressing index (linear probing, backward-shift deletion) over the entries of a table
+typedef struct {
+    struct FileEntry **slots; // NULL marks an empty slot
+    size_t mask; // capacity - 1
+} FileIndex;
+
+/*
+ * Set of file entries keyed by their 20-byte ID, optionally also indexed by filepath and by ID order.
+ * The table owns its entries: they are freed when removed or replaced.
+ * Not thread-safe, callers hold n->files_lock.
+ */
+typedef struct {
+    FileIndex by_id;
+    FileIndex by_path; // only used if index_paths is set
+    KeyIndex by_order; // only used if index_order is set
+    MerkleTree tree; // digests of the entries by ID prefix, only kept if index_order is set
+    bool index_paths;
+    bool index_order;
+    size_t count;
+} FileTable;
+
+void file_table_init(FileTable *t, bool index_paths, bool index_order);
+
+// frees every entry and the slot arrays
+void file_table_free(FileTable *t);
+
+// frees every entry, leaving the table empty but usable
+void file_table_clear(FileTable *t);
+
+// adds entry, replacing (and freeing) any entry with the same ID, returns -1 if memory ran out
+int file_table_insert(FileTable *t, struct FileEntry *entry);
+
+// returns the entry with the given ID or NULL
+struct FileEntry *file_table_find(const FileTable *t, const uint8_t *id);
+
+// returns the entry with the given filepath or NULL, the table must index paths
+struct FileEntry *file_table_find_path(const FileTable *t, const char *filepath);
+
+// removes and frees the entry with the given ID, returns -1 if there is none
+int file_table_remove(FileTable *t, const uint8_t *id);
+
+/*
+ * Removes the entries whose ID lies in the ring interval (from, to], the whole ring if from == to,
+ * and stores them in *entries (a malloc'd array, NULL if none were taken). The caller owns the
+ * returned entries. Costs O(log n + k) for k entries, the table must index the order of IDs.
+ */
+size_t file_table_take_range(FileTable *t, const uint8_t *from, const uint8_t *to, struct FileEntry ***entries);
+
+// passes every entry whose ID lies in the linear interval [lo, hi] to visit, in ID order, the table must index the order of IDs
+void file_table_visit(const FileTable *t, const uint8_t *lo, const uint8_t *hi, KeyVisitor visit, void *arg);
+
+/*
+ * Iterates over the entries: start with *pos = 0, returns NULL after the last one.
+ * After removing the returned entry, decrement *pos so that the entry shifted into its slot is not skipped.
+ */
+struct FileEntry *file_table_next(const FileTable *t, size_t *pos);
+
+#endif //FILE_TABLE_H
@@ -0,0 +1,46 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "file_entry.h"
+#include "metadata_store.h"
+#include <stdbool.h>
+
+#define HANDOFF_VERSION 1
+#define HANDOFF_FLAG_DEFLATE 0x01 // the records of the block are zlib-compressed
+#define HANDOFF_FLAG_CONTINUES 0x02 // a record too large for one block goes on in the next one
+#define HANDOFF_HEADER 2 // u8 version + u8 flags
+#define HANDOFF_RAW_MAX 8192 // uncompressed bytes gathered per block, at least a whole record
+#define HANDOFF_COMPRESS_MIN 128 // blocks smaller than this are sent uncompressed
+#define HANDOFF_OWNERS 32 // owners a block can refer back to
+
+/*
+ * File entries move between nodes (GET_FILES on join, LEAVING on departure, REPLICA_SYNC) as a series of
+ * FILE_DATA segments, each carrying one block that decodes on its own:
+ *
+ *   u8   version (HANDOFF_VERSION)
+ *   u8   flags (HANDOFF_FLAG_*)
+ *   ...  records, deflated if HANDOFF_FLAG_DEFLATE is set
+ *
+ * Every record is
+ *
+ *   u8      id[HASH_SIZE]
+ *   varint  owner: 0 if a u32 IPv4 address and a u16 port follow, otherwise the k-th owner
+ *           introduced earlier in the block
+ *   varint  bytes of path shared with the previous record of the block
+ *   varint  length of the rest of the path, followed by its bytes
+ *
+ * Varints are unsigned LEB128. A lost segment only loses the entries of its own block.
+ */
+
+// sends entries to target as FILE_DATA blocks followed by a FILE_END, header provides request_id and id
+int send_file_entries(const Node *n, const Peer *target, const Message *header, FileEntry *const *entries,
+                      size_t count);
+
+/*
+ * Adds the entries arriving on the download queue for request_id to table until FILE_END.
+ * The request must be registered on the download queue. Returns the number of entries added,
+ * or -1 if the sender went quiet before FILE_END (the entries decoded so far are kept).
+ */
+int receive_file_entries(Node *n, uint32_t request_id, StoreTable table);
+
+#endif //HANDOFF_H
@@ -0,0 +1,30 @@
+#ifndef HOT_KEYS_H
+#define HOT_KEYS_H
+
+#include "file_entry.h"
+#include <stdbool.h>
+
+#define HOT_KEY_SLOTS 1024 // keys whose request rate is tracked at once (power of two)
+#define HOT_KEY_THRESHOLD 16 // FIND_FILE requests per window that make a key hot
+#define HOT_KEY_WINDOW_MS 1000
+#define HOT_KEY_PUSH_DEPTH 2 // predecessors a hot key's location is pushed to
+
+/*
+ * Counts a FIND_FILE request for id on the responsible node. Returns true when the key is hot and
+ * its location should be pushed (again): once it crosses the threshold, then every half TTL of the
+ * location cache for as long as it stays hot, so the pushed copies never expire while in use.
+ * Keys share the slots of a direct-mapped table, a colliding key restarts the count.
+ */
+bool hot_key_hit(const uint8_t *id);
+
+/*
+ * Pushes the location of a hot file to the predecessor, which forwards it to its own predecessor
+ * until HOT_KEY_PUSH_DEPTH nodes hold it. Every lookup of the key passes through these nodes
+ * last, so they answer it from their location cache and the load spreads over them.
+ */
+void push_hot_key(Node *n, const FileInfo *file);
+
+// handles a HOT_KEY push: caches the location and forwards it while depth remains
+void accept_hot_key(Node *n, const Message *msg);
+
+#endif //HOT_KEYS_H
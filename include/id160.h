@@ -0,0 +1,34 @@
+#ifndef ID160_H
+#define ID160_H
+
+#include <stdint.h>
+
+#define ID160_WORDS 5 // 32-bit words in a 160-bit identifier
+
+// unsigned 160-bit integer, the identifier space of the ring (arithmetic is mod 2^160)
+typedef struct {
+    uint32_t w[ID160_WORDS]; // most significant word first
+} uint160;
+
+// loads a big-endian 20-byte identifier (SHA-1 digest)
+void id160_from_bytes(uint160 *out, const uint8_t *bytes);
+
+// stores id as a big-endian 20-byte identifier
+void id160_to_bytes(uint8_t *bytes, const uint160 *id);
+
+// returns <0, 0 or >0 like memcmp
+int id160_cmp(const uint160 *a, const uint160 *b);
+
+// out = a + b mod 2^160
+void id160_add(uint160 *out, const uint160 *a, const uint160 *b);
+
+// out = clockwise distance from a to b, (b - a) mod 2^160
+void id160_distance(uint160 *out, const uint160 *a, const uint160 *b);
+
+// out = 2^i, 0 <= i < 160
+void id160_pow2(uint160 *out, int i);
+
+// out = a + 2^i mod 2^160 (start of the i-th finger of a)
+void id160_add_pow2(uint160 *out, const uint160 *a, int i);
+
+#endif //ID160_H
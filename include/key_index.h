@@ -0,0 +1,52 @@
+#ifndef KEY_INDEX_H
+#define KEY_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define KEY_INDEX_CHUNK 128 // entries per chunk, a full chunk is split in two halves
+
+struct FileEntry;
+
+// sorted run of entries, every entry of a chunk precedes every entry of the next one
+typedef struct {
+    size_t count;
+    struct FileEntry *entries[KEY_INDEX_CHUNK];
+} KeyChunk;
+
+/*
+ * File entries ordered by ID: a sorted array of sorted chunks, i.e. a two-level B-tree.
+ * Lookups binary-search the chunk boundaries and then the chunk, and a range of keys can be
+ * cut out in O(log n + k) because whole chunks inside the range are dropped at once.
+ * The index does not own the entries and IDs have to be unique.
+ */
+typedef struct {
+    KeyChunk **chunks;
+    size_t count; // chunks in use
+    size_t capacity;
+} KeyIndex;
+
+// called for every entry cut out by key_index_take_range or visited by key_index_visit
+typedef void (*KeyVisitor)(struct FileEntry *entry, void *arg);
+
+void key_index_init(KeyIndex *index);
+
+// frees the chunks, not the entries
+void key_index_free(KeyIndex *index);
+
+// adds entry, whose ID must not be in the index yet, returns -1 if memory ran out
+int key_index_insert(KeyIndex *index, struct FileEntry *entry);
+
+// removes the entry with the given ID, returns -1 if there is none
+int key_index_remove(KeyIndex *index, const uint8_t *id);
+
+/*
+ * Removes every entry whose ID lies in the ring interval (from, to] and passes it to visit,
+ * in ID order starting after from. The whole ring is taken if from == to.
+ */
+size_t key_index_take_range(KeyIndex *index, const uint8_t *from, const uint8_t *to, KeyVisitor visit, void *arg);
+
+// passes every entry whose ID lies in the linear interval [lo, hi] to visit, in ID order, without removing it
+void key_index_visit(const KeyIndex *index, const uint8_t *lo, const uint8_t *hi, KeyVisitor visit, void *arg);
+
+#endif //KEY_INDEX_H
@@ -0,0 +1,45 @@
+#ifndef LOCATION_CACHE_H
+#define LOCATION_CACHE_H
+
+#include "file_entry.h"
+#include <stdbool.h>
+
+#define LOCATION_CACHE_SIZE 4096 // locations remembered at most
+#define LOCATION_CACHE_SHARDS 16 // independently locked parts of the cache (power of two)
+#define LOCATION_CACHE_TTL_MS 30000 // how long a location is trusted without asking again
+#define LOCATION_CACHE_REFRESH_MS 5000 // a hit this close to expiring refreshes the entry in the background
+
+/*
+ * Where recently found files live: file ID -> owner, path and the node that answered the lookup.
+ * Each shard keeps its entries in a hash table and an LRU list, the least recently used entry
+ * makes room for a new one once the shard is full.
+ */
+
+/*
+ * Copies the location of id into info, returns false if it is not cached or has expired.
+ * *refresh is set to the node to ask again if the entry is about to expire, NULL otherwise.
+ */
+bool location_cache_get(const uint8_t *id, FileInfo *info, Peer **refresh);
+
+// remembers the location of info->id, as answered by source
+void location_cache_put(const FileInfo *info, Peer *source);
+
+// forgets the location of id (the file was deleted or could not be downloaded)
+void location_cache_invalidate(const uint8_t *id);
+
+// asks source for the location of filename again without blocking, updating or dropping the entry
+void location_cache_refresh(Node *n, const char *filename, Peer *source);
+
+// marks the owners and sources of the cached locations for the current peer sweep
+void location_cache_mark_peers();
+
+typedef struct {
+    size_t entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long refreshes;
+} LocationCacheStats;
+
+void get_location_cache_stats(LocationCacheStats *stats);
+
+#endif //LOCATION_CACHE_H
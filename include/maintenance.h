@@ -0,0 +1,35 @@
+#ifndef MAINTENANCE_H
+#define MAINTENANCE_H
+
+#include "node.h"
+
+#define MAINTENANCE_MIN_INTERVAL_MS 500 // period right after churn was detected
+#define MAINTENANCE_MAX_INTERVAL_MS 15000 // period once the ring is stable
+#define MAINTENANCE_STABLE_ROUNDS 3 // finger rounds without changes before the ring counts as converged
+
+typedef struct {
+    uint64_t interval_ms; // current period of the maintenance tick
+    unsigned long rounds; // finger table rounds completed
+    int last_lookups; // remote lookups made by the last round
+    int last_changes; // fingers changed by the last round
+    int stable_rounds; // consecutive rounds without changes or churn
+    int distinct_fingers; // different nodes in the finger table
+    bool converged;
+} MaintenanceStatus;
+
+/*
+ * Starts the maintenance scheduler on the event loop. Each tick stabilizes, checks the
+ * predecessor and, unless one is still running, starts a refresh round of the whole finger
+ * table. A round walks the fingers in order and only looks up those whose start is past the
+ * node found for the previous finger, so about log N lookups cover all M entries. The tick
+ * period drops to MAINTENANCE_MIN_INTERVAL_MS on churn and doubles with every quiet round.
+ */
+void start_maintenance(Node *n);
+
+// tells the scheduler that the ring changed (successor, predecessor or a failed peer), callable from any thread
+void report_churn();
+
+// copies the convergence state published after the last finger round
+void get_maintenance_status(MaintenanceStatus *status);
+
+#endif //MAINTENANCE_H
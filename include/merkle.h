@@ -0,0 +1,46 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+
+#define MERKLE_FANOUT 16 // children of a node, one per value of the next nibble of the ID
+#define MERKLE_LEVELS 3 // levels kept below the root (16^3 leaves), deeper subtrees are computed when asked for
+#define MERKLE_MAX_NIBBLES 40 // nibbles of an ID, the depth of a subtree holding a single ID
+
+struct FileEntry;
+
+typedef struct {
+    uint64_t digest; // XOR of the digests of the entries below
+    uint32_t count; // entries below
+} MerkleNode;
+
+/*
+ * Digests of the entries of a table by ID prefix: the node for the first k nibbles of an ID covers
+ * every entry whose ID starts with them. A node is the XOR of the digests of its entries, so adding
+ * or removing an entry updates the path from its leaf to the root in O(MERKLE_LEVELS), and two
+ * tables holding the same entries under a prefix have the same node for it.
+ */
+typedef struct {
+    MerkleNode *levels[MERKLE_LEVELS]; // level l holds the 16^(l + 1) nodes of the prefixes of l + 1 nibbles
+} MerkleTree;
+
+// returns -1 if memory ran out
+int merkle_init(MerkleTree *t);
+
+void merkle_free(MerkleTree *t);
+
+void merkle_clear(MerkleTree *t);
+
+// 64-bit digest of the ID, owner and path of entry
+uint64_t merkle_entry_digest(const struct FileEntry *entry);
+
+// accounts for an entry added to the table
+void merkle_add(MerkleTree *t, const struct FileEntry *entry);
+
+// accounts for an entry removed from the table
+void merkle_remove(MerkleTree *t, const struct FileEntry *entry);
+
+// returns the node of the first nibbles nibbles of prefix, 1 <= nibbles <= MERKLE_LEVELS
+const MerkleNode *merkle_node(const MerkleTree *t, const uint8_t *prefix, int nibbles);
+
+#endif //MERKLE_H
@@ -0,0 +1,22 @@
+#ifndef MESSAGE_POOL_H
+#define MESSAGE_POOL_H
+
+#include "protocol.h"
+
+#define MESSAGE_POOL_SIZE 8192 // messages that can be queued at once across all requests
+
+void init_message_pool();
+
+// takes a message from the pool without locking, returns NULL if every message is in use
+Message *acquire_message();
+
+// gives a message obtained from acquire_message (or any pop_message variant) back to the pool, NULL is ignored
+void release_message(Message *msg);
+
+// number of messages currently taken from the pool
+size_t message_pool_in_use();
+
+// number of messages dropped because the pool was exhausted
+unsigned long message_pool_drops();
+
+#endif //MESSAGE_POOL_H
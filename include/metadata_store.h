@@ -0,0 +1,71 @@
+#ifndef METADATA_STORE_H
+#define METADATA_STORE_H
+
+#include "file_entry.h"
+#include <stddef.h>
+
+#define METADATA_STORE_COMPACT_RECORDS 65536 // WAL records that trigger a snapshot, if they outnumber the entries
+
+// the table of the node a record applies to
+typedef enum {
+    STORE_FILES = 0, // n->files
+    STORE_UPLOADED, // n->uploaded_files
+    STORE_REPLICAS // n->replicas
+} StoreTable;
+
+// returns the table of n that table refers to
+FileTable *store_table(Node *n, StoreTable table);
+
+/*
+ * Keeps n->files, n->uploaded_files and n->replicas on disk in dir, so a restarted node gets its metadata
+ * back without any network traffic. Two files make up the store:
+ *
+ *   wal       append-only log of the changes made since the snapshot was written
+ *   snapshot  every entry at the time of the last compaction, replaced atomically by rename()
+ *
+ * Both are sequences of records (network byte order):
+ *
+ *   u32  CRC-32 of the rest of the record
+ *   u8   op (put, remove or clear)
+ *   u8   table (StoreTable)
+ *   u8   id[HASH_SIZE]
+ *   u32  owner IPv4 address
+ *   u16  owner port
+ *   u16  path_len, followed by path_len bytes of path
+ *
+ * The snapshot starts with a header and only holds puts. It is mapped on startup and the WAL
+ * replayed on top of it, a torn record at the end of the WAL (a crash during a write) is cut off.
+ * Records are written with a single write(), they survive a crash of the process but only
+ * reach the disk with the next snapshot or when the store is closed.
+ *
+ * A checkpoint copies the tables into memory and moves the WAL to wal.old under n->files_lock,
+ * then writes the snapshot without holding it and drops wal.old. Until then wal.old is
+ * replayed between the snapshot and the WAL.
+ *
+ * The store is not thread-safe: the calls that record changes are made with n->files_lock held,
+ * which also keeps the order of the records the order of the changes.
+ */
+typedef struct MetadataStore MetadataStore;
+
+// opens (creating it if needed) the store in dir and loads its entries into the tables of n, NULL on failure
+MetadataStore *metadata_store_open(Node *n, const char *dir);
+
+// records that entry was added to (or replaced in) table, s may be NULL
+void metadata_store_put(MetadataStore *s, StoreTable table, const FileEntry *entry);
+
+// records that the entry with the given ID was removed from table, s may be NULL
+void metadata_store_remove(MetadataStore *s, StoreTable table, const uint8_t *id);
+
+// records that every entry of table was removed, s may be NULL
+void metadata_store_clear(MetadataStore *s, StoreTable table);
+
+// writes a snapshot of the tables and drops the WAL it covers, n->files_lock must not be held
+int metadata_store_checkpoint(MetadataStore *s);
+
+// starts a checkpoint on a background thread once the WAL has grown large, s may be NULL
+void metadata_store_maintain(MetadataStore *s);
+
+// waits for a running checkpoint, writes a final snapshot and closes the store, n->files_lock must not be held
+void metadata_store_close(MetadataStore *s);
+
+#endif //METADATA_STORE_H
@@ -2,19 +2,35 @@
 #define NODE_H
 
 #define M 160 // number of bits in the hash (SHA-1)
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024) // requested UDP socket buffer size
+#define SUCCESSOR_LIST_SIZE 8 // r, successors remembered to fail over when the first one dies
+#define REPLICATION_FACTOR 3 // default k, nodes holding each entry: the responsible one and its next k - 1 successors
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include "peer.h"
+#include "file_table.h"
 
 typedef struct Node {
     uint8_t id[20]; // SHA-1 hash
     char ip[16];
     int port;
-    struct Node *successor;
-    struct Node *predecessor;
-    struct Node *finger[M];
-    struct FileEntry *files;
-    struct FileEntry *uploaded_files;
+    Peer *self; // the local node's own record in the peer table
+    Peer *successor; // first entry of successor_list, or self when alone
+    Peer *successor_list[SUCCESSOR_LIST_SIZE]; // next nodes clockwise, nearest first
+    int successor_count;
+    pthread_mutex_t ring_lock; // protects successor, successor_list, predecessor and writes of finger
+    Peer *predecessor; // read through get_predecessor
+    Peer *finger[M]; // read without the lock, one entry at a time
+    uint8_t (*finger_start)[20]; // start of each finger interval, n + 2^i
+    int next_finger; // next finger examined by the current refresh round
+    FileTable files; // entries this node is responsible for, by ID
+    FileTable uploaded_files; // entries uploaded from this node, by ID and by filepath
+    FileTable replicas; // copies of the entries of the k - 1 predecessors, by ID
+    int replication; // k, at most SUCCESSOR_LIST_SIZE
+    pthread_mutex_t files_lock; // protects files, uploaded_files and replicas, handlers run on several threads
+    struct MetadataStore *store; // on-disk copy of files and uploaded_files, NULL unless persistence is enabled
     int sockfd;
     bool socket_open;
 } Node;
@@ -27,6 +43,24 @@ void node_bind(Node *n);
 
 void cleanup_node(Node *n);
 
+typedef void (*MessageHandler)(Node *n, const Message *msg);
+
+// where a handler runs: on the listener itself, or on one of the worker pools
+typedef enum {
+    HANDLER_CONTROL = 0, // control-plane requests, run on the control pool
+    HANDLER_INLINE, // cheap hand-offs to a waiting request (replies, segments, ACKs)
+    HANDLER_BULK // handlers that read or send file data, run on the bulk pool
+} HandlerClass;
+
+// registers (or replaces) the handler invoked for messages of the given opcode
+void register_handler(MessageType type, MessageHandler handler);
+
+// returns how many messages of the given opcode have been dispatched
+unsigned long get_message_count(uint8_t type);
+
+// returns where messages of the given opcode are handled, unknown opcodes are handled inline
+HandlerClass get_handler_class(uint8_t type);
+
 void handle_requests(Node *n, const Message *msg);
 
 #endif //NODE_H
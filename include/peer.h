@@ -0,0 +1,70 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PEER_BUCKETS 1024 // hash buckets of each peer index (power of two)
+#define PEER_SWEEP_MS 60000 // period of the sweeps that forget peers nothing refers to
+#define PEER_IDLE_MS 600000 // an unreferenced peer is forgotten once it has not been interned for this long
+#define PEER_GRACE_MS 60000 // a forgotten record is freed this much later, outliving any request still using it
+
+/*
+ * A remote node as seen from here. Records are interned: there is exactly one per
+ * ip:port, so fingers, successors and predecessors can point to it and compare pointers
+ * instead of IDs. Peers that neither the routing state nor any table refers to are
+ * forgotten by a periodic sweep once idle, and freed PEER_GRACE_MS later.
+ */
+typedef struct Peer {
+    uint8_t id[20]; // SHA-1 hash of "ip:port", computed once when the peer is first seen
+    char ip[16];
+    int port;
+    struct sockaddr_in addr; // resolved once, used for every datagram sent to the peer
+    atomic_bool alive; // cleared when the peer stops answering, set again when it does
+    pthread_mutex_t rtt_lock; // protects srtt and rttvar
+    uint64_t srtt; // smoothed RTT in microseconds, 0 before the first sample
+    uint64_t rttvar;
+    _Atomic uint64_t last_used_us; // last time the record was interned
+    bool marked; // referred to, as found by the current sweep
+    uint64_t forgotten_us; // when the sweep unlinked the record
+    struct Peer *next_by_id; // next peer in the same ID bucket, or the next forgotten one
+    struct Peer *next_by_addr; // next peer in the same address bucket
+} Peer;
+
+// returns the record of ip:port, creating it on first sight
+Peer *intern_peer(const char *ip, int port);
+
+// returns the record of ip:port, NULL if it is not known (nothing is created)
+Peer *find_peer_addr(const char *ip, int port);
+
+// returns the record with the given ID, NULL if no such peer was seen
+Peer *find_peer(const uint8_t *id);
+
+// returns how many peers have been seen
+int peer_count();
+
+// returns the retransmission timeout towards peer in microseconds: SRTT + 4 * RTTVAR (Jacobson/Karels)
+uint64_t peer_rto(Peer *peer, uint64_t initial, uint64_t min, uint64_t max);
+
+// returns the smoothed RTT towards peer in microseconds, 0 before the first sample
+uint64_t peer_srtt(Peer *peer);
+
+// feeds an RTT sample (microseconds) into the estimate of peer, which also proves it alive
+void peer_rtt_sample(Peer *peer, uint64_t sample);
+
+// marks peer as alive or dead
+void peer_set_alive(Peer *peer, bool alive);
+
+// starts a sweep, only one may run at a time
+void begin_peer_sweep();
+
+// keeps peer (NULL is ignored) through the current sweep
+void mark_peer(Peer *peer);
+
+// forgets the unmarked peers idle for PEER_IDLE_MS and frees those forgotten PEER_GRACE_MS ago, returns how many were forgotten
+int finish_peer_sweep();
+
+#endif //PEER_H
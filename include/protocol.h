@@ -2,60 +2,172 @@
 #define PROTOCOL_H
 
 #define MSG_SIZE 1400 // size of the message buffer
-#define MSG_JOIN "JOIN"
-#define MSG_NOTIFY "NOTIFY"
-#define MSG_FIND_SUCCESSOR "FIND_SUCCESSOR"
-#define MSG_STABILIZE "STABILIZE"
-#define MSG_HEARTBEAT "HEARTBEAT"
-#define MSG_STORE_FILE "STORE_FILE"
-#define MSG_REPLY "REPLY"
-#define MSG_DOWNLOAD_FILE "DOWNLOAD_FILE"
-#define MSG_FIND_FILE "FIND_FILE"
-#define MSG_DELETE_FILE "DELETE_FILE"
-#define MSG_FILE_DATA "FILE_DATA"
-#define MSG_FILE_END "FILE_END"
-#define MSG_GET_FILES "GET_FILES"
-#define MSG_LEAVING "LEAVING"
-#define MSG_UPDATE_SUCCESSOR "UPDATE_SUCCESSOR"
-
+#define WIRE_VERSION 4 // version of the on-wire message encoding
+#define RECV_BATCH 32 // max datagrams drained by a single receive_messages() call
+#define SEND_BATCH 32 // max datagrams handed to the kernel by a single sendmmsg() call
+#define PENDING_BUCKETS 256 // hash buckets of a MessageQueue (power of two)
+#define PENDING_STRIPES 16 // mutexes shared by the buckets of a MessageQueue
+#define PENDING_RING 1024 // messages a transfer or handoff request can hold before new ones are dropped (power of two)
+#define PENDING_RING_SMALL 64 // the same for RPC replies, a few segments and their retransmissions (power of two)
+#define PENDING_POOL 64 // finished requests a queue keeps for reuse
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <sha1.h>
 
+// message opcodes, the values are part of the wire format
+typedef enum {
+    MSG_JOIN = 0,
+    MSG_NOTIFY = 1,
+    MSG_FIND_SUCCESSOR = 2,
+    MSG_STABILIZE = 3,
+    MSG_HEARTBEAT = 4,
+    MSG_STORE_FILE = 5,
+    MSG_REPLY = 6,
+    MSG_DOWNLOAD_FILE = 7,
+    MSG_FIND_FILE = 8,
+    MSG_DELETE_FILE = 9,
+    MSG_FILE_DATA = 10,
+    MSG_FILE_END = 11,
+    MSG_GET_FILES = 12,
+    MSG_LEAVING = 13,
+    MSG_UPDATE_SUCCESSOR = 14,
+    MSG_FILE_ACK = 15,
+    MSG_STORE_BATCH = 16,
+    MSG_FIND_BATCH = 17,
+    MSG_HOT_KEY = 18,
+    MSG_REPLICATE = 19,
+    MSG_REPLICA_SYNC = 20,
+    MSG_SYNC_DIGEST = 21,
+    MSG_SYNC_ENTRIES = 22,
+    MSG_TYPE_COUNT // number of opcodes, must stay last
+} MessageType;
+
+// message flags
+#define MSG_FLAG_STREAM 0x01 // DOWNLOAD_FILE: requester accepts a TCP data channel / REPLY: data follows on it
+#define MSG_FLAG_LOCATION 0x02 // FIND_SUCCESSOR: id is a file, a cached location may answer / REPLY: it is one
+#define MSG_FLAG_FAILED 0x04 // REPLY to FIND_SUCCESSOR: the lookup failed further along the route
+
 typedef struct {
-    char type[16]; // message type
+    uint8_t type; // message opcode (MessageType)
+    uint8_t flags; // MSG_FLAG_* bits
     uint8_t id[HASH_SIZE]; // ID involved
     char ip[16]; // IP address of the sender
     int port; // port of the sender
     uint32_t request_id; // unique identifier for matching replies
-    uint16_t segment_index; // index of the segment
-    uint16_t total_segments; // total number of segments
+    uint32_t segment_index; // index of the segment
+    uint32_t total_segments; // total number of segments
     size_t data_len; // length of the data (only used for FILE_DATA typed messages)
-    char data[MSG_SIZE - sizeof(char[16]) - sizeof(uint8_t[HASH_SIZE]) - sizeof(char[16]) - sizeof(int) - sizeof(
-                  uint32_t) - sizeof(size_t) - sizeof(uint16_t) - sizeof(uint16_t)]; // message data
+    char data[MSG_SIZE - sizeof(uint8_t) - sizeof(uint8_t) - sizeof(uint8_t[HASH_SIZE]) - sizeof(char[16]) - sizeof(int) - sizeof(
+                  uint32_t) - sizeof(size_t) - sizeof(uint32_t) - sizeof(uint32_t)]; // message data
 } Message;
 
-typedef struct MessageNode {
+// slot of a PendingRequest ring, seq tells whose turn it is (Vyukov's bounded queue)
+typedef struct {
+    atomic_size_t seq;
     Message *msg;
-    struct MessageNode *next;
-} MessageNode;
+} RingSlot;
 
-typedef struct MessageQueue {
-    MessageNode *head;
-    MessageNode *tail;
-    pthread_mutex_t mutex;
+/*
+ * A request waiting for messages carrying its request_id, only its own thread is woken when one arrives.
+ * Messages are handed over through a lock-free ring with many producers (the threads receiving
+ * datagrams) and a single consumer (the thread that registered the request).
+ * Finished entries go back to their queue's pool with their condition variable and an empty ring.
+ */
+typedef struct PendingRequest {
+    uint32_t request_id;
+    atomic_int refs; // the table's reference plus one per thread currently using the entry
+    atomic_bool sleeping; // the consumer is blocked on cond, producers have to signal it
+    atomic_size_t tail; // next position producers claim
+    size_t head; // next position the consumer reads
+    size_t ring_mask; // slots of the ring - 1
     pthread_cond_t cond;
+    struct PendingRequest *next; // next entry in the same bucket, or in the pool
+    RingSlot ring[];
+} PendingRequest;
+
+// table of pending requests keyed by request_id, messages for unregistered requests are dropped
+typedef struct MessageQueue {
+    PendingRequest *buckets[PENDING_BUCKETS];
+    pthread_mutex_t mutex[PENDING_STRIPES]; // bucket i is protected by mutex[i % PENDING_STRIPES]
+    size_t ring_size; // slots of the ring of each request
+    PendingRequest *pool; // finished requests ready for reuse
+    size_t pool_count;
+    pthread_mutex_t pool_mutex;
 } MessageQueue;
 
+/*
+ * On-wire encoding of a Message (all multi-byte fields in network byte order):
+ *
+ *   u8   version (WIRE_VERSION)
+ *   u8   type (MessageType opcode)
+ *   u8   flags
+ *   u8   id[HASH_SIZE]
+ *   u32  sender IPv4 address
+ *   u16  sender port
+ *   u32  request_id
+ *   u32  segment_index
+ *   u32  total_segments
+ *   u16  data_len, followed by data_len bytes of data
+ *
+ * Datagrams are only as large as their payload, so control messages are a few dozen bytes.
+ */
+#define WIRE_HEADER_MAX (1 + 1 + 1 + HASH_SIZE + 4 + 2 + 4 + 4 + 4 + 2)
+#define WIRE_MAX_SIZE (WIRE_HEADER_MAX + sizeof(((Message *) 0)->data))
+
 #include "node.h"
 
-void init_queue(MessageQueue *queue);
+// ring_size is the number of messages a request can hold before new ones are dropped (power of two)
+void init_queue(MessageQueue *queue, size_t ring_size);
+
+// starts accepting messages for request_id, must be called before the request is sent, returns -1 if memory ran out
+int register_request(MessageQueue *queue, uint32_t request_id);
+
+// stops accepting messages for request_id and releases any that were not popped
+void unregister_request(MessageQueue *queue, uint32_t request_id);
 
-void push_message(MessageQueue *queue, const Message *msg);
+/*
+ * Hands a copy of msg to the request it belongs to without allocating: the copy lives in the message pool.
+ * Returns -1 (dropping it) if nobody is waiting for it, the pool is exhausted or the request's ring is full.
+ */
+int push_message(MessageQueue *queue, const Message *msg);
 
+/*
+ * Waits for the next message of a registered request, returns NULL if request_id is not registered.
+ * The message belongs to the message pool and has to be given back with release_message().
+ */
 Message *pop_message(MessageQueue *queue, uint32_t request_id);
 
+// like pop_message, but gives up and returns NULL after timeout_ms milliseconds
+Message *pop_message_timeout(MessageQueue *queue, uint32_t request_id, int timeout_ms);
+
+// returns a printable name for a message opcode
+const char *message_type_name(uint8_t type);
+
+// copies a NUL-terminated string into the message data and sets data_len accordingly
+void set_message_text(Message *msg, const char *text);
+
+// encodes msg into buf, returns the number of bytes written or 0 if buf is too small
+size_t encode_message(const Message *msg, uint8_t *buf, size_t buf_size);
+
+// decodes a datagram into msg, returns 0 on success or -1 if the datagram is malformed
+int decode_message(const uint8_t *buf, size_t len, Message *msg);
+
+// sends msg to ip:port without adding it to the peer table, for replies and other senders that may be strangers
 int send_message(const Node *sender, const char *receiver_ip, int receiver_port, const Message *msg);
 
+// sends msg to a known peer through its resolved address
+int send_to_peer(const Node *sender, const Peer *receiver, const Message *msg);
+
+// sends count messages to the same receiver with as few syscalls as possible, returns the number sent or -1
+int send_messages(const Node *sender, const char *receiver_ip, int receiver_port, const Message *msgs, int count);
+
+// like send_messages, towards a known peer
+int send_messages_to_peer(const Node *sender, const Peer *receiver, const Message *msgs, int count);
+
 int receive_message(const Node *n, Message *msg);
 
+// drains up to max datagrams already queued on the socket without blocking, returns the number decoded or -1
+int receive_messages(const Node *n, Message *msgs, int max);
+
 #endif //PROTOCOL_H
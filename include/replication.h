@@ -0,0 +1,71 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include "file_entry.h"
+
+#define REPLICATE_FLUSH_MS 5 // changes gathered into one REPLICATE message before it goes out
+#define REPLICATE_PUT 1
+#define REPLICATE_REMOVE 2
+#define REPLICATE_RECORD_HEADER (1 + HASH_SIZE) // u8 op + id
+#define REPLICATE_PUT_HEADER (4 + 2 + 2) // owner IPv4 address and port + u16 path_len
+#define REPLICA_RANGES 16 // owners whose ranges are remembered, more than k - 1 while the ring changes
+#define REPLICA_RANGE_TTL_MS 60000 // replicas of a range its owner has not synced or compared for this long are dropped
+
+/*
+ * Every entry of n->files is copied to the next k - 1 successors (k = n->replication), which keep
+ * it in n->replicas and answer FIND_FILE from it. Changes go out as REPLICATE messages, gathered
+ * for REPLICATE_FLUSH_MS so that a batch of stores costs a few datagrams. Each is a series of
+ *
+ *   u8   op (REPLICATE_PUT or REPLICATE_REMOVE)
+ *   u8   id[HASH_SIZE]
+ *   u32  owner IPv4 address, u16 owner port, u16 path_len and path_len bytes of path (puts only)
+ *
+ * A node that becomes one of the k - 1 successors, or missed a REPLICATE, gets the whole of
+ * n->files as a REPLICA_SYNC handoff instead (so do paths too long for a REPLICATE record).
+ * The REPLICA_SYNC carries u8 from[HASH_SIZE], the predecessor of the sender, and the receiver
+ * drops its copies in (from, sender] before taking the new ones.
+ * Once the predecessor changes, the replicas in (predecessor, n] are promoted to n->files:
+ * the entries of a crashed node are still found, on its successor.
+ *
+ * The ranges named by REPLICA_SYNC and by the anti-entropy rounds of the owners are remembered.
+ * Replicas outside (predecessor, n] and outside every range named within REPLICA_RANGE_TTL_MS
+ * belong to nodes that no longer count this one among their k - 1 successors, and are dropped.
+ */
+
+// queues a copy of entry for the replicas, n->files_lock must be held
+void replicate_put(Node *n, const FileEntry *entry);
+
+// queues the removal of id for the replicas, n->files_lock must be held
+void replicate_remove(Node *n, const uint8_t *id);
+
+// encodes a REPLICATE_PUT record of entry into buf, returns its length or 0 if it does not fit in space bytes
+size_t encode_put_record(const FileEntry *entry, uint8_t *buf, size_t space);
+
+/*
+ * Decodes the record at *p and moves *p past it. Returns its op, or 0 at end or on a malformed record.
+ * *id points to the ID of the record, for a put *entry is a new entry for it (NULL if memory ran out).
+ */
+int decode_record(const uint8_t **p, const uint8_t *end, const uint8_t **id, FileEntry **entry);
+
+// handles a REPLICATE message: applies its records to n->replicas
+void apply_replicate(Node *n, const Message *msg);
+
+// starts a REPLICA_SYNC towards every successor that needs the whole of n->files, runs on the loop thread
+void sync_replicas(Node *n);
+
+// handles a REPLICA_SYNC: receives the entries of the sender into n->replicas
+void accept_replica_sync(Node *n, const Message *msg);
+
+// moves the replicas in (n->predecessor, n] to n->files, called once the predecessor changed
+void promote_replicas(Node *n);
+
+// remembers that the owner of (from, to] keeps copies of its entries on this node
+void note_replica_range(const uint8_t *from, const uint8_t *to);
+
+// drops the replicas no range remembered recently covers, called every REPLICA_RANGE_TTL_MS
+void prune_replicas(Node *n);
+
+// stores the nodes holding the copies of n->files (its next k - 1 successors) in targets, returns how many
+int replica_targets(Node *n, Peer **targets);
+
+#endif //REPLICATION_H
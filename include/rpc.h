@@ -0,0 +1,58 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include "node.h"
+
+#define RPC_DEADLINE_MS 5000 // default overall deadline of a request
+#define RPC_MAX_RETRIES 3 // retransmissions before a request times out
+#define RPC_INITIAL_RTO_MS 300 // retransmission timeout towards a peer without RTT samples
+#define RPC_MIN_RTO_MS 10
+#define RPC_MAX_RTO_MS 3000
+#define RPC_REPLY_CACHE 256 // recent replies kept to answer retransmitted requests
+#define RPC_ASYNC_BUCKETS 256 // hash buckets of the in-flight asynchronous calls (power of two)
+
+typedef enum {
+    RPC_OK = 0,
+    RPC_TIMEOUT = -1, // no reply before the deadline, even after retransmissions
+    RPC_SEND_FAILED = -2
+} RpcStatus;
+
+/*
+ * Sends request to ip:port and waits for its first REPLY. The request is retransmitted
+ * whenever the RTT-based timeout of the peer expires, at most RPC_MAX_RETRIES times
+ * and never past deadline_ms. On RPC_OK *response must be given back with release_message().
+ */
+RpcStatus rpc_call(const Node *n, const char *ip, int port, const Message *request, Message **response,
+                   int deadline_ms);
+
+// like rpc_call, but the request stays registered so further replies can be read with rpc_wait
+RpcStatus rpc_call_open(const Node *n, const char *ip, int port, const Message *request, Message **response,
+                        int deadline_ms);
+
+// waits for another reply of a request started with rpc_call_open
+RpcStatus rpc_wait(uint32_t request_id, Message **response, int timeout_ms);
+
+// ends a request started with rpc_call_open
+void rpc_close(uint32_t request_id);
+
+// completion of rpc_call_async, response is only valid during the call (NULL unless status is RPC_OK)
+typedef void (*RpcCallback)(Node *n, RpcStatus status, const Message *response, void *arg);
+
+/*
+ * Like rpc_call, but returns right away: retransmissions are driven by event loop timers and cb
+ * runs on the loop thread once the first reply arrives or the deadline passes, so it must not block.
+ * cb is called exactly once, unless RPC_SEND_FAILED is returned because the call could not be started.
+ */
+RpcStatus rpc_call_async(Node *n, const char *ip, int port, const Message *request, int deadline_ms, RpcCallback cb,
+                         void *arg);
+
+// completes the asynchronous call reply belongs to, returns false if it is not the reply to one
+bool rpc_complete(Node *n, const Message *reply);
+
+// sends response to the sender of request and remembers it in case the request is retransmitted
+int send_reply(const Node *n, const Message *request, const Message *response);
+
+// re-sends the remembered reply if request is a retransmission, returns true if it was
+bool resend_reply(const Node *n, const Message *request);
+
+#endif //RPC_H
@@ -2,6 +2,10 @@
 #define STABILIZATION_H
 
 #include "node.h"
+#include "file_entry.h"
+
+#define SUCCESSOR_ENTRY_SIZE 6 // u32 IPv4 + u16 port of a successor list entry in a STABILIZE reply
+#define LOOKUP_MIN_HOP_MS 100 // a lookup left with less time than this fails instead of asking another hop
 
 void create_ring(Node *n);
 
@@ -9,16 +13,59 @@ void join_ring(Node *n, const char *existing_ip, int existing_port);
 
 void stabilize(Node *n);
 
-void notify(Node *n, Node *n_prime);
+// makes successor the first entry of the successor list (it lies between n and the current first one)
+void set_successor(Node *n, Peer *successor);
+
+// drops a node that stopped answering from the successor list and the fingers, failing over to the next entry
+void node_failed(Node *n, Peer *dead);
+
+// returns the predecessor of n, NULL if unknown, read under ring_lock
+Peer *get_predecessor(Node *n);
 
-void fix_fingers(Node *n, int *next);
+// writes the successor list of n into buf for a STABILIZE reply, returns the bytes written
+size_t encode_successor_list(Node *n, uint8_t *buf, size_t size);
+
+// tells the successor that n might be its predecessor
+void notify(const Node *n, const Peer *successor);
 
 void check_predecessor(Node *n);
 
-Node *find_successor(Node *n, const uint8_t *id);
+/*
+ * Finds the node responsible for id, returns NULL if the lookup failed. A hop that does not answer
+ * is dropped with node_failed and the lookup retried around it. A FIND_SUCCESSOR carries u32 budget_ms,
+ * how long the requester waits for the reply (RPC_DEADLINE_MS if absent). The hop continues the lookup
+ * within three quarters of it and replies with MSG_FLAG_FAILED if that fails, so it is not taken for dead
+ * because of a dead node further along the route.
+ */
+Peer *find_successor(Node *n, const uint8_t *id);
+
+// like find_successor, giving up once budget_ms have passed
+Peer *find_successor_within(Node *n, const uint8_t *id, uint32_t budget_ms);
+
+// outcome of lookup_file
+typedef struct {
+    bool hit; // a cached location answered the lookup, found holds it
+    FileInfo found;
+    Peer *replicas[SUCCESSOR_LIST_SIZE]; // nodes holding the entry of the file, the responsible one first
+    int replica_count; // 0 if the lookup timed out
+} FileLookup;
+
+/*
+ * Like find_successor for the ID of a file, but the lookup stops at the first node on its path
+ * (this one included) that has the location of the file cached, and it returns the replicas of
+ * the entry as known to the node preceding them: the responsible node and its next k - 1 successors.
+ * Hot keys are pushed to the nodes preceding them, so their lookups end there.
+ */
+void lookup_file(Node *n, const uint8_t *id, FileLookup *result);
+
+// like lookup_file, giving up once budget_ms have passed
+void lookup_file_within(Node *n, const uint8_t *id, FileLookup *result, uint32_t budget_ms);
+
+// encodes the replicas of result after the responsible node (SUCCESSOR_ENTRY_SIZE each) into buf, returns the length
+size_t encode_replicas(const FileLookup *result, uint8_t *buf, size_t size);
 
-Node *find_successor_remote(const Node *n, const Node *n0, const uint8_t *id);
+Peer *find_successor_remote(const Node *n, const Peer *n0, const uint8_t *id);
 
-Node *closest_preceding_node(Node *n, const uint8_t *id);
+Peer *closest_preceding_node(const Node *n, const uint8_t *id);
 
 #endif //STABILIZATION_H
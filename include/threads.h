@@ -5,10 +5,10 @@
 
 extern MessageQueue reply_queue;
 extern MessageQueue download_queue;
+extern MessageQueue ack_queue;
 
-void *node_thread(void *arg);
-
-void *listener_thread(void *arg);
+// receives datagrams and runs timers (maintenance, RPC retransmissions) on the event loop
+void *event_loop_thread(void *arg);
 
 void handle_user_commands(Node *node);
 
@@ -0,0 +1,56 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "file_entry.h"
+#include <stdbool.h>
+
+#define TRANSFER_INITIAL_WINDOW 16 // segments in flight when a transfer starts
+#define TRANSFER_MAX_WINDOW 8192 // upper bound of the congestion window (segments)
+#define TRANSFER_ACK_EVERY 16 // the receiver acknowledges at least every N new segments
+#define TRANSFER_REORDER_THRESHOLD 3 // a segment is lost once this many later transmissions were acknowledged
+#define TRANSFER_INITIAL_RTO_MS 200 // retransmission timeout before the first RTT sample
+#define TRANSFER_MIN_RTO_MS 5
+#define TRANSFER_MAX_RTO_MS 2000
+#define TRANSFER_IDLE_MS 250 // receiver re-sends its ACK after this long without data
+#define TRANSFER_MAX_TIMEOUTS 8 // consecutive timeouts before either side gives up
+#define STREAM_THRESHOLD (1024 * 1024) // files at least this large go over a TCP data channel when possible
+#define STREAM_ACCEPT_TIMEOUT_MS 5000 // how long the owner waits for the requester to connect
+#define STREAM_CHUNK (1024 * 1024) // bytes moved per sendfile/splice call
+
+/*
+ * FILE_ACK payload (network byte order):
+ *
+ *   u32  cumulative: every segment below this index was received
+ *   u32  echo: index of the segment that triggered this ACK (used for RTT samples)
+ *   ...  bitmap: bit i set if segment cumulative + 1 + i was received
+ *
+ * Unset bits below the highest set bit act as selective NACKs.
+ */
+#define TRANSFER_ACK_HEADER 8
+
+/*
+ * Starts streaming the file of file_entry to the sender of request on a dedicated thread.
+ * The "Starting download" reply is sent before returning: if the requester set MSG_FLAG_STREAM
+ * and the file is large enough, the reply carries MSG_FLAG_STREAM and the port of a TCP data
+ * channel the file is sent over with sendfile(), otherwise it carries total_segments of a
+ * datagram transfer.
+ * Returns 0 if the transfer was started, -1 if the file could not be opened.
+ */
+int start_file_transfer(Node *n, const Message *request, const FileInfo *file_entry);
+
+/*
+ * Receives total_segments segments of request_id into fd, acknowledging them
+ * to the sender so that only missing segments get retransmitted.
+ * received_segments must hold total_segments entries, all false.
+ */
+int receive_file_transfer(const Node *n, const char *sender_ip, int sender_port, uint32_t request_id,
+                          uint32_t total_segments, bool *received_segments, int fd);
+
+/*
+ * Connects to the TCP data channel announced by a MSG_FLAG_STREAM reply and moves the
+ * stream into fd with splice() (or plain reads where splice is not supported).
+ * The stream starts with the file size as a u64 in network byte order.
+ */
+int receive_stream_transfer(const char *owner_ip, int data_port, int fd);
+
+#endif //TRANSFER_H
@@ -0,0 +1,16 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "node.h"
+
+#define CONTROL_WORKERS 4 // default threads running control-plane handlers (lookups, stabilization, ...)
+#define BULK_WORKERS 2 // default threads running handlers that move file data
+#define WORKER_QUEUE_SIZE 1024 // messages a pool can hold before new ones are dropped
+
+// starts the control and bulk worker pools, returns -1 if a thread could not be created
+int start_workers(Node *n, int control_workers, int bulk_workers);
+
+// queues msg for the pool serving its handler class, returns -1 (dropping it) if that pool is full
+int submit_message(HandlerClass handler_class, const Message *msg);
+
+#endif //WORKERS_H
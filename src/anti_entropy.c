@@ -0,0 +1,564 @@
+#include "anti_entropy.h"
+#include "event_loop.h"
+#include "file_entry.h"
+#include "message_pool.h"
+#include "metadata_store.h"
+#include "replication.h"
+#include "rpc.h"
+#include "sha1.h"
+#include "stabilization.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RANGE_HEADER (2 * HASH_SIZE) // u8 from[HASH_SIZE] + u8 to[HASH_SIZE]
+#define SUBTREE_SIZE (1 + HASH_SIZE) // u8 nibbles + u8 prefix[HASH_SIZE]
+#define CHILD_SIZE (8 + 4) // u64 digest + u32 count
+#define ENTRY_DIGEST_SIZE (HASH_SIZE + 8) // u8 id[HASH_SIZE] + u64 digest
+#define MESSAGE_DATA sizeof(((Message *) 0)->data)
+#define DIGEST_BATCH (MESSAGE_DATA / (MERKLE_FANOUT * CHILD_SIZE)) // subtrees per SYNC_DIGEST
+
+// the IDs below the first nibbles nibbles of prefix
+typedef struct {
+    uint8_t prefix[HASH_SIZE];
+    int nibbles;
+} Subtree;
+
+// a range whose entries may have been lost on their way to this node
+typedef struct {
+    uint8_t from[HASH_SIZE];
+    uint8_t to[HASH_SIZE];
+    uint64_t noted_us; // 0 for an unused slot
+} IncompleteHandoff;
+
+static IncompleteHandoff handoffs[INCOMPLETE_HANDOFFS];
+static size_t next_handoff;
+static pthread_mutex_t handoffs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_bool round_running;
+static atomic_ulong rounds;
+static atomic_ulong subtrees;
+static atomic_ulong repaired;
+
+static void put_u64(uint8_t *p, const uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t) (value >> (56 - 8 * i));
+    }
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+void note_incomplete_handoff(const uint8_t *from, const uint8_t *to) {
+    pthread_mutex_lock(&handoffs_lock);
+    IncompleteHandoff *handoff = &handoffs[next_handoff++ % INCOMPLETE_HANDOFFS];
+    memcpy(handoff->from, from, HASH_SIZE);
+    memcpy(handoff->to, to, HASH_SIZE);
+    handoff->noted_us = monotonic_us();
+    pthread_mutex_unlock(&handoffs_lock);
+}
+
+// tells whether id lies in the range of a handoff that ended early
+static bool lost_in_handoff(const uint8_t *id) {
+    bool found = false;
+    pthread_mutex_lock(&handoffs_lock);
+    for (size_t i = 0; i < INCOMPLETE_HANDOFFS && !found; i++) {
+        found = handoffs[i].noted_us != 0 && is_in_half_open_interval(id, handoffs[i].from, handoffs[i].to);
+    }
+    pthread_mutex_unlock(&handoffs_lock);
+    return found;
+}
+
+// forgets the handoffs noted before since_us, a round started then has settled their ranges
+static void settle_handoffs(const uint64_t since_us) {
+    pthread_mutex_lock(&handoffs_lock);
+    for (size_t i = 0; i < INCOMPLETE_HANDOFFS; i++) {
+        if (handoffs[i].noted_us < since_us) {
+            handoffs[i].noted_us = 0;
+        }
+    }
+    pthread_mutex_unlock(&handoffs_lock);
+}
+
+static void set_nibble(uint8_t *id, const int i, const uint8_t value) {
+    if (i % 2 == 0) {
+        id[i / 2] = (uint8_t) ((id[i / 2] & 0x0f) | value << 4);
+    } else {
+        id[i / 2] = (uint8_t) ((id[i / 2] & 0xf0) | value);
+    }
+}
+
+// stores the lowest and the highest ID of subtree in lo and hi
+static void subtree_span(const uint8_t *prefix, const int nibbles, uint8_t *lo, uint8_t *hi) {
+    memcpy(lo, prefix, HASH_SIZE);
+    memcpy(hi, prefix, HASH_SIZE);
+    for (int i = nibbles; i < MERKLE_MAX_NIBBLES; i++) {
+        set_nibble(lo, i, 0x0);
+        set_nibble(hi, i, 0xf);
+    }
+}
+
+typedef enum {
+    SPAN_OUTSIDE,
+    SPAN_PARTIAL,
+    SPAN_INSIDE,
+} Overlap;
+
+// tells how the linear interval [lo, hi] lies relative to the ring interval (from, to], the whole ring if from == to
+static Overlap overlap(const uint8_t *lo, const uint8_t *hi, const uint8_t *from, const uint8_t *to) {
+    if (memcmp(from, to, HASH_SIZE) == 0) {
+        return SPAN_INSIDE;
+    }
+    const bool lo_in = is_in_half_open_interval(lo, from, to);
+    const bool hi_in = is_in_half_open_interval(hi, from, to);
+    // with both ends on the same side, the span still crosses the ring interval if one of its ends lies in it
+    const bool from_in = memcmp(lo, from, HASH_SIZE) <= 0 && memcmp(from, hi, HASH_SIZE) < 0;
+    const bool to_in = memcmp(lo, to, HASH_SIZE) <= 0 && memcmp(to, hi, HASH_SIZE) <= 0;
+    if (lo_in && hi_in && !from_in) {
+        return SPAN_INSIDE;
+    }
+    if (!lo_in && !hi_in && !to_in) {
+        return SPAN_OUTSIDE;
+    }
+    return SPAN_PARTIAL;
+}
+
+typedef struct {
+    const uint8_t *from;
+    const uint8_t *to;
+    MerkleNode *node;
+} Accumulator;
+
+static void accumulate(FileEntry *entry, void *arg) {
+    const Accumulator *acc = (const Accumulator *) arg;
+    if (is_in_half_open_interval(entry->id, acc->from, acc->to)) {
+        acc->node->digest ^= merkle_entry_digest(entry);
+        acc->node->count++;
+    }
+}
+
+// computes the digest of the entries of t in subtree that lie in (from, to]
+static void subtree_digest(const FileTable *t, const uint8_t *from, const uint8_t *to, const uint8_t *prefix,
+                           const int nibbles, MerkleNode *out) {
+    uint8_t lo[HASH_SIZE], hi[HASH_SIZE];
+    subtree_span(prefix, nibbles, lo, hi);
+    memset(out, 0, sizeof(MerkleNode));
+
+    const Overlap o = overlap(lo, hi, from, to);
+    if (o == SPAN_OUTSIDE) {
+        return;
+    }
+    // the levels kept by the table answer at once, the others cost a walk over the entries below
+    if (o == SPAN_INSIDE && nibbles >= 1 && nibbles <= MERKLE_LEVELS) {
+        *out = *merkle_node(&t->tree, prefix, nibbles);
+        return;
+    }
+    Accumulator acc = {from, to, out};
+    file_table_visit(t, lo, hi, accumulate, &acc);
+}
+
+// computes the digests of the MERKLE_FANOUT children of subtree, n->files_lock must be held
+static void child_digests(const FileTable *t, const uint8_t *from, const uint8_t *to, const uint8_t *prefix,
+                          const int nibbles, MerkleNode *children) {
+    uint8_t child[HASH_SIZE];
+    memcpy(child, prefix, HASH_SIZE);
+    for (int c = 0; c < MERKLE_FANOUT; c++) {
+        set_nibble(child, nibbles, (uint8_t) c);
+        subtree_digest(t, from, to, child, nibbles + 1, &children[c]);
+    }
+}
+
+static void init_request(const Node *n, Message *msg, const uint8_t type) {
+    memset(msg, 0, sizeof(Message));
+    msg->request_id = generate_id();
+    msg->type = type;
+    memcpy(msg->id, n->id, HASH_SIZE);
+    strcpy(msg->ip, n->ip);
+    msg->port = n->port;
+}
+
+void answer_sync_digest(Node *n, const Message *msg) {
+    const uint8_t *data = (const uint8_t *) msg->data;
+    const size_t count = msg->data_len >= RANGE_HEADER ? (msg->data_len - RANGE_HEADER) / SUBTREE_SIZE : 0;
+
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    memcpy(response.id, n->id, HASH_SIZE);
+    uint8_t *out = (uint8_t *) response.data;
+    if (msg->data_len >= RANGE_HEADER) {
+        note_replica_range(data, data + HASH_SIZE);
+    }
+
+    pthread_mutex_lock(&n->files_lock);
+    for (size_t i = 0; i < count && i < DIGEST_BATCH; i++) {
+        const uint8_t *subtree = data + RANGE_HEADER + i * SUBTREE_SIZE;
+        MerkleNode children[MERKLE_FANOUT] = {0};
+        if (subtree[0] < MERKLE_MAX_NIBBLES) {
+            child_digests(&n->replicas, data, data + HASH_SIZE, subtree + 1, subtree[0], children);
+        }
+        for (int c = 0; c < MERKLE_FANOUT; c++) {
+            const uint32_t entries = htonl(children[c].count);
+            put_u64(out, children[c].digest);
+            memcpy(out + 8, &entries, 4);
+            out += CHILD_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&n->files_lock);
+
+    response.data_len = out - (uint8_t *) response.data;
+    send_reply(n, msg, &response);
+}
+
+typedef struct {
+    const uint8_t *from;
+    const uint8_t *to;
+    const uint8_t *theirs; // IDs and digests of the requester
+    size_t their_count;
+    uint8_t *out;
+    const uint8_t *end;
+} ExtraCollector;
+
+// appends entry to the reply unless the requester listed it
+static void collect_extra(FileEntry *entry, void *arg) {
+    ExtraCollector *c = (ExtraCollector *) arg;
+    if (!is_in_half_open_interval(entry->id, c->from, c->to)) {
+        return;
+    }
+    for (size_t i = 0; i < c->their_count; i++) {
+        if (memcmp(c->theirs + i * ENTRY_DIGEST_SIZE, entry->id, HASH_SIZE) == 0) {
+            return;
+        }
+    }
+    // what does not fit is reported by the next round
+    c->out += encode_put_record(entry, c->out, c->end - c->out);
+}
+
+void answer_sync_entries(Node *n, const Message *msg) {
+    const uint8_t *data = (const uint8_t *) msg->data;
+    const uint8_t *subtree = data + RANGE_HEADER;
+    const uint8_t *theirs = subtree + SUBTREE_SIZE + 2;
+
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    memcpy(response.id, n->id, HASH_SIZE);
+
+    uint16_t count = 0;
+    if (msg->data_len >= RANGE_HEADER + SUBTREE_SIZE + 2) {
+        memcpy(&count, subtree + SUBTREE_SIZE, 2);
+        count = ntohs(count);
+    }
+    if (count > SYNC_LEAF_MAX ||
+        msg->data_len < (size_t) RANGE_HEADER + SUBTREE_SIZE + 2 + (size_t) count * ENTRY_DIGEST_SIZE ||
+        subtree[0] > MERKLE_MAX_NIBBLES) {
+        send_reply(n, msg, &response); // malformed, the empty reply ends the comparison of this subtree
+        return;
+    }
+
+    uint8_t *out = (uint8_t *) response.data + 2;
+    uint16_t wanted = 0;
+    uint8_t lo[HASH_SIZE], hi[HASH_SIZE];
+    subtree_span(subtree + 1, subtree[0], lo, hi);
+
+    pthread_mutex_lock(&n->files_lock);
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *id = theirs + i * ENTRY_DIGEST_SIZE;
+        const FileEntry *entry = file_table_find(&n->replicas, id);
+        if (entry == NULL || merkle_entry_digest(entry) != get_u64(id + HASH_SIZE)) {
+            memcpy(out, id, HASH_SIZE);
+            out += HASH_SIZE;
+            wanted++;
+        }
+    }
+    ExtraCollector extras = {data, data + HASH_SIZE, theirs, count, out, (uint8_t *) response.data + MESSAGE_DATA};
+    file_table_visit(&n->replicas, lo, hi, collect_extra, &extras);
+    pthread_mutex_unlock(&n->files_lock);
+
+    wanted = htons(wanted);
+    memcpy(response.data, &wanted, 2);
+    response.data_len = extras.out - (uint8_t *) response.data;
+    send_reply(n, msg, &response);
+}
+
+// REPLICATE messages gathered while n->files_lock is held, sent once it is released
+typedef struct {
+    Message *messages;
+    size_t count;
+} Outgoing;
+
+static void add_record(const Node *n, Outgoing *outgoing, const uint8_t *record, const size_t len) {
+    Message *last = outgoing->count > 0 ? &outgoing->messages[outgoing->count - 1] : NULL;
+    if (last == NULL || last->data_len + len > MESSAGE_DATA) {
+        Message *messages = (Message *) realloc(outgoing->messages, (outgoing->count + 1) * sizeof(Message));
+        if (messages == NULL) {
+            perror("realloc");
+            return;
+        }
+        outgoing->messages = messages;
+        last = &messages[outgoing->count++];
+        init_request(n, last, MSG_REPLICATE);
+    }
+    memcpy(last->data + last->data_len, record, len);
+    last->data_len += len;
+}
+
+// sends the gathered REPLICATE messages to target, returns -1 if it stopped answering
+static int send_outgoing(const Node *n, const Peer *target, Outgoing *outgoing) {
+    int result = 0;
+    for (size_t i = 0; i < outgoing->count && result == 0; i++) {
+        Message *response = NULL;
+        if (rpc_call(n, target->ip, target->port, &outgoing->messages[i], &response, RPC_DEADLINE_MS) != RPC_OK) {
+            result = -1;
+            continue;
+        }
+        release_message(response);
+    }
+    free(outgoing->messages);
+    return result;
+}
+
+typedef struct {
+    const uint8_t *from;
+    const uint8_t *to;
+    uint8_t *out;
+    size_t count;
+} DigestCollector;
+
+static void collect_digest(FileEntry *entry, void *arg) {
+    DigestCollector *c = (DigestCollector *) arg;
+    if (c->count == SYNC_LEAF_MAX || !is_in_half_open_interval(entry->id, c->from, c->to)) {
+        return;
+    }
+    memcpy(c->out, entry->id, HASH_SIZE);
+    put_u64(c->out + HASH_SIZE, merkle_entry_digest(entry));
+    c->out += ENTRY_DIGEST_SIZE;
+    c->count++;
+}
+
+// settles a differing subtree entry by entry, returns -1 if target stopped answering
+static int repair_subtree(Node *n, const Peer *target, const uint8_t *from, const uint8_t *to,
+                          const Subtree *subtree) {
+    Message msg;
+    init_request(n, &msg, MSG_SYNC_ENTRIES);
+    uint8_t *p = (uint8_t *) msg.data;
+    memcpy(p, from, HASH_SIZE);
+    memcpy(p + HASH_SIZE, to, HASH_SIZE);
+    p[RANGE_HEADER] = (uint8_t) subtree->nibbles;
+    memcpy(p + RANGE_HEADER + 1, subtree->prefix, HASH_SIZE);
+
+    uint8_t lo[HASH_SIZE], hi[HASH_SIZE];
+    subtree_span(subtree->prefix, subtree->nibbles, lo, hi);
+    DigestCollector ours = {from, to, p + RANGE_HEADER + SUBTREE_SIZE + 2, 0};
+    pthread_mutex_lock(&n->files_lock);
+    file_table_visit(&n->files, lo, hi, collect_digest, &ours);
+    pthread_mutex_unlock(&n->files_lock);
+    const uint16_t count = htons((uint16_t) ours.count);
+    memcpy(p + RANGE_HEADER + SUBTREE_SIZE, &count, 2);
+    msg.data_len = ours.out - p;
+
+    Message *response = NULL;
+    if (rpc_call(n, target->ip, target->port, &msg, &response, RPC_DEADLINE_MS) != RPC_OK) {
+        return -1;
+    }
+    const uint8_t *q = (const uint8_t *) response->data;
+    const uint8_t *end = q + response->data_len;
+    uint16_t wanted = 0;
+    if (response->data_len >= 2) {
+        memcpy(&wanted, q, 2);
+        wanted = ntohs(wanted);
+    }
+    if (response->data_len < 2 + (size_t) wanted * HASH_SIZE) {
+        release_message(response);
+        return 0;
+    }
+
+    Outgoing outgoing = {NULL, 0};
+    uint8_t record[MESSAGE_DATA];
+    unsigned long fixed = 0, adopted = 0;
+    pthread_mutex_lock(&n->files_lock);
+    // entries the replica lacks or holds differently
+    for (uint16_t i = 0; i < wanted; i++) {
+        const FileEntry *entry = file_table_find(&n->files, q + 2 + i * HASH_SIZE);
+        const size_t len = entry != NULL ? encode_put_record(entry, record, sizeof(record)) : 0;
+        if (len > 0) {
+            add_record(n, &outgoing, record, len);
+            fixed++;
+        }
+    }
+
+    // entries only the replica holds: deleted here, unless they were lost on the way to this node
+    q += 2 + wanted * HASH_SIZE;
+    const uint8_t *id;
+    FileEntry *entry;
+    int op;
+    while ((op = decode_record(&q, end, &id, &entry)) != 0) {
+        if (entry == NULL) {
+            continue;
+        }
+        if (!is_in_half_open_interval(id, from, to) || file_table_find(&n->files, id) != NULL) {
+            free(entry); // changed since the request, this node's copy wins
+            continue;
+        }
+        if (!lost_in_handoff(id)) {
+            record[0] = REPLICATE_REMOVE;
+            memcpy(record + 1, id, HASH_SIZE);
+            add_record(n, &outgoing, record, REPLICATE_RECORD_HEADER);
+            free(entry);
+            fixed++;
+            continue;
+        }
+        if (file_table_remove(&n->replicas, id) == 0) {
+            metadata_store_remove(n->store, STORE_REPLICAS, id);
+        }
+        if (file_table_insert(&n->files, entry) < 0) {
+            free(entry);
+            continue;
+        }
+        metadata_store_put(n->store, STORE_FILES, entry);
+        replicate_put(n, entry);
+        adopted++;
+    }
+    pthread_mutex_unlock(&n->files_lock);
+    release_message(response);
+
+    if (adopted > 0) {
+        printf("Took back %lu entries that only a replica still held\n", adopted);
+    }
+    atomic_fetch_add(&repaired, fixed + adopted);
+    return send_outgoing(n, target, &outgoing);
+}
+
+/*
+ * Compares the entries of n->files in (from, to] with their copies on target.
+ * Returns -1 if it stopped answering, 1 if differing subtrees were left for the next round.
+ */
+static int sync_with(Node *n, const Peer *target, const uint8_t *from, const uint8_t *to) {
+    Subtree *queue = (Subtree *) malloc(ANTI_ENTROPY_MAX_SUBTREES * sizeof(Subtree));
+    if (queue == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    size_t head = 0, tail = 0;
+    memset(&queue[tail++], 0, sizeof(Subtree)); // the root, all IDs
+
+    int result = 0;
+    bool skipped = false;
+    while (head < tail && result == 0) {
+        const size_t batch = tail - head < DIGEST_BATCH ? tail - head : DIGEST_BATCH;
+        Message msg;
+        init_request(n, &msg, MSG_SYNC_DIGEST);
+        uint8_t *p = (uint8_t *) msg.data;
+        memcpy(p, from, HASH_SIZE);
+        memcpy(p + HASH_SIZE, to, HASH_SIZE);
+        for (size_t i = 0; i < batch; i++) {
+            p[RANGE_HEADER + i * SUBTREE_SIZE] = (uint8_t) queue[head + i].nibbles;
+            memcpy(p + RANGE_HEADER + i * SUBTREE_SIZE + 1, queue[head + i].prefix, HASH_SIZE);
+        }
+        msg.data_len = RANGE_HEADER + batch * SUBTREE_SIZE;
+
+        Message *response = NULL;
+        if (rpc_call(n, target->ip, target->port, &msg, &response, RPC_DEADLINE_MS) != RPC_OK) {
+            result = -1;
+            break;
+        }
+        if (response->data_len != batch * MERKLE_FANOUT * CHILD_SIZE) {
+            release_message(response);
+            result = -1;
+            break;
+        }
+
+        MerkleNode ours[DIGEST_BATCH][MERKLE_FANOUT];
+        pthread_mutex_lock(&n->files_lock);
+        for (size_t i = 0; i < batch; i++) {
+            child_digests(&n->files, from, to, queue[head + i].prefix, queue[head + i].nibbles, ours[i]);
+        }
+        pthread_mutex_unlock(&n->files_lock);
+
+        for (size_t i = 0; i < batch && result == 0; i++) {
+            const Subtree *parent = &queue[head + i];
+            const uint8_t *theirs = (const uint8_t *) response->data + i * MERKLE_FANOUT * CHILD_SIZE;
+            atomic_fetch_add(&subtrees, 1);
+            for (int c = 0; c < MERKLE_FANOUT && result == 0; c++) {
+                uint32_t count;
+                memcpy(&count, theirs + c * CHILD_SIZE + 8, 4);
+                count = ntohl(count);
+                if (get_u64(theirs + c * CHILD_SIZE) == ours[i][c].digest && count == ours[i][c].count) {
+                    continue;
+                }
+
+                Subtree child = *parent;
+                set_nibble(child.prefix, parent->nibbles, (uint8_t) c);
+                child.nibbles++;
+                if (child.nibbles == MERKLE_MAX_NIBBLES || (count <= SYNC_LEAF_MAX && ours[i][c].count <= SYNC_LEAF_MAX)) {
+                    result = repair_subtree(n, target, from, to, &child);
+                } else if (tail < ANTI_ENTROPY_MAX_SUBTREES) {
+                    queue[tail++] = child;
+                } else {
+                    skipped = true;
+                }
+            }
+        }
+        release_message(response);
+        head += batch;
+    }
+    free(queue);
+    return result == 0 && skipped ? 1 : result;
+}
+
+static void *round_thread(void *arg) {
+    Node *n = (Node *) arg;
+    const Peer *predecessor = get_predecessor(n);
+    if (predecessor != NULL && predecessor != n->self) {
+        const uint64_t started_us = monotonic_us();
+        uint8_t from[HASH_SIZE];
+        memcpy(from, predecessor->id, HASH_SIZE);
+        Peer *targets[SUCCESSOR_LIST_SIZE];
+        const int count = replica_targets(n, targets);
+        // a target that stops answering is left to failure detection, the others are still compared
+        bool settled = count > 0;
+        for (int i = 0; i < count; i++) {
+            settled &= sync_with(n, targets[i], from, n->id) == 0;
+        }
+        if (settled) {
+            settle_handoffs(started_us);
+        }
+        atomic_fetch_add(&rounds, 1);
+    }
+    atomic_store(&round_running, false);
+    return NULL;
+}
+
+static void anti_entropy_tick(void *arg) {
+    Node *n = (Node *) arg;
+    // the comparison blocks on round trips, it runs on its own thread and a slow one is not overlapped
+    if (!atomic_exchange(&round_running, true)) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, round_thread, n) != 0) {
+            perror("pthread_create");
+            atomic_store(&round_running, false);
+        } else {
+            pthread_detach(tid);
+        }
+    }
+    add_timer(ANTI_ENTROPY_INTERVAL_MS, anti_entropy_tick, n);
+}
+
+void start_anti_entropy(Node *n) {
+    add_timer(ANTI_ENTROPY_INTERVAL_MS, anti_entropy_tick, n);
+}
+
+void get_anti_entropy_stats(AntiEntropyStats *stats) {
+    stats->rounds = atomic_load(&rounds);
+    stats->subtrees = atomic_load(&subtrees);
+    stats->repaired = atomic_load(&repaired);
+}
@@ -0,0 +1,605 @@
+#define _GNU_SOURCE // nftw
+#include "bulk.h"
+#include "metadata_store.h"
+#include "stabilization.h"
+#include "rpc.h"
+#include "sha1.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STORE_RECORD_HEADER (HASH_SIZE + 2) // id + u16 path_len
+#define FOUND_RECORD_HEADER (1 + 4 + 2 + 2) // found + owner address and port + u16 path_len
+
+typedef struct {
+    uint8_t id[HASH_SIZE];
+    char *name; // filepath for stores (hashed by its last component), filename for lookups
+} Key;
+
+typedef struct {
+    Key *keys;
+    size_t count;
+    size_t capacity;
+} KeyList;
+
+// state shared by the batches of one bulk operation
+typedef struct Bulk {
+    Node *node;
+    Key *keys; // sorted by ID
+    FindCallback cb; // lookups only
+    void *cb_arg;
+    pthread_mutex_t lock; // protects the fields below and serializes the calls to cb
+    pthread_cond_t done;
+    int in_flight;
+    size_t succeeded; // files stored or found
+    size_t failed;
+} Bulk;
+
+// a batched request for keys[first, first + count)
+typedef struct {
+    Bulk *bulk;
+    const Peer *responsible;
+    size_t first;
+    size_t count;
+} Batch;
+
+// handles keys[first, last), all belonging to responsible (NULL if the lookup failed)
+typedef void (*RunHandler)(Bulk *bulk, const Peer *responsible, size_t first, size_t last);
+
+typedef struct {
+    Key *keys;
+    size_t first;
+    size_t last;
+} HashRange;
+
+static void *hash_range(void *arg) {
+    const HashRange *range = (const HashRange *) arg;
+    for (size_t i = range->first; i < range->last; i++) {
+        const char *name = strrchr(range->keys[i].name, '/');
+        hash(name != NULL ? name + 1 : range->keys[i].name, range->keys[i].id);
+    }
+    return NULL;
+}
+
+// hashes the names of keys, on several threads if there are many
+static void hash_names(Key *keys, const size_t count) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > BULK_HASH_THREADS) {
+        threads = BULK_HASH_THREADS;
+    }
+    if (count < BULK_HASH_PARALLEL_MIN || threads < 2) {
+        const HashRange all = {keys, 0, count};
+        hash_range((void *) &all);
+        return;
+    }
+
+    pthread_t tids[BULK_HASH_THREADS];
+    HashRange ranges[BULK_HASH_THREADS];
+    long started = 0;
+    for (long t = 0; t < threads; t++) {
+        ranges[t] = (HashRange){keys, count * t / threads, count * (t + 1) / threads};
+        if (pthread_create(&tids[started], NULL, hash_range, &ranges[t]) != 0) {
+            hash_range(&ranges[t]); // hash it here instead
+        } else {
+            started++;
+        }
+    }
+    for (long t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+}
+
+static int compare_ids(const void *a, const void *b) {
+    return memcmp(((const Key *) a)->id, ((const Key *) b)->id, HASH_SIZE);
+}
+
+static void bulk_init(Bulk *bulk, Node *n, Key *keys, const size_t count) {
+    memset(bulk, 0, sizeof(Bulk));
+    bulk->node = n;
+    bulk->keys = keys;
+    pthread_mutex_init(&bulk->lock, NULL);
+    pthread_cond_init(&bulk->done, NULL);
+    hash_names(keys, count);
+    qsort(keys, count, sizeof(Key), compare_ids);
+}
+
+// waits until fewer than limit batches are in flight
+static void wait_in_flight(Bulk *bulk, const int limit) {
+    pthread_mutex_lock(&bulk->lock);
+    while (bulk->in_flight >= limit) {
+        pthread_cond_wait(&bulk->done, &bulk->lock);
+    }
+    pthread_mutex_unlock(&bulk->lock);
+}
+
+// waits for the batches still in flight
+static void bulk_finish(Bulk *bulk) {
+    wait_in_flight(bulk, 1);
+    pthread_mutex_destroy(&bulk->lock);
+    pthread_cond_destroy(&bulk->done);
+}
+
+// adds results of keys that are not part of a batch in flight
+static void add_results(Bulk *bulk, const size_t succeeded, const size_t failed) {
+    pthread_mutex_lock(&bulk->lock);
+    bulk->succeeded += succeeded;
+    bulk->failed += failed;
+    pthread_mutex_unlock(&bulk->lock);
+}
+
+// waits for a free slot in the window and takes it
+static void start_batch(Bulk *bulk) {
+    pthread_mutex_lock(&bulk->lock);
+    while (bulk->in_flight >= BULK_WINDOW) {
+        pthread_cond_wait(&bulk->done, &bulk->lock);
+    }
+    bulk->in_flight++;
+    pthread_mutex_unlock(&bulk->lock);
+}
+
+// accounts for a batch that is no longer in flight and frees it
+static void finish_batch(Batch *batch, const size_t succeeded, const size_t failed) {
+    Bulk *bulk = batch->bulk;
+    pthread_mutex_lock(&bulk->lock);
+    bulk->succeeded += succeeded;
+    bulk->failed += failed;
+    bulk->in_flight--;
+    pthread_cond_signal(&bulk->done);
+    pthread_mutex_unlock(&bulk->lock);
+    free(batch);
+}
+
+static Batch *new_batch(Bulk *bulk, const Peer *responsible, const size_t first, const size_t count) {
+    Batch *batch = (Batch *) malloc(sizeof(Batch));
+    if (batch == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    *batch = (Batch){bulk, responsible, first, count};
+    return batch;
+}
+
+// finds the node responsible for each run of the sorted keys and hands the run to handle_run
+static void route_runs(Bulk *bulk, const size_t count, const RunHandler handle_run) {
+    const Key *keys = bulk->keys;
+    size_t i = 0;
+    while (i < count) {
+        const Peer *responsible = find_successor(bulk->node, keys[i].id);
+        if (responsible == NULL) {
+            fprintf(stderr, "Lookup of the responsible node timed out\n");
+            handle_run(bulk, NULL, i, i + 1);
+            i++;
+            continue;
+        }
+
+        // the node responsible for keys[i] is also responsible for every ID up to its own
+        size_t end = i + 1;
+        while (end < count && (memcmp(keys[end].id, keys[i].id, HASH_SIZE) == 0 ||
+                               (memcmp(keys[i].id, responsible->id, HASH_SIZE) != 0 &&
+                                is_in_half_open_interval(keys[end].id, keys[i].id, responsible->id)))) {
+            end++;
+        }
+        handle_run(bulk, responsible, i, end);
+        i = end;
+    }
+}
+
+// adds keys[first, first + count) to the uploaded files table
+static void confirm_batch(Node *n, const Key *keys, const size_t first, const size_t count) {
+    pthread_mutex_lock(&n->files_lock);
+    for (size_t i = first; i < first + count; i++) {
+        FileEntry *entry = create_file_entry(keys[i].id, keys[i].name, n->self);
+        if (entry == NULL) {
+            continue;
+        }
+        if (file_table_insert(&n->uploaded_files, entry) < 0) {
+            free(entry);
+        } else {
+            metadata_store_put(n->store, STORE_UPLOADED, entry);
+        }
+    }
+    pthread_mutex_unlock(&n->files_lock);
+}
+
+static void on_store_reply(Node *n, const RpcStatus status, const Message *response, void *arg) {
+    Batch *batch = (Batch *) arg;
+    uint32_t added = 0;
+    if (status == RPC_OK && response->data_len >= sizeof(added)) {
+        memcpy(&added, response->data, sizeof(added));
+        added = ntohl(added);
+    }
+
+    // the responsible node counts what it added, anything less means entries were dropped
+    if (added == batch->count) {
+        confirm_batch(n, batch->bulk->keys, batch->first, batch->count);
+        finish_batch(batch, batch->count, 0);
+    } else {
+        finish_batch(batch, 0, batch->count);
+    }
+}
+
+// stores a run locally or sends it to the responsible node in as few STORE_BATCH requests as possible
+static void store_run(Bulk *bulk, const Peer *responsible, size_t first, const size_t last) {
+    Node *n = bulk->node;
+    const Key *keys = bulk->keys;
+    if (responsible == NULL) {
+        add_results(bulk, 0, last - first);
+        return;
+    }
+    if (responsible == n->self) {
+        // only the keys that made it into n->files count as uploaded
+        size_t stored = 0;
+        for (size_t i = first; i < last; i++) {
+            if (internal_store_file(n, keys[i].name, keys[i].id, n->ip, n->port) == 0) {
+                confirm_batch(n, keys, i, 1);
+                stored++;
+            }
+        }
+        add_results(bulk, stored, last - first - stored);
+        return;
+    }
+
+    Message msg = {0};
+    msg.type = MSG_STORE_BATCH;
+    strcpy(msg.ip, n->ip);
+    msg.port = n->port;
+    memcpy(msg.id, n->id, HASH_SIZE);
+
+    while (first < last) {
+        size_t offset = 0;
+        size_t i = first;
+        for (; i < last; i++) {
+            const size_t path_len = strlen(keys[i].name);
+            if (offset + STORE_RECORD_HEADER + path_len > sizeof(msg.data)) {
+                break;
+            }
+            const uint16_t len = htons((uint16_t) path_len);
+            memcpy(msg.data + offset, keys[i].id, HASH_SIZE);
+            memcpy(msg.data + offset + HASH_SIZE, &len, 2);
+            memcpy(msg.data + offset + STORE_RECORD_HEADER, keys[i].name, path_len);
+            offset += STORE_RECORD_HEADER + path_len;
+        }
+        if (i == first) {
+            fprintf(stderr, "Path too long for a batch: %s\n", keys[first].name);
+            add_results(bulk, 0, 1);
+            first++;
+            continue;
+        }
+
+        Batch *batch = new_batch(bulk, responsible, first, i - first);
+        if (batch == NULL) {
+            add_results(bulk, 0, last - first);
+            return;
+        }
+        msg.request_id = generate_id();
+        msg.data_len = offset;
+
+        start_batch(bulk);
+        if (rpc_call_async(n, responsible->ip, responsible->port, &msg, RPC_DEADLINE_MS, on_store_reply, batch) !=
+            RPC_OK) {
+            finish_batch(batch, 0, batch->count);
+        }
+        first = i;
+    }
+}
+
+// nftw() takes no argument for its callback
+static KeyList *walked;
+
+static int collect_file(const char *path, const struct stat *st, const int type, struct FTW *ftw) {
+    (void) st;
+    (void) ftw;
+    if (type != FTW_F) {
+        return 0;
+    }
+    if (walked->count == walked->capacity) {
+        const size_t capacity = walked->capacity > 0 ? walked->capacity * 2 : 256;
+        Key *keys = (Key *) realloc(walked->keys, capacity * sizeof(Key));
+        if (keys == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        walked->keys = keys;
+        walked->capacity = capacity;
+    }
+    if ((walked->keys[walked->count].name = strdup(path)) == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    walked->count++;
+    return 0;
+}
+
+int store_tree(Node *n, const char *dir, size_t *failed) {
+    KeyList tree = {NULL, 0, 0};
+    walked = &tree;
+    const int walk = nftw(dir, collect_file, 64, FTW_PHYS);
+    walked = NULL;
+
+    int stored = -1;
+    if (walk == 0) {
+        Bulk bulk;
+        bulk_init(&bulk, n, tree.keys, tree.count);
+        route_runs(&bulk, tree.count, store_run);
+        bulk_finish(&bulk);
+        *failed = bulk.failed;
+        stored = (int) bulk.succeeded;
+    } else if (walk < 0) {
+        perror("nftw");
+    }
+
+    for (size_t i = 0; i < tree.count; i++) {
+        free(tree.keys[i].name);
+    }
+    free(tree.keys);
+    return stored;
+}
+
+uint32_t apply_store_batch(Node *n, const Message *msg) {
+    char path[MAX_FILEPATH];
+    const uint8_t *p = (const uint8_t *) msg->data;
+    const uint8_t *end = p + msg->data_len;
+    uint32_t added = 0;
+
+    while (end - p >= STORE_RECORD_HEADER) {
+        uint16_t path_len;
+        memcpy(&path_len, p + HASH_SIZE, 2);
+        path_len = ntohs(path_len);
+        if (end - p - STORE_RECORD_HEADER < path_len) {
+            break;
+        }
+        memcpy(path, p + STORE_RECORD_HEADER, path_len);
+        path[path_len] = '\0';
+        if (internal_store_file(n, path, p, msg->ip, msg->port) == 0) {
+            added++;
+        }
+        p += STORE_RECORD_HEADER + path_len;
+    }
+    return added;
+}
+
+// hands the result of one name to the callback of the lookup
+static void report(Bulk *bulk, const Key *key, const FileInfo *info, const bool failed) {
+    pthread_mutex_lock(&bulk->lock);
+    bulk->cb(key->name, info, failed, bulk->cb_arg);
+    pthread_mutex_unlock(&bulk->lock);
+}
+
+static void report_failed(Bulk *bulk, const size_t first, const size_t count) {
+    for (size_t i = first; i < first + count; i++) {
+        report(bulk, &bulk->keys[i], NULL, true);
+    }
+}
+
+// returns how many of the names from keys[first] on fit in one FIND_BATCH request, at most count
+static size_t pack_names(const Key *keys, const size_t first, const size_t count, Message *msg) {
+    size_t offset = 0;
+    size_t packed = 0;
+    while (packed < count) {
+        const size_t len = strlen(keys[first + packed].name);
+        if (offset + 1 + len > sizeof(msg->data)) {
+            break;
+        }
+        msg->data[offset] = (char) len;
+        memcpy(msg->data + offset + 1, keys[first + packed].name, len);
+        offset += 1 + len;
+        packed++;
+    }
+    msg->data_len = offset;
+    return packed;
+}
+
+static void on_find_reply(Node *n, RpcStatus status, const Message *response, void *arg);
+
+// sends the FIND_BATCH request of batch, whose names all fit in one datagram
+static RpcStatus send_find_batch(Batch *batch) {
+    Node *n = batch->bulk->node;
+    Message msg = {0};
+    msg.request_id = generate_id();
+    msg.type = MSG_FIND_BATCH;
+    strcpy(msg.ip, n->ip);
+    msg.port = n->port;
+    memcpy(msg.id, n->id, HASH_SIZE);
+    pack_names(batch->bulk->keys, batch->first, batch->count, &msg);
+    return rpc_call_async(n, batch->responsible->ip, batch->responsible->port, &msg, RPC_DEADLINE_MS, on_find_reply,
+                          batch);
+}
+
+// decodes the results of a FIND_BATCH reply, returns how many names they answer
+static size_t read_results(Batch *batch, const Message *response) {
+    Bulk *bulk = batch->bulk;
+    const uint8_t *p = (const uint8_t *) response->data;
+    const uint8_t *end = p + response->data_len;
+    uint16_t answered;
+    if (end - p < 2) {
+        return 0;
+    }
+    memcpy(&answered, p, 2);
+    answered = ntohs(answered);
+    p += 2;
+
+    size_t read = 0;
+    while (read < answered && read < batch->count && p < end) {
+        const Key *key = &bulk->keys[batch->first + read];
+        if (*p == 0) {
+            report(bulk, key, NULL, false);
+            p++;
+            read++;
+            continue;
+        }
+
+        uint32_t addr;
+        uint16_t port, path_len;
+        if (end - p < FOUND_RECORD_HEADER) {
+            break;
+        }
+        memcpy(&addr, p + 1, 4);
+        memcpy(&port, p + 5, 2);
+        memcpy(&path_len, p + 7, 2);
+        path_len = ntohs(path_len);
+        if (end - p - FOUND_RECORD_HEADER < path_len || path_len >= MAX_FILEPATH) {
+            break;
+        }
+
+        FileInfo info;
+        memcpy(info.id, key->id, HASH_SIZE);
+        strncpy(info.filename, key->name, sizeof(info.filename) - 1);
+        info.filename[sizeof(info.filename) - 1] = '\0';
+        memcpy(info.filepath, p + FOUND_RECORD_HEADER, path_len);
+        info.filepath[path_len] = '\0';
+        const struct in_addr in = {addr};
+        inet_ntop(AF_INET, &in, info.owner_ip, sizeof(info.owner_ip));
+        info.owner_port = ntohs(port);
+        report(bulk, key, &info, false);
+        add_results(bulk, 1, 0);
+
+        p += FOUND_RECORD_HEADER + path_len;
+        read++;
+    }
+    return read;
+}
+
+static void on_find_reply(Node *n, const RpcStatus status, const Message *response, void *arg) {
+    (void) n;
+    Batch *batch = (Batch *) arg;
+    size_t answered = status == RPC_OK ? read_results(batch, response) : 0;
+    if (status == RPC_OK && answered == 0) {
+        // not even one result fits in a reply
+        fprintf(stderr, "Result for %s is too large for a reply\n", batch->bulk->keys[batch->first].name);
+        report_failed(batch->bulk, batch->first, 1);
+        add_results(batch->bulk, 0, 1);
+        answered = 1;
+    }
+    if (status != RPC_OK) {
+        report_failed(batch->bulk, batch->first, batch->count);
+        finish_batch(batch, 0, batch->count);
+        return;
+    }
+
+    // the reply ran out of room, the rest of the names go in a follow-up request
+    batch->first += answered;
+    batch->count -= answered;
+    if (batch->count == 0) {
+        finish_batch(batch, 0, 0);
+    } else if (send_find_batch(batch) != RPC_OK) {
+        report_failed(batch->bulk, batch->first, batch->count);
+        finish_batch(batch, 0, batch->count);
+    }
+}
+
+// looks a run up locally or sends it to the responsible node in as few FIND_BATCH requests as possible
+static void find_run(Bulk *bulk, const Peer *responsible, size_t first, const size_t last) {
+    Node *n = bulk->node;
+    const Key *keys = bulk->keys;
+    if (responsible == NULL) {
+        report_failed(bulk, first, last - first);
+        add_results(bulk, 0, last - first);
+        return;
+    }
+    if (responsible == n->self) {
+        FileInfo info;
+        for (size_t i = first; i < last; i++) {
+            pthread_mutex_lock(&n->files_lock);
+            const FileEntry *entry = file_table_find(&n->files, keys[i].id);
+            if (entry != NULL) {
+                expand_file_entry(entry, &info);
+            }
+            pthread_mutex_unlock(&n->files_lock);
+            report(bulk, &keys[i], entry != NULL ? &info : NULL, false);
+            add_results(bulk, entry != NULL, 0);
+        }
+        return;
+    }
+
+    Message msg;
+    while (first < last) {
+        const size_t count = pack_names(keys, first, last - first, &msg);
+        Batch *batch = new_batch(bulk, responsible, first, count);
+        if (batch == NULL) {
+            report_failed(bulk, first, last - first);
+            add_results(bulk, 0, last - first);
+            return;
+        }
+        start_batch(bulk);
+        if (send_find_batch(batch) != RPC_OK) {
+            report_failed(bulk, batch->first, batch->count);
+            finish_batch(batch, 0, batch->count);
+        }
+        first += count;
+    }
+}
+
+int find_many(Node *n, const char *const *filenames, const size_t count, const FindCallback cb, void *arg,
+              size_t *failed) {
+    Key *keys = (Key *) malloc((count > 0 ? count : 1) * sizeof(Key));
+    if (keys == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    size_t valid = 0;
+    for (size_t i = 0; i < count; i++) {
+        // a name must fit behind its u8 length and contain no directory
+        if (strlen(filenames[i]) == 0 || strlen(filenames[i]) >= MAX_FILENAME || strchr(filenames[i], '/') != NULL) {
+            cb(filenames[i], NULL, true, arg);
+            continue;
+        }
+        keys[valid++].name = (char *) filenames[i];
+    }
+
+    Bulk bulk;
+    bulk_init(&bulk, n, keys, valid);
+    bulk.cb = cb;
+    bulk.cb_arg = arg;
+    route_runs(&bulk, valid, find_run);
+    bulk_finish(&bulk);
+
+    free(keys);
+    *failed = bulk.failed + (count - valid);
+    return (int) bulk.succeeded;
+}
+
+void answer_find_batch(Node *n, const Message *request, Message *response) {
+    const uint8_t *p = (const uint8_t *) request->data;
+    const uint8_t *end = p + request->data_len;
+    uint8_t *out = (uint8_t *) response->data + 2;
+    const uint8_t *out_end = (const uint8_t *) response->data + sizeof(response->data);
+    char name[MAX_FILENAME];
+    uint16_t answered = 0;
+
+    pthread_mutex_lock(&n->files_lock);
+    while (p < end && (size_t) (end - p) > *p) {
+        const uint8_t len = *p;
+        memcpy(name, p + 1, len);
+        name[len] = '\0';
+        uint8_t id[HASH_SIZE];
+        hash(name, id);
+
+        const FileEntry *entry = file_table_find(&n->files, id);
+        const size_t size = entry != NULL ? FOUND_RECORD_HEADER + entry->path_len : 1;
+        if (out + size > out_end) {
+            break; // the requester asks again for the rest
+        }
+        if (entry == NULL) {
+            *out = 0;
+        } else {
+            const uint16_t path_len = htons(entry->path_len);
+            out[0] = 1;
+            memcpy(out + 1, &entry->owner->addr.sin_addr.s_addr, 4); // already in network byte order
+            memcpy(out + 5, &entry->owner->addr.sin_port, 2);
+            memcpy(out + 7, &path_len, 2);
+            memcpy(out + FOUND_RECORD_HEADER, entry->path, entry->path_len);
+        }
+        out += size;
+        answered++;
+        p += 1 + len;
+    }
+    pthread_mutex_unlock(&n->files_lock);
+
+    const uint16_t count = htons(answered);
+    memcpy(response->data, &count, 2);
+    response->data_len = out - (uint8_t *) response->data;
+}
@@ -0,0 +1,225 @@
+#include "event_loop.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+struct Timer {
+    uint64_t deadline; // monotonic microseconds
+    TimerCallback cb;
+    void *arg;
+    size_t heap_index;
+};
+
+typedef struct {
+    int fd;
+    FdCallback cb;
+    void *arg;
+} FdWatch;
+
+static int epoll_fd = -1;
+static int wake_fd = -1; // written by add_timer so that the loop recomputes its timeout
+
+// min-heap of timers ordered by deadline, shared with the threads adding timers
+static Timer **timers;
+static size_t timer_count;
+static size_t timer_capacity;
+static pthread_mutex_t timers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// registered descriptors, looked up when one is removed
+static FdWatch **watches;
+static int watch_capacity;
+
+static void heap_swap(const size_t a, const size_t b) {
+    Timer *tmp = timers[a];
+    timers[a] = timers[b];
+    timers[b] = tmp;
+    timers[a]->heap_index = a;
+    timers[b]->heap_index = b;
+}
+
+static void heap_up(size_t i) {
+    while (i > 0 && timers[(i - 1) / 2]->deadline > timers[i]->deadline) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(size_t i) {
+    while (1) {
+        size_t smallest = i;
+        const size_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < timer_count && timers[left]->deadline < timers[smallest]->deadline) {
+            smallest = left;
+        }
+        if (right < timer_count && timers[right]->deadline < timers[smallest]->deadline) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+// unlinks the timer at index i, timers_mutex must be held
+static void heap_remove(const size_t i) {
+    timer_count--;
+    if (i != timer_count) {
+        heap_swap(i, timer_count);
+        heap_down(i);
+        heap_up(i);
+    }
+}
+
+static void on_wake(const int fd, const uint32_t events, void *arg) {
+    (void) events;
+    (void) arg;
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0) {
+        perror("read");
+    }
+}
+
+int event_loop_init() {
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    return event_loop_add_fd(wake_fd, EPOLLIN, on_wake, NULL);
+}
+
+int event_loop_add_fd(const int fd, const uint32_t events, const FdCallback cb, void *arg) {
+    if (fd >= watch_capacity) {
+        const int capacity = fd + 64;
+        FdWatch **resized = (FdWatch **) realloc(watches, capacity * sizeof(FdWatch *));
+        if (resized == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        for (int i = watch_capacity; i < capacity; i++) {
+            resized[i] = NULL;
+        }
+        watches = resized;
+        watch_capacity = capacity;
+    }
+
+    FdWatch *watch = (FdWatch *) malloc(sizeof(FdWatch));
+    if (watch == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    watch->fd = fd;
+    watch->cb = cb;
+    watch->arg = arg;
+
+    struct epoll_event event = {.events = events, .data.ptr = watch};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("epoll_ctl");
+        free(watch);
+        return -1;
+    }
+    watches[fd] = watch;
+    return 0;
+}
+
+void event_loop_remove_fd(const int fd) {
+    if (fd < 0 || fd >= watch_capacity || watches[fd] == NULL) {
+        return;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    free(watches[fd]);
+    watches[fd] = NULL;
+}
+
+Timer *add_timer(const uint64_t delay_ms, const TimerCallback cb, void *arg) {
+    Timer *timer = (Timer *) malloc(sizeof(Timer));
+    if (timer == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    timer->deadline = monotonic_us() + delay_ms * 1000ULL;
+    timer->cb = cb;
+    timer->arg = arg;
+
+    pthread_mutex_lock(&timers_mutex);
+    if (timer_count == timer_capacity) {
+        const size_t capacity = timer_capacity > 0 ? timer_capacity * 2 : 64;
+        Timer **resized = (Timer **) realloc(timers, capacity * sizeof(Timer *));
+        if (resized == NULL) {
+            pthread_mutex_unlock(&timers_mutex);
+            perror("realloc");
+            free(timer);
+            return NULL;
+        }
+        timers = resized;
+        timer_capacity = capacity;
+    }
+    timer->heap_index = timer_count;
+    timers[timer_count++] = timer;
+    heap_up(timer->heap_index);
+    const bool earliest = timers[0] == timer;
+    pthread_mutex_unlock(&timers_mutex);
+
+    // the loop may be sleeping towards a later deadline
+    if (earliest && write(wake_fd, &(uint64_t){1}, sizeof(uint64_t)) < 0) {
+        perror("write");
+    }
+    return timer;
+}
+
+void cancel_timer(Timer *timer) {
+    if (timer == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&timers_mutex);
+    heap_remove(timer->heap_index);
+    pthread_mutex_unlock(&timers_mutex);
+    free(timer);
+}
+
+// runs every expired timer, returns how long the loop may sleep until the next one (-1: no timers)
+static int run_timers() {
+    while (1) {
+        pthread_mutex_lock(&timers_mutex);
+        if (timer_count == 0) {
+            pthread_mutex_unlock(&timers_mutex);
+            return -1;
+        }
+        Timer *timer = timers[0];
+        const uint64_t now = monotonic_us();
+        if (timer->deadline > now) {
+            pthread_mutex_unlock(&timers_mutex);
+            return (int) ((timer->deadline - now + 999) / 1000);
+        }
+        heap_remove(0);
+        pthread_mutex_unlock(&timers_mutex);
+
+        timer->cb(timer->arg);
+        free(timer);
+    }
+}
+
+void event_loop_run() {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    while (1) {
+        const int timeout = run_timers();
+        const int ready = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+        if (ready < 0) {
+            continue; // interrupted by a signal
+        }
+        for (int i = 0; i < ready; i++) {
+            const FdWatch *watch = (FdWatch *) events[i].data.ptr;
+            watch->cb(watch->fd, events[i].events, watch->arg);
+        }
+    }
+}
@@ -4,6 +4,12 @@
 #include "threads.h"
 #include "utils.h"
 #include "sha1.h"
+#include "transfer.h"
+#include "rpc.h"
+#include "message_pool.h"
+#include "metadata_store.h"
+#include "location_cache.h"
+#include "replication.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -11,6 +17,7 @@
 #include <dirent.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <fcntl.h>
 
 char outdir[MAX_FILEPATH] = "./";
 
@@ -25,6 +32,40 @@ int set_outdir(const char *new_outdir) {
     return 0;
 }
 
+FileEntry *create_file_entry(const uint8_t *id, const char *filepath, Peer *owner) {
+    const size_t path_len = strlen(filepath);
+    if (path_len >= MAX_FILEPATH) {
+        fprintf(stderr, "Path too long: %s\n", filepath);
+        return NULL;
+    }
+
+    FileEntry *entry = (FileEntry *) malloc(sizeof(FileEntry) + path_len + 1);
+    if (entry == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memcpy(entry->id, id, HASH_SIZE);
+    const char *filename = strrchr(filepath, '/');
+    entry->name_offset = filename != NULL ? (uint16_t) (filename + 1 - filepath) : 0;
+    entry->path_len = (uint16_t) path_len;
+    entry->owner = owner;
+    memcpy(entry->path, filepath, path_len + 1);
+    return entry;
+}
+
+const char *file_entry_name(const FileEntry *entry) {
+    return entry->path + entry->name_offset;
+}
+
+void expand_file_entry(const FileEntry *entry, FileInfo *info) {
+    memcpy(info->id, entry->id, HASH_SIZE);
+    strncpy(info->filename, file_entry_name(entry), sizeof(info->filename) - 1);
+    info->filename[sizeof(info->filename) - 1] = '\0';
+    memcpy(info->filepath, entry->path, entry->path_len + 1);
+    strcpy(info->owner_ip, entry->owner->ip);
+    info->owner_port = entry->owner->port;
+}
+
 int store_file(Node *n, const char *filepath) {
     // check if file exists
     if (access(filepath, F_OK) < 0) {
@@ -42,111 +83,125 @@ int store_file(Node *n, const char *filepath) {
     uint8_t file_id[HASH_SIZE];
     hash(filename, file_id);
 
-    const Node *responsible_node = find_successor(n, file_id);
+    const Peer *responsible_node = find_successor(n, file_id);
+    if (responsible_node == NULL) {
+        fprintf(stderr, "Lookup of the responsible node timed out\n");
+        return -1;
+    }
 
     // if the responsible node is the current node, store the file locally
-    if (memcmp(n->id, responsible_node->id, HASH_SIZE) == 0) {
-        return internal_store_file(n, filename, filepath, file_id, n->ip, n->port);
+    if (responsible_node == n->self) {
+        return internal_store_file(n, filepath, file_id, n->ip, n->port);
     }
 
     // send a message to the responsible node to store the file
-    Message msg;
+    Message msg = {0};
     msg.request_id = generate_id();
-    strcpy(msg.type, MSG_STORE_FILE);
+    msg.type = MSG_STORE_FILE;
     memcpy(msg.id, file_id, HASH_SIZE);
     strcpy(msg.ip, n->ip);
     msg.port = n->port;
-    strcpy(msg.data, filepath);
+    set_message_text(&msg, filepath);
 
-    return send_message(n, responsible_node->ip, responsible_node->port, &msg);
+    return send_to_peer(n, responsible_node, &msg);
 }
 
 // run if store function is successful to locally confirm that the file was actually uploaded
 void confirm_file_stored(Node *node, const char *filepath) {
-    FileEntry *file_entry = (FileEntry *) malloc(sizeof(FileEntry));
-    if (file_entry == NULL) {
-        perror("malloc");
-        return;
-    }
-
-    strcpy(file_entry->filepath, filepath);
     const char *filename = strrchr(filepath, '/');
     if (filename == NULL) {
         filename = (char *) filepath;
     } else {
         filename++;
     }
-    hash(filename, file_entry->id);
-    strncpy(file_entry->filename, filename, sizeof(file_entry->filename));
-    strcpy(file_entry->owner_ip, node->ip);
-    file_entry->owner_port = node->port;
+    uint8_t file_id[HASH_SIZE];
+    hash(filename, file_id);
 
-    // add file to uploaded files list
-    file_entry->next = node->uploaded_files;
-    node->uploaded_files = file_entry;
+    FileEntry *file_entry = create_file_entry(file_id, filepath, node->self);
+    if (file_entry == NULL) {
+        return;
+    }
+
+    // add file to uploaded files table
+    pthread_mutex_lock(&node->files_lock);
+    if (file_table_insert(&node->uploaded_files, file_entry) < 0) {
+        free(file_entry);
+    } else {
+        metadata_store_put(node->store, STORE_UPLOADED, file_entry);
+    }
+    pthread_mutex_unlock(&node->files_lock);
 }
 
-int internal_store_file(Node *n, const char *filename, const char *filepath, const uint8_t *file_id,
-                        const char *uploader_ip, const int uploader_port) {
-    FileEntry *new_entry = (FileEntry *) malloc(sizeof(FileEntry));
+int internal_store_file(Node *n, const char *filepath, const uint8_t *file_id, const char *uploader_ip,
+                        const int uploader_port) {
+    FileEntry *new_entry = create_file_entry(file_id, filepath, intern_peer(uploader_ip, uploader_port));
     if (new_entry == NULL) {
-        perror("malloc");
         return -1;
     }
 
-    memcpy(new_entry->id, file_id, HASH_SIZE);
-    strncpy(new_entry->filename, filename, sizeof(new_entry->filename));
-    strncpy(new_entry->filepath, filepath, sizeof(new_entry->filepath));
-    strcpy(new_entry->owner_ip, uploader_ip);
-    new_entry->owner_port = uploader_port;
-
-    // add file to files list
-    new_entry->next = n->files;
-    n->files = new_entry;
+    // add file to files table
+    pthread_mutex_lock(&n->files_lock);
+    const int result = file_table_insert(&n->files, new_entry);
+    if (result < 0) {
+        free(new_entry);
+    } else {
+        metadata_store_put(n->store, STORE_FILES, new_entry);
+        replicate_put(n, new_entry);
+    }
+    pthread_mutex_unlock(&n->files_lock);
 
-    return 0;
+    return result;
 }
 
-FileEntry *find_file(Node *n, const char *filename) {
-    uint8_t file_id[HASH_SIZE];
-    hash(filename, file_id);
-
-    const Node *responsible_node = find_successor(n, file_id);
-
-    // if the responsible node is the current node, search for the file locally
-    if (memcmp(n->id, responsible_node->id, HASH_SIZE) == 0) {
-        FileEntry *current = n->files;
-        while (current != NULL) {
-            if (memcmp(current->id, file_id, HASH_SIZE) == 0) {
-                return current; // file found locally
-            }
-            current = current->next;
-        }
-        return NULL; // file not found locally
+FileInfo *find_local_file(Node *n, const uint8_t *file_id) {
+    FileInfo *copy = NULL;
+    pthread_mutex_lock(&n->files_lock);
+    const FileEntry *current = file_table_find(&n->files, file_id);
+    if (current == NULL) {
+        current = file_table_find(&n->replicas, file_id);
+    }
+    // the entry may be deleted by another handler once the lock is released
+    if (current != NULL && (copy = (FileInfo *) malloc(sizeof(FileInfo))) != NULL) {
+        expand_file_entry(current, copy);
     }
+    pthread_mutex_unlock(&n->files_lock);
+    return copy;
+}
 
-    // send a message to the responsible node to find the file
-    Message msg;
+// asks node (responsible for filename or a replica) where the file is, caching the answer
+// *answered is set unless node did not reply at all
+static FileInfo *ask_file_location(Node *n, Peer *node, const char *filename, const uint8_t *file_id,
+                                   bool *answered) {
+    // send a message to the node to find the file
+    Message msg = {0};
     msg.request_id = generate_id();
-    strcpy(msg.type, MSG_FIND_FILE);
+    msg.type = MSG_FIND_FILE;
     memcpy(msg.id, file_id, HASH_SIZE);
     strcpy(msg.ip, n->ip);
     msg.port = n->port;
-    strcpy(msg.data, filename);
-
-    send_message(n, responsible_node->ip, responsible_node->port, &msg);
+    set_message_text(&msg, filename);
 
-    FileEntry *file_entry = (FileEntry *) malloc(sizeof(FileEntry));
-    if (file_entry == NULL) {
-        perror("malloc");
+    Message *response = NULL;
+    const RpcStatus status = rpc_call_open(n, node->ip, node->port, &msg, &response, RPC_DEADLINE_MS);
+    if (status != RPC_OK) {
+        fprintf(stderr, "FIND_FILE to %s:%d timed out\n", node->ip, node->port);
+        *answered = false;
         return NULL;
     }
+    *answered = true;
 
-    const Message *response = pop_message(&reply_queue, msg.request_id);
+    if (strcmp(response->data, "File not found") == 0) {
+        release_message(response);
+        rpc_close(msg.request_id);
+        return NULL; // file not found in the network
+    }
 
-    if (response == NULL || strcmp(response->data, "File not found") == 0) {
-        free(file_entry);
-        return NULL; // file not found in the network or timeout occurred
+    FileInfo *file_entry = (FileInfo *) malloc(sizeof(FileInfo));
+    if (file_entry == NULL) {
+        perror("malloc");
+        release_message(response);
+        rpc_close(msg.request_id);
+        return NULL;
     }
 
     memcpy(file_entry->id, response->id, HASH_SIZE);
@@ -154,191 +209,269 @@ FileEntry *find_file(Node *n, const char *filename) {
     file_entry->filename[sizeof(file_entry->filename) - 1] = '\0';
     strcpy(file_entry->owner_ip, response->ip);
     file_entry->owner_port = response->port;
-    strncpy(file_entry->filepath, response->data, response->data_len);
-    file_entry->filepath[response->data_len] = '\0';
-
-    if (response->total_segments > 1) {
-        for (int i = 1; i < response->total_segments; i++) {
-            response = pop_message(&reply_queue, msg.request_id);
-            if (response == NULL) {
-                // Handle error, possibly free memory or return an error code
-                free(file_entry);
-                return NULL;
-            }
-            strncat(file_entry->filepath, response->data, response->data_len);
+
+    // long paths span several replies, each is placed by its index whatever order they arrive in
+    bool received[(MAX_FILEPATH + sizeof(msg.data) - 1) / sizeof(msg.data)] = {false};
+    const uint32_t total_segments = response->total_segments;
+    uint32_t missing = total_segments;
+    size_t path_len = 0;
+    // a count the path cannot have is never completed
+    while (total_segments > 0 && total_segments <= sizeof(received) / sizeof(received[0])) {
+        const uint32_t index = response->segment_index;
+        const size_t end = (size_t) index * sizeof(response->data) + response->data_len;
+        if (index < total_segments && !received[index] && end < sizeof(file_entry->filepath)) {
+            memcpy(file_entry->filepath + end - response->data_len, response->data, response->data_len);
+            received[index] = true;
+            missing--;
+            path_len = end > path_len ? end : path_len;
+        }
+        release_message(response);
+        if (missing == 0 || rpc_wait(msg.request_id, &response, RPC_DEADLINE_MS) != RPC_OK) {
+            response = NULL;
+            break;
         }
     }
+    if (response != NULL) {
+        release_message(response);
+    }
+    rpc_close(msg.request_id);
+    if (missing != 0 || total_segments == 0) {
+        fprintf(stderr, "FIND_FILE reply from %s:%d is incomplete\n", node->ip, node->port);
+        free(file_entry);
+        return NULL;
+    }
+    file_entry->filepath[path_len] = '\0';
 
+    location_cache_put(file_entry, node);
     return file_entry;
 }
 
-FileEntry *find_uploaded_file(const Node *n, const char *filepath) {
-    FileEntry *current = n->uploaded_files;
-    // search for the file in the uploaded files list
-    while (current != NULL) {
-        if (strcmp(current->filepath, filepath) == 0) {
-            return current;
+// expected latency of a FIND_FILE to peer: none for this node, peers never measured come after measured ones
+static uint64_t expected_rtt(const Node *n, Peer *peer) {
+    if (peer == n->self) {
+        return 0;
+    }
+    const uint64_t srtt = peer_srtt(peer);
+    return atomic_load(&peer->alive) && srtt != 0 ? srtt : UINT64_MAX;
+}
+
+// sorts the replicas by expected_rtt, keeping the order of the lookup (responsible node first) among equals
+static void order_by_rtt(const Node *n, Peer **replicas, const int count) {
+    uint64_t rtt[SUCCESSOR_LIST_SIZE];
+    for (int i = 0; i < count; i++) {
+        rtt[i] = expected_rtt(n, replicas[i]);
+    }
+    for (int i = 1; i < count; i++) {
+        Peer *peer = replicas[i];
+        const uint64_t key = rtt[i];
+        int j = i;
+        for (; j > 0 && rtt[j - 1] > key; j--) {
+            replicas[j] = replicas[j - 1];
+            rtt[j] = rtt[j - 1];
         }
-        current = current->next;
+        replicas[j] = peer;
+        rtt[j] = key;
     }
-    return NULL;
 }
 
-int download_file(const Node *n, const FileEntry *file_entry) {
-    Message msg;
-    msg.request_id = generate_id();
-    strcpy(msg.type, MSG_DOWNLOAD_FILE);
-    memcpy(msg.id, n->id, HASH_SIZE);
-    strcpy(msg.ip, n->ip);
-    msg.port = n->port;
-    strcpy(msg.data, file_entry->filepath);
+FileInfo *find_file(Node *n, const char *filename) {
+    uint8_t file_id[HASH_SIZE];
+    hash(filename, file_id);
 
-    if (send_message(n, file_entry->owner_ip, file_entry->owner_port, &msg) < 0) {
-        return -1;
+    // a location cached here or by a node on the lookup path answers without asking the responsible node
+    FileLookup lookup;
+    lookup_file(n, file_id, &lookup);
+    if (lookup.hit) {
+        FileInfo *copy = (FileInfo *) malloc(sizeof(FileInfo));
+        if (copy != NULL) {
+            memcpy(copy, &lookup.found, sizeof(FileInfo));
+        }
+        return copy;
+    }
+    if (lookup.replica_count == 0) {
+        fprintf(stderr, "Lookup of the responsible node timed out\n");
+        return NULL;
     }
 
-    // create the output file
-    char outpath[strlen(outdir) + strlen(file_entry->filename) + 1];
-    strcpy(outpath, outdir);
-    strncat(outpath, file_entry->filename, MAX_FILEPATH);
+    // every replica answers for the entry (asking the responsible node if it has no copy), the nearest is asked
+    // first and the next one only if it does not reply
+    const Peer *responsible_node = lookup.replicas[0];
+    order_by_rtt(n, lookup.replicas, lookup.replica_count);
+    for (int i = 0; i < lookup.replica_count; i++) {
+        Peer *replica = lookup.replicas[i];
+        if (replica == n->self) {
+            FileInfo *file = find_local_file(n, file_id);
+            if (file != NULL || replica == responsible_node) {
+                return file;
+            }
+            continue; // the copy of this node may not have arrived yet
+        }
+        bool answered;
+        FileInfo *file = ask_file_location(n, replica, filename, file_id, &answered);
+        if (answered) {
+            return file;
+        }
+    }
+    return NULL;
+}
 
-    FILE *file = fopen(outpath, "wb");
-    if (file == NULL) {
-        perror("File opening failed");
-        return -1;
+FileInfo *locate_file(Node *n, const char *filename) {
+    uint8_t file_id[HASH_SIZE];
+    hash(filename, file_id);
+
+    Peer *responsible_node = find_successor(n, file_id);
+    if (responsible_node == NULL) {
+        fprintf(stderr, "Lookup of the responsible node timed out\n");
+        return NULL;
     }
 
-    const Message *response = pop_message(&reply_queue, msg.request_id);
-    if (response == NULL) {
-        fclose(file);
-        return -1;
+    // if the responsible node is the current node, search for the file locally
+    if (responsible_node == n->self) {
+        return find_local_file(n, file_id);
     }
+    bool answered;
+    return ask_file_location(n, responsible_node, filename, file_id, &answered);
+}
+
+FileEntry *find_uploaded_file(const Node *n, const char *filepath) {
+    return file_table_find_path(&n->uploaded_files, filepath);
+}
 
+// sends the DOWNLOAD_FILE request and receives the file into fd over whichever channel the owner picks
+static int request_download(const Node *n, const FileInfo *file_entry, const Message *msg, const int fd) {
+    Message *response = NULL;
+    const RpcStatus status = rpc_call(n, file_entry->owner_ip, file_entry->owner_port, msg, &response,
+                                      RPC_DEADLINE_MS);
+    if (status != RPC_OK) {
+        fprintf(stderr, "Owner %s:%d did not answer the download request\n", file_entry->owner_ip,
+                file_entry->owner_port);
+        return -1;
+    }
     if (strcmp(response->data, "Starting download") != 0) {
-        fclose(file);
+        release_message(response);
         return -1;
     }
 
-    bool *received_segments = calloc(response->total_segments, sizeof(bool));
+    if (response->flags & MSG_FLAG_STREAM) {
+        const int result = receive_stream_transfer(response->ip, response->port, fd);
+        release_message(response);
+        return result;
+    }
+
+    const uint32_t total_segments = response->total_segments;
+    release_message(response);
+
+    bool *received_segments = calloc(total_segments > 0 ? total_segments : 1, sizeof(bool));
     if (received_segments == NULL) {
         perror("calloc");
-        fclose(file);
         return -1;
     }
 
-    size_t total_received = 0;
-    int retries = 0;
-    const int max_retries = 10;
-
-    while (total_received < response->total_segments + 1 && retries < max_retries) {
-        response = pop_message(&download_queue, msg.request_id);
-        if (response == NULL) {
-            retries++;
-            usleep(1000);
-            continue;
-        }
-        retries = 0; // reset retries after successful receive
-
-        if (received_segments[response->segment_index]) {
-            continue;
-        }
-
-        if (strcmp(response->type, MSG_FILE_END) == 0) {
-            break;
-        }
+    const int result = receive_file_transfer(n, file_entry->owner_ip, file_entry->owner_port, msg->request_id,
+                                             total_segments, received_segments, fd);
+    free(received_segments);
+    return result;
+}
 
-        fseek(file, response->segment_index * MSG_SIZE, SEEK_SET);
-        fwrite(response->data, 1, response->data_len, file);
-        received_segments[response->segment_index] = true;
-        total_received++;
-    }
+int download_file(const Node *n, const FileInfo *file_entry) {
+    Message msg = {0};
+    msg.request_id = generate_id();
+    msg.type = MSG_DOWNLOAD_FILE;
+    msg.flags = MSG_FLAG_STREAM; // large files may come over a TCP data channel
+    memcpy(msg.id, n->id, HASH_SIZE);
+    strcpy(msg.ip, n->ip);
+    msg.port = n->port;
+    set_message_text(&msg, file_entry->filepath);
 
-    free(received_segments);
-    fclose(file);
+    // create the output file
+    char outpath[strlen(outdir) + strlen(file_entry->filename) + 1];
+    strcpy(outpath, outdir);
+    strncat(outpath, file_entry->filename, MAX_FILEPATH);
 
-    if (retries == max_retries) {
-        fprintf(stderr, "Timeout waiting for segments.\n");
+    const int fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("File opening failed");
         return -1;
     }
 
-    if (response && total_received != response->total_segments || strcmp(response->data, "Transfer complete") != 0) {
-        fprintf(stderr, "Download incomplete. Missing segments.\n");
+    // segments may overtake the reply, so they have to be expected before the request goes out
+    if (register_request(&download_queue, msg.request_id) < 0) {
+        close(fd);
         return -1;
     }
 
-    return 0;
-}
+    const int result = request_download(n, file_entry, &msg, fd);
 
-int delete_file_entry(FileEntry **pFiles, const uint8_t *id) {
-    FileEntry *temp = *pFiles;
-    FileEntry *prev = NULL;
-    // If the head node itself holds the key
-    if (temp != NULL && memcmp(temp->id, id, HASH_SIZE) == 0) {
-        *pFiles = temp->next;
-        free(temp);
-        return 0;
-    }
-    // Search for the key and keep track of the previous node
-    while (temp != NULL && memcmp(temp->id, id, HASH_SIZE) != 0) {
-        prev = temp;
-        temp = temp->next;
-    }
-    // If key was not present in the list
-    if (temp == NULL) {
-        return -1;
-    }
-    // Unlink the node from the linked list
-    if (prev) {
-        prev->next = temp->next;
+    unregister_request(&download_queue, msg.request_id);
+    close(fd);
+
+    // the owner may have left or the file may be gone, the next lookup has to ask the network again
+    if (result < 0) {
+        location_cache_invalidate(file_entry->id);
     }
-    free(temp);
-    return 0;
+    return result;
 }
 
 int delete_file(Node *n, const char *filename) {
-    const FileEntry *cur = n->uploaded_files;
-    if (cur == NULL) {
-        return -1;
-    }
-    int found = 0;
-    // search for the file in the uploaded files list
-    while (cur != NULL) {
-        if (strcmp(filename, cur->filename) == 0) {
-            found = 1;
-            break;
-        }
-        cur = cur->next;
-    }
+    uint8_t file_id[HASH_SIZE];
+    hash(filename, file_id);
+    location_cache_invalidate(file_id);
+
+    // search for the file in the uploaded files table (keys are the hashes of the filenames)
+    pthread_mutex_lock(&n->files_lock);
+    const bool found = file_table_find(&n->uploaded_files, file_id) != NULL;
+    pthread_mutex_unlock(&n->files_lock);
     if (!found) {
         return -1;
     }
     // find the responsible node for the file
-    const Node *responsible_node = find_successor(n, cur->id);
+    const Peer *responsible_node = find_successor(n, file_id);
+    if (responsible_node == NULL) {
+        fprintf(stderr, "Lookup of the responsible node timed out\n");
+        return -1;
+    }
 
     // if the responsible node is the current node, delete the file locally
-    if (memcmp(n->id, responsible_node->id, HASH_SIZE) == 0) {
-        const int result1 = delete_file_entry(&n->files, cur->id);
-        const int result2 = delete_file_entry(&n->uploaded_files, cur->id);
+    if (responsible_node == n->self) {
+        pthread_mutex_lock(&n->files_lock);
+        const int result1 = file_table_remove(&n->files, file_id);
+        const int result2 = file_table_remove(&n->uploaded_files, file_id);
+        if (result1 == 0) {
+            metadata_store_remove(n->store, STORE_FILES, file_id);
+            replicate_remove(n, file_id);
+        }
+        if (result2 == 0) {
+            metadata_store_remove(n->store, STORE_UPLOADED, file_id);
+        }
+        pthread_mutex_unlock(&n->files_lock);
         return result1 == 0 && result2 == 0 ? 0 : -1;
     }
 
     // send a message to the responsible node to delete the file
-    Message msg;
+    Message msg = {0};
     msg.request_id = generate_id();
-    strcpy(msg.type, MSG_DELETE_FILE);
-    memcpy(msg.id, cur->id, HASH_SIZE);
+    msg.type = MSG_DELETE_FILE;
+    memcpy(msg.id, file_id, HASH_SIZE);
     strcpy(msg.ip, n->ip);
     msg.port = n->port;
 
-    if (send_message(n, responsible_node->ip, responsible_node->port, &msg) < 0) {
+    Message *response = NULL;
+    if (rpc_call(n, responsible_node->ip, responsible_node->port, &msg, &response, RPC_DEADLINE_MS) != RPC_OK) {
+        fprintf(stderr, "DELETE_FILE to %s:%d timed out\n", responsible_node->ip, responsible_node->port);
         return -1;
     }
-
-    const Message *response = pop_message(&reply_queue, msg.request_id);
-    if (response == NULL || strcmp(response->data, "File not found") == 0) {
+    const bool deleted = strcmp(response->data, "File not found") != 0;
+    release_message(response);
+    if (!deleted) {
         return -1;
     }
 
-    // delete the file from the uploaded files list
-    return delete_file_entry(&n->uploaded_files, cur->id);
+    // delete the file from the uploaded files table
+    pthread_mutex_lock(&n->files_lock);
+    const int result = file_table_remove(&n->uploaded_files, file_id);
+    if (result == 0) {
+        metadata_store_remove(n->store, STORE_UPLOADED, file_id);
+    }
+    pthread_mutex_unlock(&n->files_lock);
+    return result;
 }
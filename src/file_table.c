@@ -0,0 +1,254 @@
+#include "file_table.h"
+#include "file_entry.h"
+#include "sha1.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef size_t (*EntryHash)(const FileEntry *entry);
+
+// SHA-1 IDs are uniformly distributed, their first bytes make a good hash
+static size_t id_hash(const uint8_t *id) {
+    uint64_t h;
+    memcpy(&h, id, sizeof(h));
+    return (size_t) h;
+}
+
+// FNV-1a
+static size_t path_hash(const char *path) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        h = (h ^ (uint8_t) *c) * 1099511628211ULL;
+    }
+    return (size_t) h;
+}
+
+static size_t entry_id_hash(const FileEntry *entry) {
+    return id_hash(entry->id);
+}
+
+static size_t entry_path_hash(const FileEntry *entry) {
+    return path_hash(entry->path);
+}
+
+static int index_init(FileIndex *index, const size_t capacity) {
+    index->slots = (FileEntry **) calloc(capacity, sizeof(FileEntry *));
+    if (index->slots == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    index->mask = capacity - 1;
+    return 0;
+}
+
+// stores entry in the first free slot of its probe sequence, the index must have one
+static void index_put(FileIndex *index, FileEntry *entry, const EntryHash hash_fn) {
+    size_t pos = hash_fn(entry) & index->mask;
+    while (index->slots[pos] != NULL) {
+        pos = (pos + 1) & index->mask;
+    }
+    index->slots[pos] = entry;
+}
+
+// empties pos and shifts later entries of the cluster back, so lookups never need tombstones
+static void index_delete(FileIndex *index, size_t pos, const EntryHash hash_fn) {
+    size_t next = pos;
+    index->slots[pos] = NULL;
+    while (true) {
+        next = (next + 1) & index->mask;
+        FileEntry *entry = index->slots[next];
+        if (entry == NULL) {
+            return;
+        }
+        // entry may fill the hole if its home slot is not in (pos, next]
+        const size_t home = hash_fn(entry) & index->mask;
+        if (((next - home) & index->mask) >= ((next - pos) & index->mask)) {
+            index->slots[pos] = entry;
+            index->slots[next] = NULL;
+            pos = next;
+        }
+    }
+}
+
+// returns the slot holding entry (compared by address)
+static size_t index_slot_of(const FileIndex *index, const FileEntry *entry, const EntryHash hash_fn) {
+    size_t pos = hash_fn(entry) & index->mask;
+    while (index->slots[pos] != entry) {
+        pos = (pos + 1) & index->mask;
+    }
+    return pos;
+}
+
+static int grow(FileTable *t) {
+    const size_t capacity = (t->by_id.mask + 1) * 2;
+    FileIndex by_id, by_path = {0};
+    if (index_init(&by_id, capacity) < 0) {
+        return -1;
+    }
+    if (t->index_paths && index_init(&by_path, capacity) < 0) {
+        free(by_id.slots);
+        return -1;
+    }
+
+    for (size_t i = 0; i <= t->by_id.mask; i++) {
+        FileEntry *entry = t->by_id.slots[i];
+        if (entry != NULL) {
+            index_put(&by_id, entry, entry_id_hash);
+            if (t->index_paths) {
+                index_put(&by_path, entry, entry_path_hash);
+            }
+        }
+    }
+
+    free(t->by_id.slots);
+    free(t->by_path.slots);
+    t->by_id = by_id;
+    t->by_path = by_path;
+    return 0;
+}
+
+void file_table_init(FileTable *t, const bool index_paths, const bool index_order) {
+    memset(t, 0, sizeof(FileTable));
+    t->index_paths = index_paths;
+    t->index_order = index_order;
+    key_index_init(&t->by_order);
+    if (index_init(&t->by_id, FILE_TABLE_INITIAL_CAPACITY) < 0 ||
+        (index_paths && index_init(&t->by_path, FILE_TABLE_INITIAL_CAPACITY) < 0) ||
+        (index_order && merkle_init(&t->tree) < 0)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+void file_table_free(FileTable *t) {
+    for (size_t i = 0; i <= t->by_id.mask; i++) {
+        free(t->by_id.slots[i]);
+    }
+    free(t->by_id.slots);
+    free(t->by_path.slots);
+    key_index_free(&t->by_order);
+    merkle_free(&t->tree);
+    memset(t, 0, sizeof(FileTable));
+}
+
+void file_table_clear(FileTable *t) {
+    const bool index_paths = t->index_paths;
+    const bool index_order = t->index_order;
+    file_table_free(t);
+    file_table_init(t, index_paths, index_order);
+}
+
+int file_table_insert(FileTable *t, FileEntry *entry) {
+    file_table_remove(t, entry->id);
+
+    if ((t->count + 1) * 100 > (t->by_id.mask + 1) * FILE_TABLE_MAX_LOAD && grow(t) < 0) {
+        return -1;
+    }
+    if (t->index_order && key_index_insert(&t->by_order, entry) < 0) {
+        return -1;
+    }
+    index_put(&t->by_id, entry, entry_id_hash);
+    if (t->index_paths) {
+        index_put(&t->by_path, entry, entry_path_hash);
+    }
+    merkle_add(&t->tree, entry);
+    t->count++;
+    return 0;
+}
+
+FileEntry *file_table_find(const FileTable *t, const uint8_t *id) {
+    size_t pos = id_hash(id) & t->by_id.mask;
+    FileEntry *entry;
+    while ((entry = t->by_id.slots[pos]) != NULL) {
+        if (memcmp(entry->id, id, HASH_SIZE) == 0) {
+            return entry;
+        }
+        pos = (pos + 1) & t->by_id.mask;
+    }
+    return NULL;
+}
+
+FileEntry *file_table_find_path(const FileTable *t, const char *filepath) {
+    size_t pos = path_hash(filepath) & t->by_path.mask;
+    FileEntry *entry;
+    while ((entry = t->by_path.slots[pos]) != NULL) {
+        if (strcmp(entry->path, filepath) == 0) {
+            return entry;
+        }
+        pos = (pos + 1) & t->by_path.mask;
+    }
+    return NULL;
+}
+
+int file_table_remove(FileTable *t, const uint8_t *id) {
+    size_t pos = id_hash(id) & t->by_id.mask;
+    FileEntry *entry;
+    while ((entry = t->by_id.slots[pos]) != NULL && memcmp(entry->id, id, HASH_SIZE) != 0) {
+        pos = (pos + 1) & t->by_id.mask;
+    }
+    if (entry == NULL) {
+        return -1;
+    }
+
+    index_delete(&t->by_id, pos, entry_id_hash);
+    if (t->index_paths) {
+        index_delete(&t->by_path, index_slot_of(&t->by_path, entry, entry_path_hash), entry_path_hash);
+    }
+    if (t->index_order) {
+        key_index_remove(&t->by_order, id);
+    }
+    merkle_remove(&t->tree, entry);
+    t->count--;
+    free(entry);
+    return 0;
+}
+
+typedef struct {
+    FileTable *table;
+    FileEntry **entries;
+    size_t count;
+    size_t capacity;
+} TakenEntries;
+
+// unlinks an entry cut out of the order index from the other indexes and collects it
+static void take_entry(FileEntry *entry, void *arg) {
+    TakenEntries *taken = (TakenEntries *) arg;
+    FileTable *t = taken->table;
+
+    index_delete(&t->by_id, index_slot_of(&t->by_id, entry, entry_id_hash), entry_id_hash);
+    if (t->index_paths) {
+        index_delete(&t->by_path, index_slot_of(&t->by_path, entry, entry_path_hash), entry_path_hash);
+    }
+    merkle_remove(&t->tree, entry);
+    t->count--;
+
+    if (taken->count == taken->capacity) {
+        taken->capacity = taken->capacity > 0 ? taken->capacity * 2 : 64;
+        taken->entries = (FileEntry **) realloc(taken->entries, taken->capacity * sizeof(FileEntry *));
+        if (taken->entries == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    taken->entries[taken->count++] = entry;
+}
+
+size_t file_table_take_range(FileTable *t, const uint8_t *from, const uint8_t *to, FileEntry ***entries) {
+    TakenEntries taken = {t, NULL, 0, 0};
+    key_index_take_range(&t->by_order, from, to, take_entry, &taken);
+    *entries = taken.entries;
+    return taken.count;
+}
+
+void file_table_visit(const FileTable *t, const uint8_t *lo, const uint8_t *hi, const KeyVisitor visit, void *arg) {
+    key_index_visit(&t->by_order, lo, hi, visit, arg);
+}
+
+FileEntry *file_table_next(const FileTable *t, size_t *pos) {
+    while (*pos <= t->by_id.mask) {
+        FileEntry *entry = t->by_id.slots[(*pos)++];
+        if (entry != NULL) {
+            return entry;
+        }
+    }
+    return NULL;
+}
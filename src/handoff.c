@@ -0,0 +1,379 @@
+#include "handoff.h"
+#include "protocol.h"
+#include "rpc.h"
+#include "sha1.h"
+#include "message_pool.h"
+#include "metadata_store.h"
+#include "replication.h"
+#include "threads.h"
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define BLOCK_PAYLOAD (sizeof(((Message *) 0)->data) - HANDOFF_HEADER)
+
+// state of the block being encoded or decoded, records refer back to it
+typedef struct {
+    const char *prev_path;
+    size_t prev_len;
+    uint32_t owner_addr[HANDOFF_OWNERS]; // network byte order
+    uint16_t owner_port[HANDOFF_OWNERS]; // network byte order
+    int owners;
+} BlockState;
+
+// growable list of the segments to send
+typedef struct {
+    Message *msgs;
+    size_t count;
+    size_t capacity;
+    const Message *header;
+} Segments;
+
+static size_t put_varint(uint8_t *p, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        p[len++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    p[len++] = (uint8_t) value;
+    return len;
+}
+
+// reads a varint from [*p, end), returns -1 if it is truncated
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        const uint8_t byte = *(*p)++;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// appends the record of entry to out, returns its length (at most HASH_SIZE + 6 + 3 * 10 + path_len)
+static size_t encode_record(BlockState *state, const FileEntry *entry, uint8_t *out) {
+    uint8_t *p = out;
+    memcpy(p, entry->id, HASH_SIZE);
+    p += HASH_SIZE;
+
+    const uint32_t addr = entry->owner->addr.sin_addr.s_addr;
+    const uint16_t port = entry->owner->addr.sin_port;
+    int owner = 0;
+    while (owner < state->owners && (state->owner_addr[owner] != addr || state->owner_port[owner] != port)) {
+        owner++;
+    }
+    if (owner < state->owners) {
+        p += put_varint(p, owner + 1);
+    } else {
+        p += put_varint(p, 0);
+        memcpy(p, &addr, 4);
+        memcpy(p + 4, &port, 2);
+        p += 6;
+        if (state->owners < HANDOFF_OWNERS) {
+            state->owner_addr[state->owners] = addr;
+            state->owner_port[state->owners] = port;
+            state->owners++;
+        }
+    }
+
+    size_t shared = 0;
+    while (shared < state->prev_len && shared < entry->path_len && state->prev_path[shared] == entry->path[shared]) {
+        shared++;
+    }
+    p += put_varint(p, shared);
+    p += put_varint(p, entry->path_len - shared);
+    memcpy(p, entry->path + shared, entry->path_len - shared);
+    p += entry->path_len - shared;
+
+    state->prev_path = entry->path;
+    state->prev_len = entry->path_len;
+    return p - out;
+}
+
+static int add_segment(Segments *segments, const uint8_t flags, const uint8_t *payload, const size_t len) {
+    if (segments->count == segments->capacity) {
+        const size_t capacity = segments->capacity > 0 ? segments->capacity * 2 : 16;
+        Message *msgs = (Message *) realloc(segments->msgs, capacity * sizeof(Message));
+        if (msgs == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        segments->msgs = msgs;
+        segments->capacity = capacity;
+    }
+
+    Message *segment = &segments->msgs[segments->count];
+    memcpy(segment, segments->header, offsetof(Message, data));
+    segment->type = MSG_FILE_DATA;
+    segment->segment_index = (uint32_t) segments->count;
+    segment->data[0] = HANDOFF_VERSION;
+    segment->data[1] = (char) flags;
+    memcpy(segment->data + HANDOFF_HEADER, payload, len);
+    segment->data_len = HANDOFF_HEADER + len;
+    segments->count++;
+    return 0;
+}
+
+// deflates raw into out (BLOCK_PAYLOAD bytes), returns the compressed length or 0 if it does not fit
+static size_t deflate_block(const uint8_t *raw, const size_t raw_len, uint8_t *out) {
+    uLongf out_len = BLOCK_PAYLOAD;
+    if (compress2(out, &out_len, raw, raw_len, Z_BEST_SPEED) != Z_OK) {
+        return 0;
+    }
+    return out_len;
+}
+
+// encodes entries into as few blocks as possible, appending them to segments
+static int encode_blocks(Segments *segments, FileEntry *const *entries, const size_t count) {
+    static _Thread_local uint8_t raw[HANDOFF_RAW_MAX];
+    static _Thread_local uint8_t packed[BLOCK_PAYLOAD];
+    size_t ends[HANDOFF_RAW_MAX / HASH_SIZE]; // end of each record in raw
+    size_t i = 0;
+
+    while (i < count) {
+        // gather records until the uncompressed limit
+        BlockState state = {0};
+        size_t raw_len = 0;
+        size_t n = 0;
+        uint8_t record[HASH_SIZE + 6 + 30 + MAX_FILEPATH];
+        while (i + n < count) {
+            BlockState next = state;
+            const size_t len = encode_record(&next, entries[i + n], record);
+            if (raw_len + len > HANDOFF_RAW_MAX) {
+                break;
+            }
+            memcpy(raw + raw_len, record, len);
+            raw_len += len;
+            ends[n++] = raw_len;
+            state = next;
+        }
+
+        // the longest prefix that fits uncompressed is the fallback
+        size_t fits = 0;
+        while (fits < n && ends[fits] <= BLOCK_PAYLOAD) {
+            fits++;
+        }
+
+        // otherwise try to squeeze more records into the block by compressing them, halving on overflow
+        size_t k = n;
+        size_t packed_len = 0;
+        while (k > fits && ends[k - 1] >= HANDOFF_COMPRESS_MIN) {
+            if ((packed_len = deflate_block(raw, ends[k - 1], packed)) > 0) {
+                break;
+            }
+            k = k / 2 > fits ? k / 2 : fits;
+        }
+        if (k > fits && packed_len > 0) {
+            if (add_segment(segments, HANDOFF_FLAG_DEFLATE, packed, packed_len) < 0) {
+                return -1;
+            }
+            i += k;
+            continue;
+        }
+
+        if (fits > 0) {
+            // even a block that fits may shrink on the wire
+            packed_len = ends[fits - 1] >= HANDOFF_COMPRESS_MIN ? deflate_block(raw, ends[fits - 1], packed) : 0;
+            const int result = packed_len > 0 && packed_len < ends[fits - 1]
+                                   ? add_segment(segments, HANDOFF_FLAG_DEFLATE, packed, packed_len)
+                                   : add_segment(segments, 0, raw, ends[fits - 1]);
+            if (result < 0) {
+                return -1;
+            }
+            i += fits;
+            continue;
+        }
+
+        // a single record larger than a block: compressed if possible, else spread over several blocks
+        if (ends[0] >= HANDOFF_COMPRESS_MIN && (packed_len = deflate_block(raw, ends[0], packed)) > 0) {
+            if (add_segment(segments, HANDOFF_FLAG_DEFLATE, packed, packed_len) < 0) {
+                return -1;
+            }
+        } else {
+            for (size_t off = 0; off < ends[0]; off += BLOCK_PAYLOAD) {
+                const size_t len = ends[0] - off < BLOCK_PAYLOAD ? ends[0] - off : BLOCK_PAYLOAD;
+                const uint8_t flags = off + len < ends[0] ? HANDOFF_FLAG_CONTINUES : 0;
+                if (add_segment(segments, flags, raw + off, len) < 0) {
+                    return -1;
+                }
+            }
+        }
+        i++;
+    }
+    return 0;
+}
+
+int send_file_entries(const Node *n, const Peer *target, const Message *header, FileEntry *const *entries,
+                      const size_t count) {
+    Segments segments = {NULL, 0, 0, header};
+    if (encode_blocks(&segments, entries, count) < 0) {
+        free(segments.msgs);
+        return -1;
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < segments.count; i++) {
+        segments.msgs[i].total_segments = (uint32_t) segments.count;
+    }
+    for (size_t i = 0; i < segments.count && result == 0; i += SEND_BATCH) {
+        const int batch = segments.count - i < SEND_BATCH ? (int) (segments.count - i) : SEND_BATCH;
+        if (send_messages_to_peer(n, target, &segments.msgs[i], batch) < batch) {
+            result = -1;
+        }
+    }
+    free(segments.msgs);
+
+    Message end;
+    memcpy(&end, header, offsetof(Message, data));
+    end.type = MSG_FILE_END;
+    end.data_len = 0;
+    if (send_to_peer(n, target, &end) < 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// decodes the records of one (uncompressed) block into table, returns the number added
+static int decode_records(Node *n, const StoreTable table, const uint8_t *p, const uint8_t *end) {
+    BlockState state = {0};
+    char path[MAX_FILEPATH];
+    int added = 0;
+
+    while (p < end) {
+        if (end - p < HASH_SIZE) {
+            return added;
+        }
+        const uint8_t *id = p;
+        p += HASH_SIZE;
+
+        uint64_t owner, shared, rest;
+        uint32_t owner_addr = 0;
+        uint16_t owner_port = 0;
+        if (get_varint(&p, end, &owner) < 0) {
+            return added;
+        }
+        if (owner == 0) {
+            if (end - p < 6) {
+                return added;
+            }
+            // an owner past a full table is used for this record only, the encoder does not refer back to it
+            memcpy(&owner_addr, p, 4);
+            memcpy(&owner_port, p + 4, 2);
+            if (state.owners < HANDOFF_OWNERS) {
+                state.owner_addr[state.owners] = owner_addr;
+                state.owner_port[state.owners] = owner_port;
+                state.owners++;
+            }
+            p += 6;
+        } else if (owner <= (uint64_t) state.owners) {
+            owner_addr = state.owner_addr[owner - 1];
+            owner_port = state.owner_port[owner - 1];
+        }
+        if (owner > (uint64_t) state.owners || get_varint(&p, end, &shared) < 0 || get_varint(&p, end, &rest) < 0 ||
+            shared > state.prev_len || shared + rest >= MAX_FILEPATH || (uint64_t) (end - p) < rest) {
+            fprintf(stderr, "Dropping a malformed handoff block\n");
+            return added;
+        }
+        // path still holds the previous record's path, whose first shared bytes are kept
+        memcpy(path + shared, p, rest);
+        path[shared + rest] = '\0';
+        p += rest;
+        state.prev_path = path;
+        state.prev_len = shared + rest;
+
+        char ip[16];
+        struct in_addr addr = {owner_addr};
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        FileEntry *entry = create_file_entry(id, path, intern_peer(ip, ntohs(owner_port)));
+        if (entry == NULL) {
+            return added;
+        }
+
+        pthread_mutex_lock(&n->files_lock);
+        if (file_table_insert(store_table(n, table), entry) < 0) {
+            free(entry);
+        } else {
+            metadata_store_put(n->store, table, entry);
+            // an entry this node becomes responsible for is no replica anymore, and gets replicas of its own
+            if (table == STORE_FILES) {
+                if (file_table_remove(&n->replicas, id) == 0) {
+                    metadata_store_remove(n->store, STORE_REPLICAS, id);
+                }
+                replicate_put(n, entry);
+            }
+            added++;
+        }
+        pthread_mutex_unlock(&n->files_lock);
+    }
+    return added;
+}
+
+int receive_file_entries(Node *n, const uint32_t request_id, const StoreTable table) {
+    static _Thread_local uint8_t raw[HANDOFF_RAW_MAX];
+    uint8_t *pending = NULL; // pieces of a record spread over several blocks
+    size_t pending_len = 0;
+    uint32_t expected = 0;
+    int added = 0;
+    Message *segment;
+
+    while ((segment = pop_message_timeout(&download_queue, request_id, RPC_DEADLINE_MS)) != NULL &&
+           segment->type != MSG_FILE_END) {
+        const uint8_t *data = (const uint8_t *) segment->data;
+        if (segment->data_len < HANDOFF_HEADER || data[0] != HANDOFF_VERSION) {
+            fprintf(stderr, "Dropping a handoff block of unknown version\n");
+            release_message(segment);
+            continue;
+        }
+        const uint8_t flags = data[1];
+        const uint8_t *payload = data + HANDOFF_HEADER;
+        size_t len = segment->data_len - HANDOFF_HEADER;
+
+        // a gap breaks a record spread over several blocks
+        if (segment->segment_index != expected) {
+            pending_len = 0;
+        }
+        expected = segment->segment_index + 1;
+
+        if (flags & HANDOFF_FLAG_DEFLATE) {
+            uLongf raw_len = sizeof(raw);
+            if (uncompress(raw, &raw_len, payload, len) != Z_OK) {
+                fprintf(stderr, "Dropping a corrupt handoff block\n");
+                release_message(segment);
+                continue;
+            }
+            payload = raw;
+            len = raw_len;
+        }
+
+        if (flags & HANDOFF_FLAG_CONTINUES || pending_len > 0) {
+            uint8_t *grown = (uint8_t *) realloc(pending, pending_len + len);
+            if (grown == NULL) {
+                perror("realloc");
+                release_message(segment);
+                continue;
+            }
+            pending = grown;
+            memcpy(pending + pending_len, payload, len);
+            pending_len += len;
+            if (!(flags & HANDOFF_FLAG_CONTINUES)) {
+                added += decode_records(n, table, pending, pending + pending_len);
+                pending_len = 0;
+            }
+        } else {
+            added += decode_records(n, table, payload, payload + len);
+        }
+        release_message(segment);
+    }
+
+    free(pending);
+    if (segment == NULL) {
+        return -1;
+    }
+    release_message(segment);
+    return added;
+}
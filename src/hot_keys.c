@@ -0,0 +1,104 @@
+#include "hot_keys.h"
+#include "location_cache.h"
+#include "sha1.h"
+#include "stabilization.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <string.h>
+
+#define PUSH_HEADER (1 + 4 + 2) // u8 depth + owner IPv4 address and port
+
+typedef struct {
+    uint8_t id[HASH_SIZE];
+    uint32_t count; // requests in the current window
+    uint64_t window_start_us;
+    uint64_t pushed_us; // last push of the key, 0 if never
+} HotKeySlot;
+
+static HotKeySlot slots[HOT_KEY_SLOTS];
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool hot_key_hit(const uint8_t *id) {
+    HotKeySlot *slot = &slots[((size_t) id[0] << 8 | id[1]) & (HOT_KEY_SLOTS - 1)];
+    const uint64_t now = monotonic_us();
+    bool push = false;
+
+    pthread_mutex_lock(&slots_lock);
+    if (memcmp(slot->id, id, HASH_SIZE) != 0) {
+        memcpy(slot->id, id, HASH_SIZE);
+        slot->count = 0;
+        slot->window_start_us = now;
+        slot->pushed_us = 0;
+    } else if (now - slot->window_start_us >= HOT_KEY_WINDOW_MS * 1000ULL) {
+        slot->count = 0;
+        slot->window_start_us = now;
+    }
+    slot->count++;
+    if (slot->count >= HOT_KEY_THRESHOLD &&
+        (slot->pushed_us == 0 || now - slot->pushed_us >= LOCATION_CACHE_TTL_MS * 1000ULL / 2)) {
+        slot->pushed_us = now;
+        push = true;
+    }
+    pthread_mutex_unlock(&slots_lock);
+    return push;
+}
+
+// sends a HOT_KEY push with depth nodes left to msg's predecessor
+static void send_push(Node *n, Message *msg, const uint8_t depth) {
+    const Peer *predecessor = get_predecessor(n);
+    if (predecessor == NULL || predecessor == n->self || predecessor == find_peer_addr(msg->ip, msg->port)) {
+        return; // nobody precedes this node on the lookup paths of the key
+    }
+    msg->request_id = generate_id();
+    msg->data[0] = (char) depth;
+    send_to_peer(n, predecessor, msg);
+}
+
+void push_hot_key(Node *n, const FileInfo *file) {
+    const size_t path_len = strlen(file->filepath);
+    Message msg = {0};
+    if (PUSH_HEADER + path_len > sizeof(msg.data)) {
+        return; // lookups of this key keep going to the responsible node
+    }
+
+    msg.type = MSG_HOT_KEY;
+    memcpy(msg.id, file->id, HASH_SIZE);
+    strcpy(msg.ip, n->ip);
+    msg.port = n->port;
+    struct in_addr addr;
+    const uint16_t port = htons((uint16_t) file->owner_port);
+    inet_pton(AF_INET, file->owner_ip, &addr);
+    memcpy(msg.data + 1, &addr.s_addr, 4);
+    memcpy(msg.data + 5, &port, 2);
+    memcpy(msg.data + PUSH_HEADER, file->filepath, path_len);
+    msg.data_len = PUSH_HEADER + path_len;
+    send_push(n, &msg, HOT_KEY_PUSH_DEPTH);
+}
+
+void accept_hot_key(Node *n, const Message *msg) {
+    if (msg->data_len <= PUSH_HEADER || msg->data_len - PUSH_HEADER >= MAX_FILEPATH) {
+        return;
+    }
+
+    FileInfo info;
+    struct in_addr addr;
+    uint16_t port;
+    memcpy(info.id, msg->id, HASH_SIZE);
+    memcpy(&addr.s_addr, msg->data + 1, 4);
+    memcpy(&port, msg->data + 5, 2);
+    inet_ntop(AF_INET, &addr, info.owner_ip, sizeof(info.owner_ip));
+    info.owner_port = ntohs(port);
+    memcpy(info.filepath, msg->data + PUSH_HEADER, msg->data_len - PUSH_HEADER);
+    info.filepath[msg->data_len - PUSH_HEADER] = '\0';
+
+    // the responsible node is asked again when the copy is about to expire
+    location_cache_put(&info, intern_peer(msg->ip, msg->port));
+
+    const uint8_t depth = (uint8_t) msg->data[0];
+    if (depth > 1) {
+        Message forward;
+        memcpy(&forward, msg, sizeof(Message));
+        send_push(n, &forward, depth - 1);
+    }
+}
@@ -0,0 +1,56 @@
+#include "id160.h"
+#include <string.h>
+
+void id160_from_bytes(uint160 *out, const uint8_t *bytes) {
+    for (int i = 0; i < ID160_WORDS; i++) {
+        const uint8_t *b = bytes + 4 * i;
+        out->w[i] = (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 | (uint32_t) b[2] << 8 | b[3];
+    }
+}
+
+void id160_to_bytes(uint8_t *bytes, const uint160 *id) {
+    for (int i = 0; i < ID160_WORDS; i++) {
+        bytes[4 * i] = (uint8_t) (id->w[i] >> 24);
+        bytes[4 * i + 1] = (uint8_t) (id->w[i] >> 16);
+        bytes[4 * i + 2] = (uint8_t) (id->w[i] >> 8);
+        bytes[4 * i + 3] = (uint8_t) id->w[i];
+    }
+}
+
+int id160_cmp(const uint160 *a, const uint160 *b) {
+    for (int i = 0; i < ID160_WORDS; i++) {
+        if (a->w[i] != b->w[i]) {
+            return a->w[i] < b->w[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+void id160_add(uint160 *out, const uint160 *a, const uint160 *b) {
+    uint64_t carry = 0;
+    for (int i = ID160_WORDS - 1; i >= 0; i--) {
+        const uint64_t sum = (uint64_t) a->w[i] + b->w[i] + carry;
+        out->w[i] = (uint32_t) sum;
+        carry = sum >> 32;
+    }
+}
+
+void id160_distance(uint160 *out, const uint160 *a, const uint160 *b) {
+    uint64_t borrow = 0;
+    for (int i = ID160_WORDS - 1; i >= 0; i--) {
+        const uint64_t diff = (uint64_t) b->w[i] - a->w[i] - borrow;
+        out->w[i] = (uint32_t) diff;
+        borrow = diff >> 63; // wrapped below zero
+    }
+}
+
+void id160_pow2(uint160 *out, const int i) {
+    memset(out, 0, sizeof(uint160));
+    out->w[ID160_WORDS - 1 - i / 32] = 1u << (i % 32);
+}
+
+void id160_add_pow2(uint160 *out, const uint160 *a, const int i) {
+    uint160 offset;
+    id160_pow2(&offset, i);
+    id160_add(out, a, &offset);
+}
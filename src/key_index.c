@@ -0,0 +1,200 @@
+#include "key_index.h"
+#include "file_entry.h"
+#include "sha1.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int cmp_id(const uint8_t *a, const uint8_t *b) {
+    return memcmp(a, b, HASH_SIZE);
+}
+
+// returns the first chunk whose last entry is >= id (or > id if strict), index->count if there is none
+static size_t find_chunk(const KeyIndex *index, const uint8_t *id, const bool strict) {
+    size_t lo = 0, hi = index->count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const KeyChunk *chunk = index->chunks[mid];
+        const int c = cmp_id(chunk->entries[chunk->count - 1]->id, id);
+        if (c > 0 || (c == 0 && !strict)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// returns the position of the first entry of chunk that is >= id (or > id if strict)
+static size_t find_position(const KeyChunk *chunk, const uint8_t *id, const bool strict) {
+    size_t lo = 0, hi = chunk->count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const int c = cmp_id(chunk->entries[mid]->id, id);
+        if (c > 0 || (c == 0 && !strict)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// inserts chunk at position at of the chunk array
+static int add_chunk(KeyIndex *index, const size_t at, KeyChunk *chunk) {
+    if (index->count == index->capacity) {
+        const size_t capacity = index->capacity > 0 ? index->capacity * 2 : 16;
+        KeyChunk **chunks = (KeyChunk **) realloc(index->chunks, capacity * sizeof(KeyChunk *));
+        if (chunks == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        index->chunks = chunks;
+        index->capacity = capacity;
+    }
+    memmove(&index->chunks[at + 1], &index->chunks[at], (index->count - at) * sizeof(KeyChunk *));
+    index->chunks[at] = chunk;
+    index->count++;
+    return 0;
+}
+
+// frees the chunks [first, last) and closes the gap they leave
+static void drop_chunks(KeyIndex *index, const size_t first, const size_t last) {
+    for (size_t i = first; i < last; i++) {
+        free(index->chunks[i]);
+    }
+    memmove(&index->chunks[first], &index->chunks[last], (index->count - last) * sizeof(KeyChunk *));
+    index->count -= last - first;
+}
+
+void key_index_init(KeyIndex *index) {
+    memset(index, 0, sizeof(KeyIndex));
+}
+
+void key_index_free(KeyIndex *index) {
+    drop_chunks(index, 0, index->count);
+    free(index->chunks);
+    memset(index, 0, sizeof(KeyIndex));
+}
+
+int key_index_insert(KeyIndex *index, FileEntry *entry) {
+    if (index->count == 0) {
+        KeyChunk *chunk = (KeyChunk *) malloc(sizeof(KeyChunk));
+        if (chunk == NULL || add_chunk(index, 0, chunk) < 0) {
+            free(chunk);
+            return -1;
+        }
+        chunk->entries[0] = entry;
+        chunk->count = 1;
+        return 0;
+    }
+
+    // an ID past the last entry goes to the end of the last chunk
+    size_t c = find_chunk(index, entry->id, false);
+    if (c == index->count) {
+        c--;
+    }
+    KeyChunk *chunk = index->chunks[c];
+
+    if (chunk->count == KEY_INDEX_CHUNK) {
+        KeyChunk *upper = (KeyChunk *) malloc(sizeof(KeyChunk));
+        if (upper == NULL || add_chunk(index, c + 1, upper) < 0) {
+            free(upper);
+            return -1;
+        }
+        upper->count = KEY_INDEX_CHUNK / 2;
+        chunk->count = KEY_INDEX_CHUNK - upper->count;
+        memcpy(upper->entries, &chunk->entries[chunk->count], upper->count * sizeof(FileEntry *));
+        if (cmp_id(entry->id, upper->entries[0]->id) > 0) {
+            chunk = upper;
+        }
+    }
+
+    const size_t pos = find_position(chunk, entry->id, false);
+    memmove(&chunk->entries[pos + 1], &chunk->entries[pos], (chunk->count - pos) * sizeof(FileEntry *));
+    chunk->entries[pos] = entry;
+    chunk->count++;
+    return 0;
+}
+
+int key_index_remove(KeyIndex *index, const uint8_t *id) {
+    const size_t c = find_chunk(index, id, false);
+    if (c == index->count) {
+        return -1;
+    }
+    KeyChunk *chunk = index->chunks[c];
+    const size_t pos = find_position(chunk, id, false);
+    if (pos == chunk->count || cmp_id(chunk->entries[pos]->id, id) != 0) {
+        return -1;
+    }
+
+    chunk->count--;
+    memmove(&chunk->entries[pos], &chunk->entries[pos + 1], (chunk->count - pos) * sizeof(FileEntry *));
+    if (chunk->count == 0) {
+        drop_chunks(index, c, c + 1);
+    }
+    return 0;
+}
+
+// takes the linear range (lo, hi], a NULL bound is open
+static size_t take_linear(KeyIndex *index, const uint8_t *lo, const uint8_t *hi, const KeyVisitor visit, void *arg) {
+    size_t taken = 0;
+    size_t c = lo != NULL ? find_chunk(index, lo, true) : 0;
+    const size_t first_chunk = c;
+    size_t empty_from = index->count, empty_to = index->count; // emptied chunks, always contiguous
+
+    while (c < index->count) {
+        KeyChunk *chunk = index->chunks[c];
+        const size_t count = chunk->count;
+        const size_t start = c == first_chunk && lo != NULL ? find_position(chunk, lo, true) : 0;
+        const size_t end = hi != NULL ? find_position(chunk, hi, true) : chunk->count;
+
+        for (size_t i = start; i < end; i++) {
+            visit(chunk->entries[i], arg);
+        }
+        taken += end - start;
+        memmove(&chunk->entries[start], &chunk->entries[end], (chunk->count - end) * sizeof(FileEntry *));
+        chunk->count -= end - start;
+
+        if (chunk->count == 0) {
+            if (empty_from == index->count) {
+                empty_from = c;
+            }
+            empty_to = c + 1;
+        }
+        if (end < count) {
+            break; // the range ends inside this chunk
+        }
+        c++;
+    }
+
+    if (empty_from < empty_to) {
+        drop_chunks(index, empty_from, empty_to);
+    }
+    return taken;
+}
+
+size_t key_index_take_range(KeyIndex *index, const uint8_t *from, const uint8_t *to, const KeyVisitor visit,
+                            void *arg) {
+    if (cmp_id(from, to) < 0) {
+        return take_linear(index, from, to, visit, arg);
+    }
+    // the interval wraps around zero: (from, max] followed by [0, to]
+    const size_t taken = take_linear(index, from, NULL, visit, arg);
+    return taken + take_linear(index, NULL, to, visit, arg);
+}
+
+void key_index_visit(const KeyIndex *index, const uint8_t *lo, const uint8_t *hi, const KeyVisitor visit,
+                     void *arg) {
+    const size_t first_chunk = find_chunk(index, lo, false);
+    for (size_t c = first_chunk; c < index->count; c++) {
+        const KeyChunk *chunk = index->chunks[c];
+        for (size_t i = c == first_chunk ? find_position(chunk, lo, false) : 0; i < chunk->count; i++) {
+            if (cmp_id(chunk->entries[i]->id, hi) > 0) {
+                return;
+            }
+            visit(chunk->entries[i], arg);
+        }
+    }
+}
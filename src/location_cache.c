@@ -0,0 +1,252 @@
+#include "location_cache.h"
+#include "rpc.h"
+#include "sha1.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHARD_CAPACITY (LOCATION_CACHE_SIZE / LOCATION_CACHE_SHARDS)
+#define SHARD_BUCKETS (SHARD_CAPACITY * 2) // power of two
+
+typedef struct CachedLocation {
+    uint8_t id[HASH_SIZE];
+    Peer *owner;
+    Peer *source; // node that answered the lookup, asked again to refresh the entry
+    uint64_t expires_us;
+    bool refreshing; // a refresh is in flight
+    struct CachedLocation *next_in_bucket;
+    struct CachedLocation *newer; // LRU list, newest first
+    struct CachedLocation *older;
+    char path[]; // NUL-terminated filepath on the owner
+} CachedLocation;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CachedLocation *buckets[SHARD_BUCKETS];
+    CachedLocation *newest;
+    CachedLocation *oldest;
+    size_t count;
+} Shard;
+
+// refresh in flight
+typedef struct {
+    uint8_t id[HASH_SIZE];
+    Peer *source;
+} Refresh;
+
+static Shard shards[LOCATION_CACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static atomic_ulong hits, misses, refreshes;
+
+static void init_shards() {
+    for (int i = 0; i < LOCATION_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+// the bytes of a SHA-1 digest are uniformly distributed: the first picks the shard, the next two the bucket
+static Shard *shard_of(const uint8_t *id) {
+    pthread_once(&shards_once, init_shards);
+    return &shards[id[0] & (LOCATION_CACHE_SHARDS - 1)];
+}
+
+static size_t bucket_of(const uint8_t *id) {
+    return ((size_t) id[1] << 8 | id[2]) & (SHARD_BUCKETS - 1);
+}
+
+// returns the entry of id and the link pointing to it, the shard lock must be held
+static CachedLocation *lookup(Shard *shard, const uint8_t *id, CachedLocation ***link) {
+    CachedLocation **l = &shard->buckets[bucket_of(id)];
+    while (*l != NULL && memcmp((*l)->id, id, HASH_SIZE) != 0) {
+        l = &(*l)->next_in_bucket;
+    }
+    if (link != NULL) {
+        *link = l;
+    }
+    return *l;
+}
+
+static void lru_unlink(Shard *shard, CachedLocation *entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        shard->newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
+    }
+}
+
+static void lru_push(Shard *shard, CachedLocation *entry) {
+    entry->newer = NULL;
+    entry->older = shard->newest;
+    if (shard->newest != NULL) {
+        shard->newest->newer = entry;
+    } else {
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+}
+
+// unlinks and frees the entry link points to, the shard lock must be held
+static void drop(Shard *shard, CachedLocation **link) {
+    CachedLocation *entry = *link;
+    *link = entry->next_in_bucket;
+    lru_unlink(shard, entry);
+    shard->count--;
+    free(entry);
+}
+
+bool location_cache_get(const uint8_t *id, FileInfo *info, Peer **refresh) {
+    Shard *shard = shard_of(id);
+    const uint64_t now = monotonic_us();
+    *refresh = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    CachedLocation **link;
+    CachedLocation *entry = lookup(shard, id, &link);
+    if (entry != NULL && entry->expires_us <= now) {
+        drop(shard, link);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        atomic_fetch_add(&misses, 1);
+        return false;
+    }
+
+    lru_unlink(shard, entry);
+    lru_push(shard, entry);
+    memcpy(info->id, entry->id, HASH_SIZE);
+    strcpy(info->filepath, entry->path);
+    const char *filename = strrchr(entry->path, '/');
+    strncpy(info->filename, filename != NULL ? filename + 1 : entry->path, sizeof(info->filename) - 1);
+    info->filename[sizeof(info->filename) - 1] = '\0';
+    strcpy(info->owner_ip, entry->owner->ip);
+    info->owner_port = entry->owner->port;
+
+    // a hot entry is refreshed before it expires, so its lookups never have to wait for the network
+    if (!entry->refreshing && entry->expires_us - now < LOCATION_CACHE_REFRESH_MS * 1000ULL) {
+        entry->refreshing = true;
+        *refresh = entry->source;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add(&hits, 1);
+    return true;
+}
+
+void location_cache_put(const FileInfo *info, Peer *source) {
+    const size_t path_len = strlen(info->filepath);
+    CachedLocation *entry = (CachedLocation *) malloc(sizeof(CachedLocation) + path_len + 1);
+    if (entry == NULL) {
+        perror("malloc");
+        return;
+    }
+    memcpy(entry->id, info->id, HASH_SIZE);
+    entry->owner = intern_peer(info->owner_ip, info->owner_port);
+    entry->source = source;
+    entry->expires_us = monotonic_us() + LOCATION_CACHE_TTL_MS * 1000ULL;
+    entry->refreshing = false;
+    memcpy(entry->path, info->filepath, path_len + 1);
+
+    Shard *shard = shard_of(info->id);
+    pthread_mutex_lock(&shard->lock);
+    CachedLocation **link;
+    if (lookup(shard, info->id, &link) != NULL) {
+        drop(shard, link);
+    } else if (shard->count == SHARD_CAPACITY) {
+        lookup(shard, shard->oldest->id, &link);
+        drop(shard, link);
+    }
+    CachedLocation **head = &shard->buckets[bucket_of(info->id)];
+    entry->next_in_bucket = *head;
+    *head = entry;
+    lru_push(shard, entry);
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void location_cache_invalidate(const uint8_t *id) {
+    Shard *shard = shard_of(id);
+    pthread_mutex_lock(&shard->lock);
+    CachedLocation **link;
+    if (lookup(shard, id, &link) != NULL) {
+        drop(shard, link);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void on_refresh_reply(Node *n, const RpcStatus status, const Message *response, void *arg) {
+    (void) n;
+    Refresh *refresh = (Refresh *) arg;
+
+    // only a location that still fits in one reply replaces the entry, anything else drops it
+    if (status == RPC_OK && response->total_segments == 1 && response->data_len > 0 &&
+        response->data_len < sizeof(((FileInfo *) 0)->filepath) && memcmp(response->id, refresh->id, HASH_SIZE) == 0) {
+        FileInfo info;
+        memcpy(info.id, refresh->id, HASH_SIZE);
+        memcpy(info.filepath, response->data, response->data_len);
+        info.filepath[response->data_len] = '\0';
+        strcpy(info.owner_ip, response->ip);
+        info.owner_port = response->port;
+        location_cache_put(&info, refresh->source);
+    } else {
+        location_cache_invalidate(refresh->id);
+    }
+    free(refresh);
+}
+
+void location_cache_refresh(Node *n, const char *filename, Peer *source) {
+    Refresh *refresh = (Refresh *) malloc(sizeof(Refresh));
+    if (refresh == NULL) {
+        perror("malloc");
+        return;
+    }
+    hash(filename, refresh->id);
+    refresh->source = source;
+    atomic_fetch_add(&refreshes, 1);
+
+    Message msg = {0};
+    msg.request_id = generate_id();
+    msg.type = MSG_FIND_FILE;
+    memcpy(msg.id, refresh->id, HASH_SIZE);
+    strcpy(msg.ip, n->ip);
+    msg.port = n->port;
+    set_message_text(&msg, filename);
+    if (rpc_call_async(n, source->ip, source->port, &msg, RPC_DEADLINE_MS, on_refresh_reply, refresh) != RPC_OK) {
+        location_cache_invalidate(refresh->id);
+        free(refresh);
+    }
+}
+
+void location_cache_mark_peers() {
+    pthread_once(&shards_once, init_shards);
+    for (int i = 0; i < LOCATION_CACHE_SHARDS; i++) {
+        Shard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (const CachedLocation *entry = shard->newest; entry != NULL; entry = entry->older) {
+            mark_peer(entry->owner);
+            mark_peer(entry->source);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void get_location_cache_stats(LocationCacheStats *stats) {
+    stats->entries = 0;
+    for (int i = 0; i < LOCATION_CACHE_SHARDS; i++) {
+        Shard *shard = &shards[i];
+        pthread_once(&shards_once, init_shards);
+        pthread_mutex_lock(&shard->lock);
+        stats->entries += shard->count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    stats->hits = atomic_load(&hits);
+    stats->misses = atomic_load(&misses);
+    stats->refreshes = atomic_load(&refreshes);
+}
@@ -1,5 +1,11 @@
 #include "threads.h"
 #include "stabilization.h"
+#include "message_pool.h"
+#include "workers.h"
+#include "event_loop.h"
+#include "maintenance.h"
+#include "anti_entropy.h"
+#include "metadata_store.h"
 #include <sys/socket.h>
 #include <stdio.h>
 #include <pthread.h>
@@ -8,46 +14,82 @@
 #include <unistd.h>
 
 int main(const int argc, char *argv[]) {
-    init_queue(&reply_queue);
+    init_message_pool();
+    init_queue(&reply_queue, PENDING_RING_SMALL);
+    init_queue(&download_queue, PENDING_RING);
+    init_queue(&ack_queue, PENDING_RING);
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <IP> <PORT>\n", argv[0]);
+    int control_workers = CONTROL_WORKERS;
+    int bulk_workers = BULK_WORKERS;
+    const char *store_dir = NULL;
+    int replication = REPLICATION_FACTOR;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:b:d:k:")) != -1) {
+        switch (opt) {
+            case 'w':
+                control_workers = atoi(optarg);
+                break;
+            case 'b':
+                bulk_workers = atoi(optarg);
+                break;
+            case 'd':
+                store_dir = optarg;
+                break;
+            case 'k':
+                replication = atoi(optarg);
+                break;
+            default:
+                control_workers = 0;
+        }
+    }
+
+    const int args = argc - optind;
+    if ((args != 2 && args != 4) || control_workers < 1 || bulk_workers < 1 || replication < 1 ||
+        replication > SUCCESSOR_LIST_SIZE) {
+        fprintf(stderr, "Usage: %s [-w control_workers] [-b bulk_workers] [-d store_dir] [-k replicas] <IP> <PORT> [<ENTRY_IP> <ENTRY_PORT>]\n",
+                argv[0]);
         return EXIT_FAILURE;
     }
 
     signal(SIGINT, handle_exit); // gracefully handle ctrl+c
 
-    const char *ip = argv[1];
-    const int port = atoi(argv[2]);
+    const char *ip = argv[optind];
+    const int port = atoi(argv[optind + 1]);
 
     Node *node = create_node(ip, port);
+    node->replication = replication;
+    // the stored metadata is back before the node takes part in the ring
+    if (store_dir != NULL && (node->store = metadata_store_open(node, store_dir)) == NULL) {
+        return EXIT_FAILURE;
+    }
     node_bind(node);
 
-    pthread_t listener_tid;
+    if (start_workers(node, control_workers, bulk_workers) < 0 || event_loop_init() < 0) {
+        return EXIT_FAILURE;
+    }
 
-    // Start listener thread (accept incoming connections) BEFORE joining the ring.
-    if (pthread_create(&listener_tid, NULL, listener_thread, node) != 0) {
+    pthread_t loop_tid;
+
+    // Start the event loop (receives messages) BEFORE joining the ring.
+    if (pthread_create(&loop_tid, NULL, event_loop_thread, node) != 0) {
         perror("pthread_create");
         return EXIT_FAILURE;
     }
 
-    if (argc == 5) {
+    if (args == 4) {
         // Join an existing ring
-        const char *existing_ip = argv[3];
-        const int existing_port = atoi(argv[4]);
+        const char *existing_ip = argv[optind + 2];
+        const int existing_port = atoi(argv[optind + 3]);
         join_ring(node, existing_ip, existing_port);
     } else {
         // Create a new ring
         create_ring(node);
     }
 
-    pthread_t node_tid;
-
-    // Start node thread (stabilize, fix fingers, check predecessor)
-    if (pthread_create(&node_tid, NULL, node_thread, node) != 0) {
-        perror("pthread_create");
-        return EXIT_FAILURE;
-    }
+    // stabilize, fix fingers and check predecessor on the event loop, more often while the ring changes
+    start_maintenance(node);
+    // compare the entries with their replicas now and then, repairing what replication missed
+    start_anti_entropy(node);
 
     printf("Node running at %s:%d\n", ip, port);
 
@@ -56,10 +98,7 @@ int main(const int argc, char *argv[]) {
 
     printf("Exiting...\n");
 
-    pthread_cancel(listener_tid);
-    pthread_cancel(node_tid);
-    pthread_join(listener_tid, NULL);
-    pthread_join(node_tid, NULL);
+    // the event loop keeps running while the files are handed over to the successor
     cleanup_node(node);
 
     return 0;
@@ -0,0 +1,191 @@
+#include "maintenance.h"
+#include "stabilization.h"
+#include "replication.h"
+#include "event_loop.h"
+#include "location_cache.h"
+#include "metadata_store.h"
+#include "rpc.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+// scheduler state, only touched on the event loop thread except where noted
+static uint64_t interval_ms = MAINTENANCE_MIN_INTERVAL_MS;
+static bool round_active;
+static int round_lookups;
+static int round_changes;
+static atomic_bool churn; // set by report_churn from any thread
+static uint64_t last_sweep_us;
+static uint64_t last_prune_us;
+
+// published for get_maintenance_status
+static MaintenanceStatus status;
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void report_churn() {
+    atomic_store(&churn, true);
+}
+
+static void set_finger(Node *n, const int i, Peer *finger) {
+    if (n->finger[i] != finger) {
+        round_changes++;
+    }
+    pthread_mutex_lock(&n->ring_lock);
+    n->finger[i] = finger;
+    pthread_mutex_unlock(&n->ring_lock);
+}
+
+static void finish_round(Node *n) {
+    round_active = false;
+    const bool churned = atomic_exchange(&churn, false);
+    const bool changed = round_changes > 0 || churned;
+    interval_ms = changed ? MAINTENANCE_MIN_INTERVAL_MS : interval_ms * 2;
+    if (interval_ms > MAINTENANCE_MAX_INTERVAL_MS) {
+        interval_ms = MAINTENANCE_MAX_INTERVAL_MS;
+    }
+
+    int distinct = 0;
+    for (int i = 0; i < M; i++) {
+        if (i == 0 || n->finger[i] != n->finger[i - 1]) {
+            distinct++;
+        }
+    }
+
+    pthread_mutex_lock(&status_mutex);
+    status.rounds++;
+    status.last_lookups = round_lookups;
+    status.last_changes = round_changes;
+    status.stable_rounds = changed ? 0 : status.stable_rounds + 1;
+    status.distinct_fingers = distinct;
+    status.converged = status.stable_rounds >= MAINTENANCE_STABLE_ROUNDS;
+    pthread_mutex_unlock(&status_mutex);
+}
+
+static void refresh_fingers(Node *n);
+
+static void on_finger_reply(Node *n, const RpcStatus rpc_status, const Message *response, void *arg) {
+    const int i = (int) (intptr_t) arg;
+    if (rpc_status != RPC_OK || response->flags & MSG_FLAG_FAILED) {
+        report_churn(); // keep the old entry, the next round comes sooner
+    } else {
+        set_finger(n, i, intern_peer(response->ip, response->port));
+    }
+    n->next_finger = i + 1;
+    refresh_fingers(n);
+}
+
+// continues the current round until it needs a remote lookup (answered by on_finger_reply) or is done
+static void refresh_fingers(Node *n) {
+    while (n->next_finger < M) {
+        const int i = n->next_finger;
+        const uint8_t *start = n->finger_start[i];
+
+        // the successor, or the node found for the previous finger, may already cover this start
+        if (is_in_half_open_interval(start, n->id, n->successor->id)) {
+            set_finger(n, i, n->successor);
+        } else if (i > 0 && is_in_half_open_interval(start, n->id, n->finger[i - 1]->id)) {
+            set_finger(n, i, n->finger[i - 1]);
+        } else {
+            const Peer *n0 = closest_preceding_node(n, start);
+            if (n0 != n->self) {
+                Message msg = {0};
+                msg.request_id = generate_id();
+                msg.type = MSG_FIND_SUCCESSOR;
+                memcpy(msg.id, start, HASH_SIZE);
+                strcpy(msg.ip, n->ip);
+                msg.port = n->port;
+                msg.data_len = 0;
+
+                round_lookups++;
+                if (rpc_call_async(n, n0->ip, n0->port, &msg, RPC_DEADLINE_MS, on_finger_reply,
+                                   (void *) (intptr_t) i) == RPC_OK) {
+                    return;
+                }
+            }
+            set_finger(n, i, n->successor);
+        }
+        n->next_finger++;
+    }
+    finish_round(n);
+}
+
+static void mark_owners(const FileTable *t) {
+    size_t pos = 0;
+    const FileEntry *entry;
+    while ((entry = file_table_next(t, &pos)) != NULL) {
+        mark_peer(entry->owner);
+    }
+}
+
+// forgets the peers that neither the routing state nor any table refers to anymore
+static void sweep_peers(Node *n) {
+    begin_peer_sweep();
+    mark_peer(n->self);
+    mark_peer(get_predecessor(n));
+    for (int i = 0; i < M; i++) {
+        mark_peer(n->finger[i]);
+    }
+    pthread_mutex_lock(&n->ring_lock);
+    mark_peer(n->successor);
+    for (int i = 0; i < n->successor_count; i++) {
+        mark_peer(n->successor_list[i]);
+    }
+    pthread_mutex_unlock(&n->ring_lock);
+
+    pthread_mutex_lock(&n->files_lock);
+    mark_owners(&n->files);
+    mark_owners(&n->replicas);
+    mark_owners(&n->uploaded_files);
+    pthread_mutex_unlock(&n->files_lock);
+    location_cache_mark_peers();
+    finish_peer_sweep();
+}
+
+static void maintenance_tick(void *arg) {
+    Node *n = (Node *) arg;
+    stabilize(n);
+    check_predecessor(n);
+    sync_replicas(n);
+    metadata_store_maintain(n->store);
+    if (monotonic_us() - last_sweep_us >= PEER_SWEEP_MS * 1000ULL) {
+        last_sweep_us = monotonic_us();
+        sweep_peers(n);
+    }
+    // the first prune waits for the owners to name their ranges
+    if (last_prune_us == 0) {
+        last_prune_us = monotonic_us();
+    } else if (monotonic_us() - last_prune_us >= REPLICA_RANGE_TTL_MS * 1000ULL) {
+        last_prune_us = monotonic_us();
+        prune_replicas(n);
+    }
+
+    if (!round_active) {
+        round_active = true;
+        round_lookups = 0;
+        round_changes = 0;
+        n->next_finger = 0;
+        refresh_fingers(n);
+    }
+
+    // churn reported since the last round makes the next tick come sooner
+    if (atomic_load(&churn)) {
+        interval_ms = MAINTENANCE_MIN_INTERVAL_MS;
+    }
+    pthread_mutex_lock(&status_mutex);
+    status.interval_ms = interval_ms;
+    pthread_mutex_unlock(&status_mutex);
+
+    add_timer(interval_ms, maintenance_tick, n);
+}
+
+void start_maintenance(Node *n) {
+    add_timer(interval_ms, maintenance_tick, n);
+}
+
+void get_maintenance_status(MaintenanceStatus *out) {
+    pthread_mutex_lock(&status_mutex);
+    memcpy(out, &status, sizeof(MaintenanceStatus));
+    pthread_mutex_unlock(&status_mutex);
+}
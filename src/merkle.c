@@ -0,0 +1,82 @@
+#include "merkle.h"
+#include "file_entry.h"
+#include "sha1.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// index of the node of the first nibbles nibbles of id within its level
+static size_t node_index(const uint8_t *id, const int nibbles) {
+    size_t index = 0;
+    for (int i = 0; i < nibbles; i++) {
+        index = index << 4 | (i % 2 == 0 ? id[i / 2] >> 4 : id[i / 2] & 0x0f);
+    }
+    return index;
+}
+
+int merkle_init(MerkleTree *t) {
+    size_t nodes = 1;
+    for (int l = 0; l < MERKLE_LEVELS; l++) {
+        nodes *= MERKLE_FANOUT;
+        t->levels[l] = (MerkleNode *) calloc(nodes, sizeof(MerkleNode));
+        if (t->levels[l] == NULL) {
+            perror("calloc");
+            merkle_free(t);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void merkle_free(MerkleTree *t) {
+    for (int l = 0; l < MERKLE_LEVELS; l++) {
+        free(t->levels[l]);
+        t->levels[l] = NULL;
+    }
+}
+
+void merkle_clear(MerkleTree *t) {
+    size_t nodes = 1;
+    for (int l = 0; l < MERKLE_LEVELS; l++) {
+        nodes *= MERKLE_FANOUT;
+        memset(t->levels[l], 0, nodes * sizeof(MerkleNode));
+    }
+}
+
+// FNV-1a over the ID, the owner address and the path
+uint64_t merkle_entry_digest(const FileEntry *entry) {
+    uint64_t h = 14695981039346656037ULL;
+    const uint8_t *parts[] = {entry->id, (const uint8_t *) &entry->owner->addr.sin_addr.s_addr,
+                              (const uint8_t *) &entry->owner->addr.sin_port, (const uint8_t *) entry->path};
+    const size_t lengths[] = {HASH_SIZE, 4, 2, entry->path_len};
+    for (int part = 0; part < 4; part++) {
+        for (size_t i = 0; i < lengths[part]; i++) {
+            h = (h ^ parts[part][i]) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+static void update(MerkleTree *t, const FileEntry *entry, const int delta) {
+    if (t->levels[0] == NULL) {
+        return;
+    }
+    const uint64_t digest = merkle_entry_digest(entry);
+    for (int l = 0; l < MERKLE_LEVELS; l++) {
+        MerkleNode *node = &t->levels[l][node_index(entry->id, l + 1)];
+        node->digest ^= digest;
+        node->count += delta;
+    }
+}
+
+void merkle_add(MerkleTree *t, const FileEntry *entry) {
+    update(t, entry, 1);
+}
+
+void merkle_remove(MerkleTree *t, const FileEntry *entry) {
+    update(t, entry, -1);
+}
+
+const MerkleNode *merkle_node(const MerkleTree *t, const uint8_t *prefix, const int nibbles) {
+    return &t->levels[nibbles - 1][node_index(prefix, nibbles)];
+}
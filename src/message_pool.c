@@ -0,0 +1,65 @@
+#include "message_pool.h"
+#include <stdatomic.h>
+
+#define POOL_EMPTY UINT32_MAX
+
+static Message pool[MESSAGE_POOL_SIZE];
+static _Atomic uint32_t free_next[MESSAGE_POOL_SIZE]; // next free index after each free message
+
+// top of the free list: the low 32 bits are an index into pool, the high 32 bits a tag
+// bumped on every change so that a stale compare-and-swap cannot succeed (ABA)
+static _Atomic uint64_t free_head;
+
+static atomic_size_t in_use;
+static atomic_ulong drops;
+
+void init_message_pool() {
+    for (uint32_t i = 0; i < MESSAGE_POOL_SIZE; i++) {
+        atomic_store_explicit(&free_next[i], i + 1 < MESSAGE_POOL_SIZE ? i + 1 : POOL_EMPTY, memory_order_relaxed);
+    }
+    atomic_store(&free_head, 0);
+    atomic_store(&in_use, 0);
+    atomic_store(&drops, 0);
+}
+
+Message *acquire_message() {
+    uint64_t head = atomic_load_explicit(&free_head, memory_order_acquire);
+    while (1) {
+        const uint32_t index = (uint32_t) head;
+        if (index == POOL_EMPTY) {
+            atomic_fetch_add_explicit(&drops, 1, memory_order_relaxed);
+            return NULL;
+        }
+        const uint32_t next = atomic_load_explicit(&free_next[index], memory_order_relaxed);
+        const uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+        if (atomic_compare_exchange_weak_explicit(&free_head, &head, new_head, memory_order_acquire,
+                                                  memory_order_acquire)) {
+            atomic_fetch_add_explicit(&in_use, 1, memory_order_relaxed);
+            return &pool[index];
+        }
+    }
+}
+
+void release_message(Message *msg) {
+    if (msg == NULL) {
+        return;
+    }
+    const uint32_t index = (uint32_t) (msg - pool);
+
+    uint64_t head = atomic_load_explicit(&free_head, memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        atomic_store_explicit(&free_next[index], (uint32_t) head, memory_order_relaxed);
+        new_head = ((head >> 32) + 1) << 32 | index;
+    } while (!atomic_compare_exchange_weak_explicit(&free_head, &head, new_head, memory_order_release,
+                                                    memory_order_relaxed));
+    atomic_fetch_sub_explicit(&in_use, 1, memory_order_relaxed);
+}
+
+size_t message_pool_in_use() {
+    return atomic_load_explicit(&in_use, memory_order_relaxed);
+}
+
+unsigned long message_pool_drops() {
+    return atomic_load_explicit(&drops, memory_order_relaxed);
+}
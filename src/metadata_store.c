@@ -0,0 +1,437 @@
+#include "metadata_store.h"
+#include "sha1.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// offsets of the fields of a record
+#define RECORD_OP 4
+#define RECORD_TABLE 5
+#define RECORD_ID 6
+#define RECORD_ADDR (RECORD_ID + HASH_SIZE)
+#define RECORD_PORT (RECORD_ADDR + 4)
+#define RECORD_PATH_LEN (RECORD_PORT + 2)
+#define RECORD_HEADER (RECORD_PATH_LEN + 2)
+
+#define SNAPSHOT_MAGIC "P2PSNAP" // 8 bytes with the terminator
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER (8 + 4) // magic + u32 version
+
+typedef enum {
+    OP_PUT = 1,
+    OP_REMOVE,
+    OP_CLEAR
+} StoreOp;
+
+struct MetadataStore {
+    Node *node;
+    char dir[MAX_FILEPATH];
+    char wal_path[MAX_FILEPATH + 8];
+    char old_wal_path[MAX_FILEPATH + 8];
+    char snapshot_path[MAX_FILEPATH + 16];
+    int wal_fd;
+    size_t wal_records; // records appended since the last snapshot
+    bool old_wal; // wal.old holds records the snapshot on disk may lack
+    atomic_bool checkpoint_due; // the WAL has grown large, set under n->files_lock
+    atomic_bool checkpointing; // a background checkpoint is running
+    pthread_t checkpoint_thread;
+    bool checkpoint_started; // checkpoint_thread has to be joined
+};
+
+// a snapshot encoded under n->files_lock, written to disk after releasing it
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+} SnapshotBuffer;
+
+FileTable *store_table(Node *n, const StoreTable table) {
+    switch (table) {
+        case STORE_FILES:
+            return &n->files;
+        case STORE_UPLOADED:
+            return &n->uploaded_files;
+        default:
+            return &n->replicas;
+    }
+}
+
+static FileTable *table_of(const MetadataStore *s, const StoreTable table) {
+    return store_table(s->node, table);
+}
+
+// encodes a record into buf (RECORD_HEADER + MAX_FILEPATH bytes), returns its length
+static size_t encode_record(uint8_t *buf, const StoreOp op, const StoreTable table, const uint8_t *id,
+                            const FileEntry *entry) {
+    memset(buf, 0, RECORD_HEADER);
+    buf[RECORD_OP] = (uint8_t) op;
+    buf[RECORD_TABLE] = (uint8_t) table;
+    if (id != NULL) {
+        memcpy(buf + RECORD_ID, id, HASH_SIZE);
+    }
+    size_t len = RECORD_HEADER;
+    if (entry != NULL) {
+        memcpy(buf + RECORD_ADDR, &entry->owner->addr.sin_addr.s_addr, 4); // already in network byte order
+        memcpy(buf + RECORD_PORT, &entry->owner->addr.sin_port, 2);
+        const uint16_t path_len = htons(entry->path_len);
+        memcpy(buf + RECORD_PATH_LEN, &path_len, 2);
+        memcpy(buf + RECORD_HEADER, entry->path, entry->path_len);
+        len += entry->path_len;
+    }
+    const uint32_t crc = htonl((uint32_t) crc32(0, buf + RECORD_OP, len - RECORD_OP));
+    memcpy(buf, &crc, 4);
+    return len;
+}
+
+// applies the records of [data, data + size) to the tables, returns the length of the valid prefix
+static size_t apply_records(const MetadataStore *s, const uint8_t *data, const size_t size) {
+    char path[MAX_FILEPATH];
+    uint32_t last_addr = 0;
+    uint16_t last_port = 0;
+    Peer *last_owner = NULL; // the entries of a node mostly share their owner, so it is looked up once
+    size_t offset = 0;
+
+    while (offset + RECORD_HEADER <= size) {
+        const uint8_t *p = data + offset;
+        uint32_t crc, addr;
+        uint16_t port, path_len;
+        memcpy(&crc, p, 4);
+        memcpy(&addr, p + RECORD_ADDR, 4);
+        memcpy(&port, p + RECORD_PORT, 2);
+        memcpy(&path_len, p + RECORD_PATH_LEN, 2);
+        path_len = ntohs(path_len);
+        if (path_len >= MAX_FILEPATH || offset + RECORD_HEADER + path_len > size ||
+            ntohl(crc) != (uint32_t) crc32(0, p + RECORD_OP, RECORD_HEADER - RECORD_OP + path_len) ||
+            p[RECORD_TABLE] > STORE_REPLICAS) {
+            break;
+        }
+        FileTable *t = table_of(s, (StoreTable) p[RECORD_TABLE]);
+
+        switch (p[RECORD_OP]) {
+            case OP_PUT: {
+                if (last_owner == NULL || addr != last_addr || port != last_port) {
+                    char ip[16];
+                    const struct in_addr in = {addr};
+                    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+                    last_owner = intern_peer(ip, ntohs(port));
+                    last_addr = addr;
+                    last_port = port;
+                }
+                memcpy(path, p + RECORD_HEADER, path_len);
+                path[path_len] = '\0';
+                FileEntry *entry = create_file_entry(p + RECORD_ID, path, last_owner);
+                if (entry == NULL || file_table_insert(t, entry) < 0) {
+                    free(entry);
+                    return offset;
+                }
+                break;
+            }
+            case OP_REMOVE:
+                file_table_remove(t, p + RECORD_ID);
+                break;
+            case OP_CLEAR:
+                file_table_clear(t);
+                break;
+            default:
+                return offset;
+        }
+        offset += RECORD_HEADER + path_len;
+    }
+    return offset;
+}
+
+// maps the file at path and applies its records after skip bytes, returns the length of the valid prefix or -1
+static ssize_t load_file(const MetadataStore *s, const char *path, const size_t skip) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0; // nothing stored yet
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    if ((size_t) st.st_size <= skip) {
+        close(fd);
+        return st.st_size;
+    }
+
+    uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    ssize_t valid;
+    if (skip == SNAPSHOT_HEADER && (memcmp(data, SNAPSHOT_MAGIC, 8) != 0 ||
+                                    ntohl(*(const uint32_t *) (data + 8)) != SNAPSHOT_VERSION)) {
+        fprintf(stderr, "%s is not a snapshot of this version\n", path);
+        valid = -1;
+    } else {
+        valid = (ssize_t) (skip + apply_records(s, data + skip, st.st_size - skip));
+    }
+    munmap(data, st.st_size);
+    return valid;
+}
+
+// appends a record to the WAL, compacting it into a snapshot once it has grown large
+static void append(MetadataStore *s, const StoreOp op, const StoreTable table, const uint8_t *id,
+                   const FileEntry *entry) {
+    uint8_t buf[RECORD_HEADER + MAX_FILEPATH];
+    const size_t len = encode_record(buf, op, table, id, entry);
+    if (write(s->wal_fd, buf, len) != (ssize_t) len) {
+        perror("Failed to append to the WAL");
+        return;
+    }
+
+    // the snapshot is written by metadata_store_maintain, away from the lock held here
+    s->wal_records++;
+    if (s->wal_records >= METADATA_STORE_COMPACT_RECORDS &&
+        s->wal_records > s->node->files.count + s->node->uploaded_files.count + s->node->replicas.count) {
+        atomic_store(&s->checkpoint_due, true);
+    }
+}
+
+MetadataStore *metadata_store_open(Node *n, const char *dir) {
+    if (mkdir(dir, 0755) < 0 && access(dir, W_OK) < 0) {
+        perror("Failed to create the store directory");
+        return NULL;
+    }
+    if (strlen(dir) >= MAX_FILEPATH) {
+        fprintf(stderr, "Path too long: %s\n", dir);
+        return NULL;
+    }
+
+    MetadataStore *s = (MetadataStore *) malloc(sizeof(MetadataStore));
+    if (s == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    s->node = n;
+    s->wal_records = 0;
+    atomic_init(&s->checkpoint_due, false);
+    atomic_init(&s->checkpointing, false);
+    s->checkpoint_started = false;
+    strcpy(s->dir, dir);
+    snprintf(s->wal_path, sizeof(s->wal_path), "%s/wal", dir);
+    snprintf(s->old_wal_path, sizeof(s->old_wal_path), "%s/wal.old", dir);
+    snprintf(s->snapshot_path, sizeof(s->snapshot_path), "%s/snapshot", dir);
+
+    // a checkpoint interrupted before its snapshot reached the disk leaves the WAL it rotated out
+    s->old_wal = access(s->old_wal_path, F_OK) == 0;
+    pthread_mutex_lock(&n->files_lock);
+    const ssize_t snapshot = load_file(s, s->snapshot_path, SNAPSHOT_HEADER);
+    const ssize_t old_wal = snapshot < 0 ? -1 : load_file(s, s->old_wal_path, 0);
+    const ssize_t wal = old_wal < 0 ? -1 : load_file(s, s->wal_path, 0);
+    pthread_mutex_unlock(&n->files_lock);
+    if (wal < 0) {
+        free(s);
+        return NULL;
+    }
+
+    s->wal_fd = open(s->wal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (s->wal_fd < 0) {
+        perror("Failed to open the WAL");
+        free(s);
+        return NULL;
+    }
+    // a torn record left by a crash would hide every record appended after it
+    struct stat st;
+    if (fstat(s->wal_fd, &st) == 0 && st.st_size > wal) {
+        fprintf(stderr, "Dropping %ld bytes of torn WAL records\n", (long) (st.st_size - wal));
+        if (ftruncate(s->wal_fd, wal) < 0) {
+            perror("ftruncate");
+        }
+    }
+
+    printf("Loaded %zu entries, %zu uploads and %zu replicas from %s\n", n->files.count, n->uploaded_files.count,
+           n->replicas.count, dir);
+    return s;
+}
+
+void metadata_store_put(MetadataStore *s, const StoreTable table, const FileEntry *entry) {
+    if (s != NULL) {
+        append(s, OP_PUT, table, entry->id, entry);
+    }
+}
+
+void metadata_store_remove(MetadataStore *s, const StoreTable table, const uint8_t *id) {
+    if (s != NULL) {
+        append(s, OP_REMOVE, table, id, NULL);
+    }
+}
+
+void metadata_store_clear(MetadataStore *s, const StoreTable table) {
+    if (s != NULL) {
+        append(s, OP_CLEAR, table, NULL, NULL);
+    }
+}
+
+// appends len bytes to b, returns -1 if memory ran out
+static int buffer_append(SnapshotBuffer *b, const void *data, const size_t len) {
+    if (b->len + len > b->capacity) {
+        size_t capacity = b->capacity > 0 ? b->capacity * 2 : 65536;
+        while (capacity < b->len + len) {
+            capacity *= 2;
+        }
+        uint8_t *grown = (uint8_t *) realloc(b->data, capacity);
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+// encodes the entries of table as put records
+static int encode_table(SnapshotBuffer *b, const MetadataStore *s, const StoreTable table) {
+    uint8_t buf[RECORD_HEADER + MAX_FILEPATH];
+    const FileTable *t = table_of(s, table);
+    size_t pos = 0;
+    const FileEntry *entry;
+    while ((entry = file_table_next(t, &pos)) != NULL) {
+        if (buffer_append(b, buf, encode_record(buf, OP_PUT, table, entry->id, entry)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// encodes the header and the entries of every table, n->files_lock must be held
+static int encode_snapshot(SnapshotBuffer *b, const MetadataStore *s) {
+    char header[SNAPSHOT_HEADER] = SNAPSHOT_MAGIC;
+    const uint32_t version = htonl(SNAPSHOT_VERSION);
+    memcpy(header + 8, &version, 4);
+    if (buffer_append(b, header, sizeof(header)) < 0 || encode_table(b, s, STORE_FILES) < 0 ||
+        encode_table(b, s, STORE_UPLOADED) < 0 || encode_table(b, s, STORE_REPLICAS) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// replaces the snapshot on disk with b
+static int write_snapshot(const MetadataStore *s, const SnapshotBuffer *b) {
+    char tmp_path[sizeof(s->snapshot_path) + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", s->snapshot_path);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        perror("Failed to create the snapshot");
+        return -1;
+    }
+    // the snapshot has to be on disk before it replaces the old one and the WAL is dropped
+    if (fwrite(b->data, 1, b->len, f) != b->len || fflush(f) != 0 || fsync(fileno(f)) < 0) {
+        perror("Failed to write the snapshot");
+        fclose(f);
+        unlink(tmp_path);
+        return -1;
+    }
+    fclose(f);
+    if (rename(tmp_path, s->snapshot_path) < 0) {
+        perror("Failed to replace the snapshot");
+        unlink(tmp_path);
+        return -1;
+    }
+    const int dir_fd = open(s->dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+// moves the WAL to wal.old and starts an empty one, n->files_lock must be held
+static int rotate_wal(MetadataStore *s) {
+    if (rename(s->wal_path, s->old_wal_path) < 0) {
+        perror("Failed to rotate the WAL");
+        return -1;
+    }
+    const int fd = open(s->wal_path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open the WAL");
+        rename(s->old_wal_path, s->wal_path);
+        return -1;
+    }
+    close(s->wal_fd);
+    s->wal_fd = fd;
+    s->old_wal = true;
+    return 0;
+}
+
+int metadata_store_checkpoint(MetadataStore *s) {
+    SnapshotBuffer snapshot = {NULL, 0, 0};
+
+    // changes made after the tables are copied go to a fresh WAL, replayed on top of the new snapshot.
+    // A wal.old left by a failed checkpoint is kept instead: replaying the records of the current WAL
+    // that predate the snapshot again gives the same tables.
+    pthread_mutex_lock(&s->node->files_lock);
+    int result = encode_snapshot(&snapshot, s);
+    if (result == 0 && !s->old_wal) {
+        result = rotate_wal(s);
+    }
+    if (result == 0) {
+        s->wal_records = 0;
+        atomic_store(&s->checkpoint_due, false);
+    }
+    pthread_mutex_unlock(&s->node->files_lock);
+
+    if (result == 0) {
+        result = write_snapshot(s, &snapshot);
+    }
+    free(snapshot.data);
+    if (result == 0 && unlink(s->old_wal_path) == 0) {
+        s->old_wal = false;
+    }
+    return result;
+}
+
+static void *checkpoint_thread(void *arg) {
+    MetadataStore *s = (MetadataStore *) arg;
+    metadata_store_checkpoint(s);
+    atomic_store(&s->checkpointing, false);
+    return NULL;
+}
+
+void metadata_store_maintain(MetadataStore *s) {
+    if (s == NULL || !atomic_load(&s->checkpoint_due) || atomic_load(&s->checkpointing)) {
+        return;
+    }
+    if (s->checkpoint_started) {
+        pthread_join(s->checkpoint_thread, NULL);
+        s->checkpoint_started = false;
+    }
+    atomic_store(&s->checkpointing, true);
+    if (pthread_create(&s->checkpoint_thread, NULL, checkpoint_thread, s) != 0) {
+        perror("pthread_create");
+        atomic_store(&s->checkpointing, false);
+        return;
+    }
+    s->checkpoint_started = true;
+}
+
+void metadata_store_close(MetadataStore *s) {
+    if (s == NULL) {
+        return;
+    }
+    if (s->checkpoint_started) {
+        pthread_join(s->checkpoint_thread, NULL);
+    }
+    metadata_store_checkpoint(s);
+    close(s->wal_fd);
+    free(s);
+}
@@ -1,8 +1,19 @@
 #include "node.h"
 #include "file_entry.h"
+#include "handoff.h"
 #include "stabilization.h"
 #include "sha1.h"
 #include "utils.h"
+#include "transfer.h"
+#include "rpc.h"
+#include "message_pool.h"
+#include "maintenance.h"
+#include "metadata_store.h"
+#include "bulk.h"
+#include "location_cache.h"
+#include "hot_keys.h"
+#include "replication.h"
+#include "anti_entropy.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,6 +21,8 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
 Node *create_node(const char *ip, const int port) {
     Node *node = (Node *) malloc(sizeof(Node));
@@ -17,17 +30,25 @@ Node *create_node(const char *ip, const int port) {
         perror("malloc");
         exit(EXIT_FAILURE);
     }
-    char id_str[256];
-    snprintf(id_str, sizeof(id_str), "%s:%d", ip, port);
-    hash(id_str, node->id);
+    node->self = intern_peer(ip, port);
+    memcpy(node->id, node->self->id, HASH_SIZE);
     strncpy(node->ip, ip, sizeof(node->ip));
     node->port = port;
-    node->successor = node;
+    node->successor = node->self;
+    node->successor_count = 0;
+    pthread_mutex_init(&node->ring_lock, NULL);
     node->predecessor = NULL;
-    node->files = NULL;
+    file_table_init(&node->files, false, true); // ordered, joins split off a range of IDs
+    file_table_init(&node->uploaded_files, true, false);
+    file_table_init(&node->replicas, false, true); // ordered, replicas in a range are promoted at once
+    node->replication = REPLICATION_FACTOR;
+    pthread_mutex_init(&node->files_lock, NULL);
+    node->store = NULL;
     for (int i = 0; i < M; i++) {
-        node->finger[i] = node; // initially, all fingers point to the node itself
+        node->finger[i] = node->self; // initially, all fingers point to the node itself
     }
+    node->finger_start = NULL;
+    node->next_finger = 0;
     node->socket_open = false;
     return node;
 }
@@ -46,6 +67,10 @@ void node_bind(Node *n) {
         exit(EXIT_FAILURE);
     }
 
+    // large socket buffers absorb the bursts of a full transfer window (best effort, capped by the kernel)
+    setsockopt(n->sockfd, SOL_SOCKET, SO_RCVBUF, &(int){SOCKET_BUFFER_SIZE}, sizeof(int));
+    setsockopt(n->sockfd, SOL_SOCKET, SO_SNDBUF, &(int){SOCKET_BUFFER_SIZE}, sizeof(int));
+
     struct sockaddr_in addr = {0};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(n->port);
@@ -62,372 +87,545 @@ void node_bind(Node *n) {
 }
 
 void cleanup_node(Node *n) {
-    FileEntry *file = n->files;
-    Message msg;
-    if (n->successor != n) {
+    Message msg = {0};
+    if (n->successor != n->self) {
         msg.request_id = generate_id();
-        strcpy(msg.type, MSG_LEAVING);
+        msg.type = MSG_LEAVING;
         memcpy(msg.id, n->id, HASH_SIZE);
         strcpy(msg.ip, n->ip);
         msg.port = n->port;
 
-        // Allocate buffer with appropriate size
-        char *buf = (char *) malloc(4096);
-        if (buf == NULL) {
-            // Handle allocation failure
-            perror("Failed to allocate buffer");
-            return;
-        }
-        const size_t data_size = serialize_all_file_entries(&buf, 4096, n->files);
-
-        // Send file entries to the new node in chunks
-        const size_t chunk_size = sizeof(msg.data);
-        const size_t total_chunks = (data_size + chunk_size - 1) / chunk_size;
-
-        strcpy(msg.type, MSG_FILE_DATA);
-
-        // TODO: complete this
-        for (size_t i = 0; i < total_chunks; i++) {
-            msg.segment_index = (uint16_t) i;
-            msg.total_segments = (uint16_t) total_chunks;
-
-            const size_t start_index = i * chunk_size;
-            size_t end_index = start_index + chunk_size;
-            if (end_index > data_size) {
-                end_index = data_size;
+        // the successor has to expect the segments before they are sent
+        Message *response = NULL;
+        if (rpc_call(n, n->successor->ip, n->successor->port, &msg, &response, RPC_DEADLINE_MS) != RPC_OK) {
+            fprintf(stderr, "Successor did not acknowledge LEAVING, its files are lost\n");
+        } else {
+            release_message(response);
+
+            // copies are encoded and sent without the lock, like the replica sync does
+            pthread_mutex_lock(&n->files_lock);
+            FileEntry **entries = (FileEntry **) malloc((n->files.count + 1) * sizeof(FileEntry *));
+            size_t count = 0, pos = 0;
+            const FileEntry *entry;
+            bool copied = entries != NULL;
+            while (copied && (entry = file_table_next(&n->files, &pos)) != NULL) {
+                entries[count] = create_file_entry(entry->id, entry->path, entry->owner);
+                copied = entries[count] != NULL;
+                count += copied;
             }
+            pthread_mutex_unlock(&n->files_lock);
 
-            const size_t segment_size = end_index - start_index;
-            memcpy(msg.data, buf + start_index, segment_size);
-            msg.data_len = (uint32_t) segment_size;
-
-            // Send the message, with error handling
-            if (send_message(n, n->successor->ip, n->successor->port, &msg) < 0) {
+            if (!copied || send_file_entries(n, n->successor, &msg, entries, count) < 0) {
                 perror("Failed to send file data message");
-                free(buf);
-                return;
+            } else {
+                // the successor owns the sent entries now, a restart must not bring them back
+                pthread_mutex_lock(&n->files_lock);
+                for (size_t i = 0; i < count; i++) {
+                    if (file_table_remove(&n->files, entries[i]->id) == 0) {
+                        metadata_store_remove(n->store, STORE_FILES, entries[i]->id);
+                    }
+                }
+                pthread_mutex_unlock(&n->files_lock);
             }
+            for (size_t i = 0; i < count; i++) {
+                free(entries[i]);
+            }
+            free(entries);
         }
 
-        strcpy(msg.type, MSG_FILE_END);
-        strcpy(msg.data, "");
-        msg.data_len = 0;
-        if (send_message(n, n->successor->ip, n->successor->port, &msg) < 0) {
-            perror("Failed to send file end message");
-        }
-
-        // Free allocated buffer
-        free(buf);
-
-        if (n->predecessor != NULL) {
+        const Peer *predecessor = get_predecessor(n);
+        if (predecessor != NULL) {
             // Update predecessor's successor
-            strcpy(msg.type, MSG_UPDATE_SUCCESSOR);
+            msg.type = MSG_UPDATE_SUCCESSOR;
             msg.request_id = generate_id();
             memcpy(msg.id, n->successor->id, HASH_SIZE);
             strcpy(msg.ip, n->successor->ip);
             msg.port = n->successor->port;
-            if (send_message(n, n->predecessor->ip, n->predecessor->port, &msg) < 0) {
+            memcpy(msg.data, n->id, HASH_SIZE); // lets the predecessor check that it comes from its successor
+            msg.data_len = HASH_SIZE;
+            if (send_to_peer(n, predecessor, &msg) < 0) {
                 perror("Failed to update predecessor's successor");
             }
             // Update successor's predecessor
-            strcpy(msg.type, MSG_NOTIFY);
+            msg.type = MSG_NOTIFY;
             msg.request_id = generate_id();
-            memcpy(msg.id, n->predecessor->id, HASH_SIZE);
-            strcpy(msg.ip, n->predecessor->ip);
-            msg.port = n->predecessor->port;
-            if (send_message(n, n->successor->ip, n->successor->port, &msg) < 0) {
+            memcpy(msg.id, predecessor->id, HASH_SIZE);
+            strcpy(msg.ip, predecessor->ip);
+            msg.port = predecessor->port;
+            msg.data_len = 0;
+            if (send_to_peer(n, n->successor, &msg) < 0) {
                 perror("Failed to notify successor");
             }
-            free(n->predecessor);
         }
-        free(n->successor);
     }
 
-    // Free files
-    while (file != NULL) {
-        FileEntry *next = file->next;
-        free(file);
-        file = next;
-    }
+    // Last snapshot of the entries that are still ours
+    pthread_mutex_lock(&n->files_lock);
+    MetadataStore *store = n->store;
+    n->store = NULL; // changes made from now on are not recorded
+    pthread_mutex_unlock(&n->files_lock);
+    metadata_store_close(store);
 
-    // Clean up
+    // the other threads still use the tables and n, exit() releases them
     n->socket_open = false;
     close(n->sockfd);
-    free(n);
 
     exit(EXIT_SUCCESS);
 }
 
-void handle_requests(Node *n, const Message *msg) {
-    if (strcmp(msg->type, MSG_FILE_DATA) == 0 || strcmp(msg->type, MSG_FILE_END) == 0) {
-        // FILE_DATA message handling (ignore, just push to download queue for other threads)
-        push_message(&download_queue, msg);
-    } else if (strcmp(msg->type, MSG_REPLY) == 0) {
-        // REPLY message handling (ignore, just push to reply queue for other threads)
+static void handle_file_data(Node *n, const Message *msg) {
+    // FILE_DATA message handling (ignore, just push to download queue for other threads)
+    (void) n;
+    push_message(&download_queue, msg);
+}
+
+static void handle_reply(Node *n, const Message *msg) {
+    // REPLY message handling: complete an asynchronous call, or wake the thread waiting for it
+    if (!rpc_complete(n, msg)) {
         push_message(&reply_queue, msg);
-    } else if (strcmp(msg->type, MSG_JOIN) == 0) {
-        // JOIN request handling
-        Node *new_node = create_node(msg->ip, msg->port);
+    }
+}
 
-        // find successor of new node
-        const Node *successor = find_successor(n, new_node->id);
+static void handle_join(Node *n, const Message *msg) {
+    // JOIN request handling
+    const Peer *new_node = intern_peer(msg->ip, msg->port);
 
-        // reply with successor info
-        Message response;
-        response.request_id = msg->request_id;
-        strcpy(response.type, MSG_REPLY);
-        memcpy(response.id, successor->id, HASH_SIZE);
-        strcpy(response.ip, successor->ip);
-        response.port = successor->port;
-        strcpy(response.data, "");
-
-        send_message(n, msg->ip, msg->port, &response);
-        free(new_node);
-    } else if (strcmp(msg->type, MSG_FIND_SUCCESSOR) == 0) {
-        // FIND_SUCCESSOR request handling
-        const Node *successor = find_successor(n, msg->id);
-
-        // reply with successor info
-        Message response;
-        response.request_id = msg->request_id;
-        strcpy(response.type, MSG_REPLY);
-        memcpy(response.id, successor->id, HASH_SIZE);
-        strcpy(response.ip, successor->ip);
-        response.port = successor->port;
-        strcpy(response.data, "");
-
-        send_message(n, msg->ip, msg->port, &response);
-    } else if (strcmp(msg->type, MSG_GET_FILES) == 0) {
-        Message response;
-        response.request_id = msg->request_id;
-        memcpy(response.id, n->id, HASH_SIZE);
-
-        char *buf = (char *) malloc(4096);
-        size_t data_size = serialize_file_entries(&buf, 4096, n->files, msg->id, n->id);
-
-        // send file entries to new node in chunks
-        const size_t chunk_size = sizeof(response.data);
-        size_t total_chunks = (data_size + chunk_size - 1) / chunk_size;
-
-        // send file entries to new node
-        strcpy(response.type, MSG_FILE_DATA);
-        for (size_t i = 0; i < total_chunks; i++) {
-            response.segment_index = (uint16_t) i;
-            response.total_segments = (uint16_t) total_chunks;
-
-            // calculate start and end index of chunk
-            size_t start_index = i * chunk_size;
-            size_t end_index = start_index + chunk_size;
-            if (end_index > data_size) {
-                end_index = data_size;
-            }
+    // find successor of new node
+    const Peer *successor = find_successor(n, new_node->id);
+    if (successor == NULL) {
+        return; // lookup timed out, the joining node will retry
+    }
 
-            // copy chunk to response data
-            size_t segment_size = end_index - start_index;
-            memcpy(response.data, buf + start_index, segment_size);
-            response.data_len = (uint32_t) segment_size;
+    // reply with successor info
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    memcpy(response.id, successor->id, HASH_SIZE);
+    strcpy(response.ip, successor->ip);
+    response.port = successor->port;
+    response.data_len = 0;
 
-            // send file entries to new node
-            send_message(n, msg->ip, msg->port, &response);
-        }
+    send_reply(n, msg, &response);
+}
 
-        strcpy(response.type, MSG_FILE_END);
-        strcpy(response.data, "");
+static void handle_find_successor(Node *n, const Message *msg) {
+    // FIND_SUCCESSOR request handling
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+
+    // the nested lookup gets three quarters of the requester's deadline, leaving time for the reply
+    uint32_t budget = RPC_DEADLINE_MS;
+    if (msg->data_len >= 4) {
+        memcpy(&budget, msg->data, 4);
+        budget = ntohl(budget);
+    }
+    budget -= budget / 4;
+
+    // the lookup of a file ends early on a node that has its location cached, and also returns its replicas
+    const Peer *successor;
+    if (msg->flags & MSG_FLAG_LOCATION) {
+        FileLookup lookup;
+        lookup_file_within(n, msg->id, &lookup, budget);
+        if (lookup.hit && strlen(lookup.found.filepath) <= sizeof(response.data)) {
+            response.flags = MSG_FLAG_LOCATION;
+            memcpy(response.id, lookup.found.id, HASH_SIZE);
+            strcpy(response.ip, lookup.found.owner_ip);
+            response.port = lookup.found.owner_port;
+            response.data_len = strlen(lookup.found.filepath);
+            memcpy(response.data, lookup.found.filepath, response.data_len);
+            send_reply(n, msg, &response);
+            return;
+        }
+        if (lookup.hit) {
+            successor = find_successor_within(n, msg->id, budget); // the path does not fit in a reply
+        } else {
+            successor = lookup.replica_count > 0 ? lookup.replicas[0] : NULL;
+            response.data_len = encode_replicas(&lookup, (uint8_t *) response.data, sizeof(response.data));
+        }
+    } else {
+        successor = find_successor_within(n, msg->id, budget);
+    }
+    if (successor == NULL) {
+        // tells the requester that this node is alive, the lookup failed further along the route
+        response.flags = MSG_FLAG_FAILED;
         response.data_len = 0;
-        send_message(n, msg->ip, msg->port, &response);
+        send_reply(n, msg, &response);
+        return;
+    }
 
-        delete_transferred_files(&n->files, msg->id, n->id);
+    // reply with successor info
+    memcpy(response.id, successor->id, HASH_SIZE);
+    strcpy(response.ip, successor->ip);
+    response.port = successor->port;
 
-        free(buf);
-    } else if (strcmp(msg->type, MSG_STABILIZE) == 0) {
-        // STABILIZE request handling
-        if (n->predecessor != NULL) {
-            Message response;
-            response.request_id = msg->request_id;
-            strcpy(response.type, MSG_REPLY);
-            memcpy(response.id, n->predecessor->id, HASH_SIZE);
-            strcpy(response.ip, n->predecessor->ip);
-            response.port = n->predecessor->port;
-            strcpy(response.data, "");
-
-            // return predecessor info to get verified
-            send_message(n, msg->ip, msg->port, &response);
-        }
-    } else if (strcmp(msg->type, MSG_NOTIFY) == 0) {
-        // NOTIFY request handling
-        Node *new_predecessor = create_node(msg->ip, msg->port);
+    send_reply(n, msg, &response);
+}
 
-        // update predecessor if necessary
-        if (n->predecessor == NULL || is_in_interval(new_predecessor->id, n->predecessor->id, n->id)) {
-            n->predecessor = new_predecessor;
-        } else {
-            free(new_predecessor);
-        }
-    } else if (strcmp(msg->type, MSG_UPDATE_SUCCESSOR) == 0) {
-        // UPDATE_SUCCESSOR request handling
-        Node *new_successor = create_node(msg->ip, msg->port);
+static void handle_get_files(Node *n, const Message *msg) {
+    Message response = {0};
+    response.request_id = msg->request_id;
+    memcpy(response.id, n->id, HASH_SIZE);
+
+    // the joining node takes over the IDs outside (new node, n], i.e. (n, new node]
+    FileEntry **entries;
+    pthread_mutex_lock(&n->files_lock);
+    const size_t count = file_table_take_range(&n->files, n->id, msg->id, &entries);
+    for (size_t i = 0; i < count; i++) {
+        metadata_store_remove(n->store, STORE_FILES, entries[i]->id);
+    }
+    pthread_mutex_unlock(&n->files_lock);
 
-        if (is_in_interval(new_successor->id, n->id, n->successor->id)) {
-            n->successor = new_successor;
-        } else {
-            free(new_successor);
-        }
-    } else if (strcmp(msg->type, MSG_HEARTBEAT) == 0) {
-        // HEARTBEAT request handling
-        // do nothing, just to keep the connection alive
-    } else if (strcmp(msg->type, MSG_STORE_FILE) == 0) {
-        // STORE_FILE request handling
-        const char *filepath = msg->data;
-        const char *filename = strrchr(filepath, '/') + 1;
-        internal_store_file(n, filename, filepath, msg->id, msg->ip, msg->port);
-    } else if (strcmp(msg->type, MSG_FIND_FILE) == 0) {
-        // FIND_FILE request handling
-        const FileEntry *file = find_file(n, msg->data);
-        if (file) {
-            Message response;
-            response.request_id = msg->request_id;
-            strcpy(response.type, MSG_REPLY);
-            memcpy(response.id, file->id, HASH_SIZE);
-            strcpy(response.ip, file->owner_ip);
-            response.port = file->owner_port;
-            response.segment_index = 0;
-            response.total_segments = (strlen(file->filepath) + sizeof(response.data) - 1) / sizeof(response.data);
-
-            size_t bytes_sent = 0;
-
-            for (int i = 0; i < response.total_segments; i++) {
-                size_t copy_len = strlen(file->filepath) - bytes_sent > sizeof(response.data)
-                                      ? sizeof(response.data)
-                                      : strlen(file->filepath) - bytes_sent;
-                memcpy(response.data, file->filepath + bytes_sent, copy_len);
-                response.data[copy_len] = '\0'; // Ensure null-termination
-                response.data_len = copy_len;
-                send_message(n, msg->ip, msg->port, &response);
-                bytes_sent += response.data_len;
-                response.segment_index++;
-                usleep(1000);
-            }
+    // send file entries to new node in blocks
+    send_file_entries(n, intern_peer(msg->ip, msg->port), &response, entries, count);
+
+    // as the successor of the new node, this one keeps a copy of what it handed over
+    pthread_mutex_lock(&n->files_lock);
+    for (size_t i = 0; i < count; i++) {
+        if (n->replication < 2 || file_table_insert(&n->replicas, entries[i]) < 0) {
+            free(entries[i]);
         } else {
-            Message response;
-            response.request_id = msg->request_id;
-            strcpy(response.type, MSG_REPLY);
-            memset(response.id, 0, HASH_SIZE);
-            strcpy(response.ip, "");
-            response.port = 0;
-            strcpy(response.data, "File not found");
-            send_message(n, msg->ip, msg->port, &response);
+            metadata_store_put(n->store, STORE_REPLICAS, entries[i]);
         }
-    } else if (strcmp(msg->type, MSG_DOWNLOAD_FILE) == 0) {
-        // DOWNLOAD_FILE request handling
-        const char *filepath = msg->data;
-        // Ensure the file was uploaded by this node before sending it
-        const FileEntry *file_entry = find_uploaded_file(n, filepath);
-        if (file_entry != NULL) {
-            FILE *file = fopen(file_entry->filepath, "rb");
-            if (file == NULL) {
-                perror("Failed to open file");
-                Message response;
-                response.request_id = msg->request_id;
-                strcpy(response.type, MSG_REPLY);
-                memset(response.id, 0, HASH_SIZE);
-                strcpy(response.ip, file_entry->owner_ip);
-                response.port = file_entry->owner_port;
-                strcpy(response.data, "Failed to open file");
-                send_message(n, msg->ip, msg->port, &response);
-                return;
-            }
+    }
+    pthread_mutex_unlock(&n->files_lock);
+    free(entries);
+}
 
-            Message response;
-            response.request_id = msg->request_id;
-            strcpy(response.type, MSG_REPLY);
-            memcpy(response.id, file_entry->id, HASH_SIZE);
-            strcpy(response.ip, file_entry->owner_ip);
-            response.port = file_entry->owner_port;
+static void handle_stabilize(Node *n, const Message *msg) {
+    // STABILIZE request handling
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    // an empty address tells the caller that there is no predecessor yet
+    const Peer *predecessor = get_predecessor(n);
+    if (predecessor != NULL) {
+        memcpy(response.id, predecessor->id, HASH_SIZE);
+        strcpy(response.ip, predecessor->ip);
+        response.port = predecessor->port;
+    }
+    // our successor list becomes the tail of the caller's
+    response.data_len = encode_successor_list(n, (uint8_t *) response.data, sizeof(response.data));
 
-            strcpy(response.data, "Starting download");
+    // return predecessor info to get verified
+    send_reply(n, msg, &response);
+}
+
+static void handle_notify(Node *n, const Message *msg) {
+    // NOTIFY request handling
+    Peer *new_predecessor = intern_peer(msg->ip, msg->port);
+    peer_set_alive(new_predecessor, true);
+
+    // update predecessor if necessary
+    pthread_mutex_lock(&n->ring_lock);
+    const bool changed = n->predecessor == NULL || is_in_interval(new_predecessor->id, n->predecessor->id, n->id);
+    if (changed) {
+        n->predecessor = new_predecessor;
+    }
+    pthread_mutex_unlock(&n->ring_lock);
+    if (changed) {
+        report_churn();
+        // if the old predecessor failed, this node is now responsible for the entries it replicated
+        promote_replicas(n);
+    }
+}
 
-            size_t file_size;
-            fseek(file, 0, SEEK_END);
-            file_size = ftell(file);
-            rewind(file);
+static void handle_update_successor(Node *n, const Message *msg) {
+    // UPDATE_SUCCESSOR request handling
+    // sent by a leaving successor, its ID in the data, naming its own successor as the new one
+    pthread_mutex_lock(&n->ring_lock);
+    Peer *leaving = n->successor;
+    const Peer *next = n->successor_count > 1 ? n->successor_list[1] : n->self;
+    pthread_mutex_unlock(&n->ring_lock);
+
+    // a late or duplicated message, or one from a node that is not our successor, is ignored
+    if (msg->data_len < HASH_SIZE || leaving == n->self || memcmp(msg->data, leaving->id, HASH_SIZE) != 0 ||
+        !is_in_half_open_interval(msg->id, n->id, next->id)) {
+        return;
+    }
+    node_failed(n, leaving);
+    if (memcmp(msg->id, n->id, HASH_SIZE) != 0 && memcmp(msg->id, n->successor->id, HASH_SIZE) != 0) {
+        set_successor(n, intern_peer(msg->ip, msg->port));
+    }
+}
 
-            response.total_segments = (file_size + sizeof(response.data) - 1) / sizeof(response.data);
-            send_message(n, msg->ip, msg->port, &response);
+static void handle_heartbeat(Node *n, const Message *msg) {
+    // HEARTBEAT request handling
+    // an empty reply tells the sender that we are still alive
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    send_reply(n, msg, &response);
+}
 
+static void handle_store_file(Node *n, const Message *msg) {
+    // STORE_FILE request handling
+    internal_store_file(n, msg->data, msg->id, msg->ip, msg->port);
+}
 
-            size_t bytes_read;
-            size_t data_size = sizeof(response.data);
-            int status = 0;
+static void handle_store_batch(Node *n, const Message *msg) {
+    // STORE_BATCH request handling: the reply tells the uploader how many entries were added
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    memcpy(response.id, n->id, HASH_SIZE);
+    const uint32_t added = htonl(apply_store_batch(n, msg));
+    memcpy(response.data, &added, sizeof(added));
+    response.data_len = sizeof(added);
+    send_reply(n, msg, &response);
+}
 
-            response.segment_index = 0;
-            strcpy(response.type, MSG_FILE_DATA);
-            while ((bytes_read = fread(response.data, 1, data_size, file)) > 0) {
-                response.data_len = bytes_read;
-                if (send_message(n, msg->ip, msg->port, &response) < 0) {
-                    status = -1;
-                    break;
-                }
-                response.segment_index++;
-                usleep(1000);
-            }
+static void handle_find_batch(Node *n, const Message *msg) {
+    // FIND_BATCH request handling: the reply answers as many of the names as fit
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    memcpy(response.id, n->id, HASH_SIZE);
+    answer_find_batch(n, msg, &response);
+    send_reply(n, msg, &response);
+}
 
-            strcpy(response.type, MSG_FILE_END);
-            strcpy(response.data, status == 0 ? "Transfer complete" : "Transfer interrupted");
-            send_message(n, msg->ip, msg->port, &response);
+static void handle_find_file(Node *n, const Message *msg) {
+    // FIND_FILE request handling
+    FileInfo *file = find_local_file(n, msg->id);
+    if (file != NULL) {
+        // this node is responsible for the file, a key requested this often is pushed along its lookup paths
+        if (hot_key_hit(file->id)) {
+            push_hot_key(n, file);
+        }
+    } else {
+        file = locate_file(n, msg->data);
+    }
+    if (file) {
+        // the path goes out in segments, handed to the kernel together instead of paced on this worker
+        Message segments[(MAX_FILEPATH + sizeof(msg->data) - 1) / sizeof(msg->data)];
+        const size_t path_len = strlen(file->filepath);
+        const uint32_t total = (path_len + sizeof(msg->data) - 1) / sizeof(msg->data);
+        size_t bytes_sent = 0;
+
+        for (uint32_t i = 0; i < total; i++) {
+            Message *response = &segments[i];
+            memset(response, 0, sizeof(Message));
+            response->request_id = msg->request_id;
+            response->type = MSG_REPLY;
+            memcpy(response->id, file->id, HASH_SIZE);
+            strcpy(response->ip, file->owner_ip);
+            response->port = file->owner_port;
+            response->segment_index = i;
+            response->total_segments = total;
+            response->data_len = path_len - bytes_sent > sizeof(response->data) ? sizeof(response->data)
+                                                                                 : path_len - bytes_sent;
+            memcpy(response->data, file->filepath + bytes_sent, response->data_len);
+            bytes_sent += response->data_len;
+        }
+        send_messages(n, msg->ip, msg->port, segments, (int) total);
+        free(file);
+    } else {
+        Message response = {0};
+        response.request_id = msg->request_id;
+        response.type = MSG_REPLY;
+        memset(response.id, 0, HASH_SIZE);
+        strcpy(response.ip, "");
+        response.port = 0;
+        set_message_text(&response, "File not found");
+        send_reply(n, msg, &response);
+    }
+}
 
-            fclose(file);
-        } else {
-            Message response;
+static void handle_download_file(Node *n, const Message *msg) {
+    // DOWNLOAD_FILE request handling
+    const char *filepath = msg->data;
+    // Ensure the file was uploaded by this node before sending it
+    FileInfo uploaded;
+    const FileInfo *file_entry = NULL;
+    pthread_mutex_lock(&n->files_lock);
+    const FileEntry *found = find_uploaded_file(n, filepath);
+    if (found != NULL) {
+        expand_file_entry(found, &uploaded);
+        file_entry = &uploaded;
+    }
+    pthread_mutex_unlock(&n->files_lock);
+    if (file_entry != NULL) {
+        // the transfer runs on its own thread so that this listener keeps receiving its ACKs
+        if (start_file_transfer(n, msg, file_entry) < 0) {
+            Message response = {0};
             response.request_id = msg->request_id;
-            strcpy(response.type, MSG_REPLY);
+            response.type = MSG_REPLY;
             memset(response.id, 0, HASH_SIZE);
-            strcpy(response.ip, "");
-            response.port = 0;
-            strcpy(response.data, "File not found");
-            send_message(n, msg->ip, msg->port, &response);
+            strcpy(response.ip, file_entry->owner_ip);
+            response.port = file_entry->owner_port;
+            set_message_text(&response, "Failed to open file");
+            send_reply(n, msg, &response);
         }
-    } else if (strcmp(msg->type, MSG_DELETE_FILE) == 0) {
-        Message response;
+    } else {
+        Message response = {0};
         response.request_id = msg->request_id;
-        strcpy(response.type, MSG_REPLY);
+        response.type = MSG_REPLY;
         memset(response.id, 0, HASH_SIZE);
         strcpy(response.ip, "");
         response.port = 0;
+        set_message_text(&response, "File not found");
+        send_reply(n, msg, &response);
+    }
+}
 
-        if (delete_file_entry(&n->files, msg->id) < 0) {
-            strcpy(response.data, "File not found");
-        } else {
-            strcpy(response.data, "File deleted");
-        }
-        send_message(n, msg->ip, msg->port, &response);
-    } else if (strcmp(msg->type, MSG_LEAVING) == 0) {
-        // TODO: handle this
-        char *buf = malloc(4096);
-        size_t buf_size = 4096;
-        size_t file_data_size = 0;
-
-        // receive the file metadata from the successor
-        while ((msg = pop_message(&download_queue, msg->request_id)) != NULL && strcmp(msg->type, MSG_FILE_END) !=
-               0) {
-            const size_t segment_start = msg->segment_index * sizeof(msg->data);
-            const size_t segment_end = segment_start + msg->data_len;
-
-            if (segment_end > buf_size) {
-                buf = realloc(buf, segment_end);
-                buf_size = segment_end;
-            }
+static void handle_file_ack(Node *n, const Message *msg) {
+    // FILE_ACK message handling (push to the ack queue for the transfer thread)
+    (void) n;
+    push_message(&ack_queue, msg);
+}
+
+static void handle_delete_file(Node *n, const Message *msg) {
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    memset(response.id, 0, HASH_SIZE);
+    strcpy(response.ip, "");
+    response.port = 0;
+
+    pthread_mutex_lock(&n->files_lock);
+    const int deleted = file_table_remove(&n->files, msg->id);
+    location_cache_invalidate(msg->id);
+    if (deleted == 0) {
+        metadata_store_remove(n->store, STORE_FILES, msg->id);
+        replicate_remove(n, msg->id);
+    }
+    pthread_mutex_unlock(&n->files_lock);
+    if (deleted < 0) {
+        set_message_text(&response, "File not found");
+    } else {
+        set_message_text(&response, "File deleted");
+    }
+    send_reply(n, msg, &response);
+}
 
-            memcpy(buf + segment_start, msg->data, msg->data_len);
+static void handle_leaving(Node *n, const Message *msg) {
+    // LEAVING request handling: the predecessor hands over its files before leaving the ring
+    if (register_request(&download_queue, msg->request_id) < 0) {
+        return; // without a reply the leaving node retransmits the request
+    }
 
-            if (msg->segment_index + 1 == msg->total_segments) {
-                file_data_size = segment_end;
-            }
-        }
+    // forget the leaving node so that the NOTIFY it sends for its own predecessor is accepted
+    const Peer *leaving = find_peer(msg->id);
+    pthread_mutex_lock(&n->ring_lock);
+    const bool forgotten = leaving != NULL && n->predecessor == leaving;
+    if (forgotten) {
+        n->predecessor = NULL;
+    }
+    pthread_mutex_unlock(&n->ring_lock);
+    if (forgotten) {
+        report_churn();
+    }
 
-        if (file_data_size > 0 && msg->segment_index + 1 == msg->total_segments) {
-            deserialize_file_entries(n, buf, file_data_size);
-        }
-    } else {
-        printf("Unknown message type: %s\n", msg->type);
+    // the reply tells the leaving node that its segments will be expected
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    memcpy(response.id, n->id, HASH_SIZE);
+    send_reply(n, msg, &response);
+
+    // receive the file metadata from the leaving node
+    if (receive_file_entries(n, msg->request_id, STORE_FILES) < 0) {
+        fprintf(stderr, "Leaving node went quiet during the handoff, some files may be missing\n");
+        note_incomplete_handoff(n->id, msg->id); // the range of the leaving node lies in (n, leaving]
+    }
+    unregister_request(&download_queue, msg->request_id);
+}
+
+static void handle_hot_key(Node *n, const Message *msg) {
+    accept_hot_key(n, msg);
+}
+
+static void handle_replicate(Node *n, const Message *msg) {
+    apply_replicate(n, msg);
+}
+
+static void handle_replica_sync(Node *n, const Message *msg) {
+    accept_replica_sync(n, msg);
+}
+
+static void handle_sync_digest(Node *n, const Message *msg) {
+    answer_sync_digest(n, msg);
+}
+
+static void handle_sync_entries(Node *n, const Message *msg) {
+    answer_sync_entries(n, msg);
+}
+
+// handler table indexed by opcode, unregistered opcodes are reported and dropped
+static MessageHandler handlers[MSG_TYPE_COUNT] = {
+    [MSG_FILE_DATA] = handle_file_data,
+    [MSG_FILE_END] = handle_file_data,
+    [MSG_REPLY] = handle_reply,
+    [MSG_JOIN] = handle_join,
+    [MSG_FIND_SUCCESSOR] = handle_find_successor,
+    [MSG_GET_FILES] = handle_get_files,
+    [MSG_STABILIZE] = handle_stabilize,
+    [MSG_NOTIFY] = handle_notify,
+    [MSG_UPDATE_SUCCESSOR] = handle_update_successor,
+    [MSG_HEARTBEAT] = handle_heartbeat,
+    [MSG_STORE_FILE] = handle_store_file,
+    [MSG_FIND_FILE] = handle_find_file,
+    [MSG_DOWNLOAD_FILE] = handle_download_file,
+    [MSG_DELETE_FILE] = handle_delete_file,
+    [MSG_LEAVING] = handle_leaving,
+    [MSG_FILE_ACK] = handle_file_ack,
+    [MSG_STORE_BATCH] = handle_store_batch,
+    [MSG_FIND_BATCH] = handle_find_batch,
+    [MSG_HOT_KEY] = handle_hot_key,
+    [MSG_REPLICATE] = handle_replicate,
+    [MSG_REPLICA_SYNC] = handle_replica_sync,
+    [MSG_SYNC_DIGEST] = handle_sync_digest,
+    [MSG_SYNC_ENTRIES] = handle_sync_entries,
+};
+
+// handlers not listed here are control-plane requests
+static const HandlerClass handler_classes[MSG_TYPE_COUNT] = {
+    [MSG_FILE_DATA] = HANDLER_INLINE,
+    [MSG_FILE_END] = HANDLER_INLINE,
+    [MSG_REPLY] = HANDLER_INLINE,
+    [MSG_FILE_ACK] = HANDLER_INLINE,
+    [MSG_DOWNLOAD_FILE] = HANDLER_BULK,
+    [MSG_GET_FILES] = HANDLER_BULK,
+    [MSG_LEAVING] = HANDLER_BULK,
+    [MSG_REPLICA_SYNC] = HANDLER_BULK,
+};
+
+// requests that must not be executed twice: a retransmission gets the remembered reply instead
+static const bool deduplicated[MSG_TYPE_COUNT] = {
+    [MSG_DOWNLOAD_FILE] = true,
+    [MSG_DELETE_FILE] = true,
+    [MSG_LEAVING] = true,
+    [MSG_REPLICA_SYNC] = true,
+    [MSG_STORE_BATCH] = true,
+};
+
+// number of messages dispatched per opcode (the last slot counts unknown opcodes)
+static atomic_ulong message_counters[MSG_TYPE_COUNT + 1];
+
+void register_handler(const MessageType type, const MessageHandler handler) {
+    if (type < MSG_TYPE_COUNT) {
+        handlers[type] = handler;
+    }
+}
+
+unsigned long get_message_count(const uint8_t type) {
+    return atomic_load(&message_counters[type < MSG_TYPE_COUNT ? type : MSG_TYPE_COUNT]);
+}
+
+HandlerClass get_handler_class(const uint8_t type) {
+    return type < MSG_TYPE_COUNT ? handler_classes[type] : HANDLER_INLINE;
+}
+
+void handle_requests(Node *n, const Message *msg) {
+    if (msg->type >= MSG_TYPE_COUNT || handlers[msg->type] == NULL) {
+        atomic_fetch_add(&message_counters[MSG_TYPE_COUNT], 1);
+        printf("Unknown message type: %u\n", msg->type);
+        return;
+    }
+    atomic_fetch_add(&message_counters[msg->type], 1);
+    if (deduplicated[msg->type] && resend_reply(n, msg)) {
+        return;
     }
+    handlers[msg->type](n, msg);
 }
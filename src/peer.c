@@ -0,0 +1,222 @@
+#include "peer.h"
+#include "sha1.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Peer *by_id[PEER_BUCKETS];
+static Peer *by_addr[PEER_BUCKETS];
+static int count;
+static Peer *forgotten; // unlinked records waiting for PEER_GRACE_MS, only touched by the sweep
+static pthread_rwlock_t peers_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// the first bytes of a SHA-1 digest are already uniformly distributed
+static size_t id_bucket(const uint8_t *id) {
+    return ((size_t) id[0] << 8 | id[1]) & (PEER_BUCKETS - 1);
+}
+
+// FNV-1a over the address string and the port, so known peers are found without parsing
+static size_t addr_bucket(const char *ip, const int port) {
+    uint32_t h = 2166136261u;
+    for (const char *c = ip; *c != '\0'; c++) {
+        h = (h ^ (uint8_t) *c) * 16777619u;
+    }
+    h = (h ^ (uint32_t) port) * 16777619u;
+    return h & (PEER_BUCKETS - 1);
+}
+
+// looks ip:port up in the address index, peers_lock must be held
+static Peer *lookup_addr(const size_t bucket, const char *ip, const int port) {
+    for (Peer *peer = by_addr[bucket]; peer != NULL; peer = peer->next_by_addr) {
+        if (peer->port == port && strcmp(peer->ip, ip) == 0) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+Peer *intern_peer(const char *ip, const int port) {
+    const size_t bucket = addr_bucket(ip, port);
+
+    pthread_rwlock_rdlock(&peers_lock);
+    Peer *peer = lookup_addr(bucket, ip, port);
+    if (peer != NULL) {
+        atomic_store_explicit(&peer->last_used_us, monotonic_us(), memory_order_relaxed);
+    }
+    pthread_rwlock_unlock(&peers_lock);
+    if (peer != NULL) {
+        return peer;
+    }
+
+    // hash and resolve outside the lock, another thread may intern the same peer meanwhile
+    Peer *created = (Peer *) calloc(1, sizeof(Peer));
+    if (created == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    char id_str[256];
+    snprintf(id_str, sizeof(id_str), "%s:%d", ip, port);
+    hash(id_str, created->id);
+    strncpy(created->ip, ip, sizeof(created->ip) - 1);
+    created->port = port;
+    created->addr.sin_family = AF_INET;
+    created->addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &created->addr.sin_addr);
+    atomic_init(&created->alive, true);
+    atomic_init(&created->last_used_us, monotonic_us());
+    pthread_mutex_init(&created->rtt_lock, NULL);
+
+    pthread_rwlock_wrlock(&peers_lock);
+    peer = lookup_addr(bucket, ip, port);
+    if (peer == NULL) {
+        peer = created;
+        created = NULL;
+        peer->next_by_addr = by_addr[bucket];
+        by_addr[bucket] = peer;
+        const size_t id_b = id_bucket(peer->id);
+        peer->next_by_id = by_id[id_b];
+        by_id[id_b] = peer;
+        count++;
+    }
+    pthread_rwlock_unlock(&peers_lock);
+
+    if (created != NULL) {
+        pthread_mutex_destroy(&created->rtt_lock);
+        free(created);
+    }
+    return peer;
+}
+
+Peer *find_peer_addr(const char *ip, const int port) {
+    pthread_rwlock_rdlock(&peers_lock);
+    Peer *peer = lookup_addr(addr_bucket(ip, port), ip, port);
+    pthread_rwlock_unlock(&peers_lock);
+    return peer;
+}
+
+Peer *find_peer(const uint8_t *id) {
+    pthread_rwlock_rdlock(&peers_lock);
+    Peer *peer = by_id[id_bucket(id)];
+    while (peer != NULL && memcmp(peer->id, id, HASH_SIZE) != 0) {
+        peer = peer->next_by_id;
+    }
+    pthread_rwlock_unlock(&peers_lock);
+    return peer;
+}
+
+int peer_count() {
+    pthread_rwlock_rdlock(&peers_lock);
+    const int result = count;
+    pthread_rwlock_unlock(&peers_lock);
+    return result;
+}
+
+uint64_t peer_rto(Peer *peer, const uint64_t initial, const uint64_t min, const uint64_t max) {
+    pthread_mutex_lock(&peer->rtt_lock);
+    uint64_t rto = peer->srtt != 0 ? peer->srtt + 4 * peer->rttvar : initial;
+    pthread_mutex_unlock(&peer->rtt_lock);
+
+    if (rto < min) {
+        rto = min;
+    } else if (rto > max) {
+        rto = max;
+    }
+    return rto;
+}
+
+uint64_t peer_srtt(Peer *peer) {
+    pthread_mutex_lock(&peer->rtt_lock);
+    const uint64_t srtt = peer->srtt;
+    pthread_mutex_unlock(&peer->rtt_lock);
+    return srtt;
+}
+
+void peer_rtt_sample(Peer *peer, const uint64_t sample) {
+    pthread_mutex_lock(&peer->rtt_lock);
+    if (peer->srtt == 0) {
+        peer->srtt = sample > 0 ? sample : 1;
+        peer->rttvar = sample / 2;
+    } else {
+        const uint64_t delta = sample > peer->srtt ? sample - peer->srtt : peer->srtt - sample;
+        peer->rttvar = (3 * peer->rttvar + delta) / 4;
+        peer->srtt = (7 * peer->srtt + sample) / 8;
+        if (peer->srtt == 0) {
+            peer->srtt = 1;
+        }
+    }
+    pthread_mutex_unlock(&peer->rtt_lock);
+    atomic_store(&peer->alive, true);
+}
+
+void peer_set_alive(Peer *peer, const bool alive) {
+    atomic_store(&peer->alive, alive);
+}
+
+void begin_peer_sweep() {
+    pthread_rwlock_rdlock(&peers_lock);
+    for (size_t b = 0; b < PEER_BUCKETS; b++) {
+        for (Peer *peer = by_addr[b]; peer != NULL; peer = peer->next_by_addr) {
+            peer->marked = false;
+        }
+    }
+    pthread_rwlock_unlock(&peers_lock);
+}
+
+void mark_peer(Peer *peer) {
+    if (peer != NULL) {
+        peer->marked = true;
+    }
+}
+
+// unlinks peer from the ID index, peers_lock must be held for writing
+static void unlink_id(const Peer *peer) {
+    Peer **link = &by_id[id_bucket(peer->id)];
+    while (*link != peer) {
+        link = &(*link)->next_by_id;
+    }
+    *link = peer->next_by_id;
+}
+
+int finish_peer_sweep() {
+    const uint64_t now = monotonic_us();
+    int forgotten_now = 0;
+
+    // records interned since begin_peer_sweep are unmarked but not idle, so they stay
+    pthread_rwlock_wrlock(&peers_lock);
+    for (size_t b = 0; b < PEER_BUCKETS; b++) {
+        Peer **link = &by_addr[b];
+        while (*link != NULL) {
+            Peer *peer = *link;
+            const uint64_t used = atomic_load_explicit(&peer->last_used_us, memory_order_relaxed);
+            if (peer->marked || now - used < PEER_IDLE_MS * 1000ULL) {
+                link = &peer->next_by_addr;
+                continue;
+            }
+            *link = peer->next_by_addr;
+            unlink_id(peer);
+            peer->forgotten_us = now;
+            peer->next_by_id = forgotten;
+            forgotten = peer;
+            count--;
+            forgotten_now++;
+        }
+    }
+    pthread_rwlock_unlock(&peers_lock);
+
+    // threads that looked a record up before it was forgotten are done with it by now
+    Peer **link = &forgotten;
+    while (*link != NULL) {
+        Peer *peer = *link;
+        if (now - peer->forgotten_us < PEER_GRACE_MS * 1000ULL) {
+            link = &peer->next_by_id;
+            continue;
+        }
+        *link = peer->next_by_id;
+        pthread_mutex_destroy(&peer->rtt_lock);
+        free(peer);
+    }
+    return forgotten_now;
+}
@@ -1,114 +1,482 @@
+#define _GNU_SOURCE // recvmmsg/sendmmsg
 #include "protocol.h"
 #include "node.h"
+#include "message_pool.h"
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
-void init_queue(MessageQueue *queue) {
-    queue->head = queue->tail = NULL;
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->cond, NULL);
+void init_queue(MessageQueue *queue, const size_t ring_size) {
+    memset(queue->buckets, 0, sizeof(queue->buckets));
+    for (int i = 0; i < PENDING_STRIPES; i++) {
+        pthread_mutex_init(&queue->mutex[i], NULL);
+    }
+    queue->ring_size = ring_size;
+    queue->pool = NULL;
+    queue->pool_count = 0;
+    pthread_mutex_init(&queue->pool_mutex, NULL);
 }
 
-void push_message(MessageQueue *queue, const Message *msg) {
-    MessageNode *new_msg = (MessageNode *) malloc(sizeof(MessageNode));
-    new_msg->msg = (Message *) malloc(sizeof(Message)); // Allocate memory for the Message
-    memcpy(new_msg->msg, msg, sizeof(Message)); // Copy Message data
-    new_msg->next = NULL;
+static size_t bucket_index(const uint32_t request_id) {
+    return (request_id * 2654435761u) >> 24 & (PENDING_BUCKETS - 1); // Knuth's multiplicative hash
+}
 
-    pthread_mutex_lock(&queue->mutex);
-    if (queue->tail == NULL) {
-        queue->head = queue->tail = new_msg;
-    } else {
-        queue->tail->next = new_msg;
-        queue->tail = new_msg;
+static pthread_mutex_t *bucket_mutex(MessageQueue *queue, const size_t bucket) {
+    return &queue->mutex[bucket % PENDING_STRIPES];
+}
+
+// finds the entry of request_id, the bucket's mutex must be held
+static PendingRequest *find_request(const MessageQueue *queue, const size_t bucket, const uint32_t request_id) {
+    PendingRequest *req = queue->buckets[bucket];
+    while (req != NULL && req->request_id != request_id) {
+        req = req->next;
     }
-    pthread_cond_broadcast(&queue->cond);
-    pthread_mutex_unlock(&queue->mutex);
+    return req;
 }
 
-Message *pop_message(MessageQueue *queue, const uint32_t request_id) {
-    pthread_mutex_lock(&queue->mutex);
-
-    MessageNode *prev = NULL;
-    MessageNode *msg_node = queue->head;
-
-    // Search for a message with the matching request_id
-    while (msg_node != NULL) {
-        if (msg_node->msg->request_id == request_id) {
-            // If it's the head, move the head pointer
-            if (msg_node == queue->head) {
-                queue->head = msg_node->next;
-                if (queue->head == NULL) {
-                    queue->tail = NULL;
-                }
-            } else if (prev) {
-                // Otherwise, unlink it from the list
-                prev->next = msg_node->next;
-                if (msg_node == queue->tail) {
-                    queue->tail = prev;
-                }
+// allocates an entry with an empty ring of the queue's size, returns NULL if memory ran out
+static PendingRequest *create_request(const MessageQueue *queue) {
+    PendingRequest *req = (PendingRequest *) malloc(sizeof(PendingRequest) + queue->ring_size * sizeof(RingSlot));
+    if (req == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    atomic_init(&req->tail, 0);
+    req->head = 0;
+    req->ring_mask = queue->ring_size - 1;
+    for (size_t i = 0; i < queue->ring_size; i++) {
+        atomic_init(&req->ring[i].seq, i);
+        req->ring[i].msg = NULL;
+    }
+
+    // timed waits measure their deadlines on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&req->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return req;
+}
+
+int register_request(MessageQueue *queue, const uint32_t request_id) {
+    // a pooled entry comes back drained, its ring goes on from where the last request left it
+    pthread_mutex_lock(&queue->pool_mutex);
+    PendingRequest *req = queue->pool;
+    if (req != NULL) {
+        queue->pool = req->next;
+        queue->pool_count--;
+    }
+    pthread_mutex_unlock(&queue->pool_mutex);
+    if (req == NULL && (req = create_request(queue)) == NULL) {
+        return -1;
+    }
+    req->request_id = request_id;
+    atomic_init(&req->refs, 1);
+    atomic_init(&req->sleeping, false);
+
+    const size_t bucket = bucket_index(request_id);
+    pthread_mutex_lock(bucket_mutex(queue, bucket));
+    req->next = queue->buckets[bucket];
+    queue->buckets[bucket] = req;
+    pthread_mutex_unlock(bucket_mutex(queue, bucket));
+    return 0;
+}
+
+// returns the entry of request_id with an extra reference, or NULL if it is not registered
+static PendingRequest *get_request(MessageQueue *queue, const uint32_t request_id) {
+    const size_t bucket = bucket_index(request_id);
+    pthread_mutex_lock(bucket_mutex(queue, bucket));
+    PendingRequest *req = find_request(queue, bucket, request_id);
+    if (req != NULL) {
+        atomic_fetch_add_explicit(&req->refs, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(bucket_mutex(queue, bucket));
+    return req;
+}
+
+// consumer side of the ring, returns NULL if it is empty
+static Message *ring_pop(PendingRequest *req) {
+    RingSlot *slot = &req->ring[req->head & req->ring_mask];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != req->head + 1) {
+        return NULL;
+    }
+    Message *msg = slot->msg;
+    atomic_store_explicit(&slot->seq, req->head + req->ring_mask + 1, memory_order_release);
+    req->head++;
+    return msg;
+}
+
+// producer side of the ring, returns false if it is full
+static bool ring_push(PendingRequest *req, Message *msg) {
+    size_t pos = atomic_load_explicit(&req->tail, memory_order_relaxed);
+    while (1) {
+        RingSlot *slot = &req->ring[pos & req->ring_mask];
+        const size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&req->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                slot->msg = msg;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return true;
             }
-            pthread_mutex_unlock(&queue->mutex);
-            Message *message = msg_node->msg;
-            free(msg_node); // Free the MessageNode
-            return message;
+        } else if (seq < pos) {
+            return false; // the consumer has not freed this slot yet
+        } else {
+            pos = atomic_load_explicit(&req->tail, memory_order_relaxed);
         }
-        prev = msg_node;
-        msg_node = msg_node->next;
     }
+}
 
-    // If no matching message is found, wait
-    while (1) {
-        pthread_cond_wait(&queue->cond, &queue->mutex);
-        msg_node = queue->head;
-        prev = NULL;
-
-        while (msg_node != NULL) {
-            if (msg_node->msg->request_id == request_id) {
-                // If it's the head, move the head pointer
-                if (msg_node == queue->head) {
-                    queue->head = msg_node->next;
-                    if (queue->head == NULL) {
-                        queue->tail = NULL;
-                    }
-                } else if (prev) {
-                    // Otherwise, unlink it from the list
-                    prev->next = msg_node->next;
-                    if (msg_node == queue->tail) {
-                        queue->tail = prev;
-                    }
-                }
-                pthread_mutex_unlock(&queue->mutex);
-                Message *message = msg_node->msg;
-                free(msg_node); // Free the MessageNode
-                return message;
+// drops a reference, the last one releases the messages left in the ring and returns the entry to the pool
+static void put_request(MessageQueue *queue, PendingRequest *req) {
+    if (atomic_fetch_sub_explicit(&req->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    // nobody else holds the entry, so every claimed slot has been published and the ring ends up empty
+    Message *msg;
+    while ((msg = ring_pop(req)) != NULL) {
+        release_message(msg);
+    }
+
+    pthread_mutex_lock(&queue->pool_mutex);
+    const bool pooled = queue->pool_count < PENDING_POOL;
+    if (pooled) {
+        req->next = queue->pool;
+        queue->pool = req;
+        queue->pool_count++;
+    }
+    pthread_mutex_unlock(&queue->pool_mutex);
+    if (!pooled) {
+        pthread_cond_destroy(&req->cond);
+        free(req);
+    }
+}
+
+void unregister_request(MessageQueue *queue, const uint32_t request_id) {
+    const size_t bucket = bucket_index(request_id);
+    pthread_mutex_lock(bucket_mutex(queue, bucket));
+
+    PendingRequest **link = &queue->buckets[bucket];
+    while (*link != NULL && (*link)->request_id != request_id) {
+        link = &(*link)->next;
+    }
+    PendingRequest *req = *link;
+    if (req != NULL) {
+        *link = req->next;
+    }
+
+    pthread_mutex_unlock(bucket_mutex(queue, bucket));
+
+    if (req != NULL) {
+        put_request(queue, req);
+    }
+}
+
+int push_message(MessageQueue *queue, const Message *msg) {
+    PendingRequest *req = get_request(queue, msg->request_id);
+    if (req == NULL) {
+        // late duplicate or reply to a request that already gave up
+        return -1;
+    }
+
+    Message *copy = acquire_message();
+    if (copy == NULL || !ring_push(req, memcpy(copy, msg, sizeof(Message)))) {
+        // the consumer is too far behind, senders retransmit what gets lost here
+        release_message(copy);
+        put_request(queue, req);
+        return -1;
+    }
+
+    // pairs with the fence in wait_message: either the consumer sees the message or we see it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&req->sleeping, memory_order_relaxed)) {
+        pthread_mutex_t *mutex = bucket_mutex(queue, bucket_index(msg->request_id));
+        pthread_mutex_lock(mutex);
+        pthread_cond_signal(&req->cond);
+        pthread_mutex_unlock(mutex);
+    }
+
+    put_request(queue, req);
+    return 0;
+}
+
+// waits until req has a message or the deadline (if any) passes
+static Message *wait_message(MessageQueue *queue, const uint32_t request_id, const struct timespec *deadline) {
+    PendingRequest *req = get_request(queue, request_id);
+    if (req == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_t *mutex = bucket_mutex(queue, bucket_index(request_id));
+    Message *message;
+    bool timed_out = false;
+    while ((message = ring_pop(req)) == NULL && !timed_out) {
+        pthread_mutex_lock(mutex);
+        atomic_store_explicit(&req->sleeping, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((message = ring_pop(req)) == NULL) {
+            if (deadline == NULL) {
+                pthread_cond_wait(&req->cond, mutex);
+            } else {
+                timed_out = pthread_cond_timedwait(&req->cond, mutex, deadline) == ETIMEDOUT;
             }
-            prev = msg_node;
-            msg_node = msg_node->next;
+        }
+        atomic_store_explicit(&req->sleeping, false, memory_order_relaxed);
+        pthread_mutex_unlock(mutex);
+        if (message != NULL) {
+            break;
         }
     }
+
+    put_request(queue, req);
+    return message;
 }
 
+Message *pop_message(MessageQueue *queue, const uint32_t request_id) {
+    return wait_message(queue, request_id, NULL);
+}
 
-int send_message(const Node *sender, const char *receiver_ip, const int receiver_port, const Message *msg) {
-    struct sockaddr_in receiver_addr = {0};
-    receiver_addr.sin_family = AF_INET;
-    receiver_addr.sin_port = htons(receiver_port);
-    receiver_addr.sin_addr.s_addr = inet_addr(receiver_ip);
+Message *pop_message_timeout(MessageQueue *queue, const uint32_t request_id, const int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return wait_message(queue, request_id, &deadline);
+}
+
+static const char *message_type_names[MSG_TYPE_COUNT] = {
+    [MSG_JOIN] = "JOIN",
+    [MSG_NOTIFY] = "NOTIFY",
+    [MSG_FIND_SUCCESSOR] = "FIND_SUCCESSOR",
+    [MSG_STABILIZE] = "STABILIZE",
+    [MSG_HEARTBEAT] = "HEARTBEAT",
+    [MSG_STORE_FILE] = "STORE_FILE",
+    [MSG_REPLY] = "REPLY",
+    [MSG_DOWNLOAD_FILE] = "DOWNLOAD_FILE",
+    [MSG_FIND_FILE] = "FIND_FILE",
+    [MSG_DELETE_FILE] = "DELETE_FILE",
+    [MSG_FILE_DATA] = "FILE_DATA",
+    [MSG_FILE_END] = "FILE_END",
+    [MSG_GET_FILES] = "GET_FILES",
+    [MSG_LEAVING] = "LEAVING",
+    [MSG_UPDATE_SUCCESSOR] = "UPDATE_SUCCESSOR",
+    [MSG_FILE_ACK] = "FILE_ACK",
+    [MSG_STORE_BATCH] = "STORE_BATCH",
+    [MSG_FIND_BATCH] = "FIND_BATCH",
+    [MSG_HOT_KEY] = "HOT_KEY",
+    [MSG_REPLICATE] = "REPLICATE",
+    [MSG_REPLICA_SYNC] = "REPLICA_SYNC",
+    [MSG_SYNC_DIGEST] = "SYNC_DIGEST",
+    [MSG_SYNC_ENTRIES] = "SYNC_ENTRIES",
+};
+
+const char *message_type_name(const uint8_t type) {
+    if (type >= MSG_TYPE_COUNT || message_type_names[type] == NULL) {
+        return "UNKNOWN";
+    }
+    return message_type_names[type];
+}
 
-    char buffer[MSG_SIZE];
+void set_message_text(Message *msg, const char *text) {
+    size_t len = strlen(text);
+    if (len >= sizeof(msg->data)) {
+        len = sizeof(msg->data) - 1;
+    }
+    memcpy(msg->data, text, len);
+    msg->data[len] = '\0';
+    msg->data_len = len;
+}
 
-    memcpy(buffer, msg, sizeof(Message)); // Copy entire Message structure
+static uint8_t *put_u16(uint8_t *p, const uint16_t v) {
+    const uint16_t be = htons(v);
+    memcpy(p, &be, sizeof(be));
+    return p + sizeof(be);
+}
+
+static uint8_t *put_u32(uint8_t *p, const uint32_t v) {
+    const uint32_t be = htonl(v);
+    memcpy(p, &be, sizeof(be));
+    return p + sizeof(be);
+}
+
+static const uint8_t *get_u16(const uint8_t *p, uint16_t *v) {
+    uint16_t be;
+    memcpy(&be, p, sizeof(be));
+    *v = ntohs(be);
+    return p + sizeof(be);
+}
+
+static const uint8_t *get_u32(const uint8_t *p, uint32_t *v) {
+    uint32_t be;
+    memcpy(&be, p, sizeof(be));
+    *v = ntohl(be);
+    return p + sizeof(be);
+}
+
+size_t encode_message(const Message *msg, uint8_t *buf, const size_t buf_size) {
+    const size_t data_len = msg->data_len > sizeof(msg->data) ? sizeof(msg->data) : msg->data_len;
+    const size_t total = WIRE_HEADER_MAX + data_len;
+
+    if (total > buf_size) {
+        return 0;
+    }
+
+    // the sender address travels as a raw IPv4 address instead of a dotted string
+    struct in_addr addr = {0};
+    if (inet_pton(AF_INET, msg->ip, &addr) != 1) {
+        addr.s_addr = 0;
+    }
+
+    uint8_t *p = buf;
+    *p++ = WIRE_VERSION;
+    *p++ = msg->type;
+    *p++ = msg->flags;
+    memcpy(p, msg->id, HASH_SIZE);
+    p += HASH_SIZE;
+    memcpy(p, &addr.s_addr, sizeof(addr.s_addr)); // already in network byte order
+    p += sizeof(addr.s_addr);
+    p = put_u16(p, (uint16_t) msg->port);
+    p = put_u32(p, msg->request_id);
+    p = put_u32(p, msg->segment_index);
+    p = put_u32(p, msg->total_segments);
+    p = put_u16(p, (uint16_t) data_len);
+    memcpy(p, msg->data, data_len);
+    p += data_len;
+
+    return p - buf;
+}
+
+int decode_message(const uint8_t *buf, const size_t len, Message *msg) {
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + len;
+
+    if (len < WIRE_HEADER_MAX || p[0] != WIRE_VERSION) {
+        return -1;
+    }
+    msg->type = p[1];
+    msg->flags = p[2];
+    p += 3;
+    memcpy(msg->id, p, HASH_SIZE);
+    p += HASH_SIZE;
+
+    struct in_addr addr;
+    memcpy(&addr.s_addr, p, sizeof(addr.s_addr));
+    p += sizeof(addr.s_addr);
+    if (addr.s_addr == 0) {
+        msg->ip[0] = '\0';
+    } else {
+        inet_ntop(AF_INET, &addr, msg->ip, sizeof(msg->ip));
+    }
+
+    uint16_t port, data_len;
+    p = get_u16(p, &port);
+    p = get_u32(p, &msg->request_id);
+    p = get_u32(p, &msg->segment_index);
+    p = get_u32(p, &msg->total_segments);
+    p = get_u16(p, &data_len);
+    msg->port = port;
+
+    if (data_len > sizeof(msg->data) || end - p < data_len) {
+        return -1;
+    }
+    memcpy(msg->data, p, data_len);
+    if (data_len < sizeof(msg->data)) {
+        msg->data[data_len] = '\0'; // text payloads are sent without their terminator
+    }
+    msg->data_len = data_len;
+
+    return 0;
+}
+
+// fills addr with ip:port, returns -1 if ip is not an IPv4 address
+static int resolve_address(const char *ip, const int port, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+static int send_to_address(const Node *sender, const struct sockaddr_in *addr, const Message *msg) {
+    uint8_t buffer[WIRE_MAX_SIZE];
+    const size_t len = encode_message(msg, buffer, sizeof(buffer));
+    if (len == 0) {
+        return -1;
+    }
 
     // Use MSG_CONFIRM if the message type is MSG_REPLY
-    const int flags = strcmp(msg->type, MSG_REPLY) == 0 ? MSG_CONFIRM : 0;
+    const int flags = msg->type == MSG_REPLY ? MSG_CONFIRM : 0;
 
-    return sendto(sender->sockfd, buffer, sizeof(Message), flags,
-                  (struct sockaddr *) &receiver_addr, sizeof(receiver_addr));
+    return sendto(sender->sockfd, buffer, len, flags, (const struct sockaddr *) addr, sizeof(struct sockaddr_in));
+}
+
+int send_message(const Node *sender, const char *receiver_ip, const int receiver_port, const Message *msg) {
+    struct sockaddr_in addr;
+    if (resolve_address(receiver_ip, receiver_port, &addr) < 0) {
+        return -1;
+    }
+    return send_to_address(sender, &addr, msg);
+}
+
+int send_to_peer(const Node *sender, const Peer *receiver, const Message *msg) {
+    return send_to_address(sender, &receiver->addr, msg);
+}
+
+static int send_batch_to_address(const Node *sender, const struct sockaddr_in *addr, const Message *msgs,
+                                 const int count) {
+    uint8_t buffers[SEND_BATCH][WIRE_MAX_SIZE];
+    struct iovec iovecs[SEND_BATCH];
+    struct mmsghdr headers[SEND_BATCH];
+    int sent = 0;
+
+    while (sent < count) {
+        const int batch = count - sent < SEND_BATCH ? count - sent : SEND_BATCH;
+
+        memset(headers, 0, sizeof(struct mmsghdr) * batch);
+        for (int i = 0; i < batch; i++) {
+            const size_t len = encode_message(&msgs[sent + i], buffers[i], sizeof(buffers[i]));
+            if (len == 0) {
+                return -1;
+            }
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = len;
+            headers[i].msg_hdr.msg_iov = &iovecs[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+            headers[i].msg_hdr.msg_name = (void *) addr;
+            headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        // sendmmsg may accept only part of the batch, resend the remainder on the next iteration
+        const int result = sendmmsg(sender->sockfd, headers, batch, 0);
+        if (result < 0) {
+            perror("sendmmsg failed");
+            return sent > 0 ? sent : -1;
+        }
+        sent += result;
+    }
+
+    return sent;
+}
+
+int send_messages(const Node *sender, const char *receiver_ip, const int receiver_port, const Message *msgs,
+                  const int count) {
+    struct sockaddr_in addr;
+    if (resolve_address(receiver_ip, receiver_port, &addr) < 0) {
+        return -1;
+    }
+    return send_batch_to_address(sender, &addr, msgs, count);
+}
+
+int send_messages_to_peer(const Node *sender, const Peer *receiver, const Message *msgs, const int count) {
+    return send_batch_to_address(sender, &receiver->addr, msgs, count);
 }
 
 int receive_message(const Node *n, Message *msg) {
@@ -120,8 +488,8 @@ int receive_message(const Node *n, Message *msg) {
     struct sockaddr_in sender_addr = {0};
     socklen_t sender_addr_len = sizeof(sender_addr);
 
-    char buffer[MSG_SIZE];
-    const int bytes_read = recvfrom(n->sockfd, buffer, MSG_SIZE, 0,
+    uint8_t buffer[WIRE_MAX_SIZE];
+    const int bytes_read = recvfrom(n->sockfd, buffer, sizeof(buffer), 0,
                                     (struct sockaddr *) &sender_addr, &sender_addr_len);
 
     if (bytes_read < 0) {
@@ -129,8 +497,59 @@ int receive_message(const Node *n, Message *msg) {
         return -1;
     }
 
-    memcpy(msg, buffer, sizeof(Message)); // Copy received data into Message
+    if (decode_message(buffer, bytes_read, msg) < 0) {
+        fprintf(stderr, "Dropping malformed message from %s:%d\n", inet_ntoa(sender_addr.sin_addr),
+                ntohs(sender_addr.sin_port));
+        return -1;
+    }
 
     return bytes_read;
 }
 
+int receive_messages(const Node *n, Message *msgs, int max) {
+    if (!n->socket_open) {
+        usleep(10000); // Sleep for 10ms to avoid busy waiting
+        return -1;
+    }
+
+    if (max > RECV_BATCH) {
+        max = RECV_BATCH;
+    }
+
+    uint8_t buffers[RECV_BATCH][WIRE_MAX_SIZE];
+    struct iovec iovecs[RECV_BATCH];
+    struct mmsghdr headers[RECV_BATCH];
+    struct sockaddr_in sender_addrs[RECV_BATCH];
+
+    memset(headers, 0, sizeof(struct mmsghdr) * max);
+    for (int i = 0; i < max; i++) {
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = sizeof(buffers[i]);
+        headers[i].msg_hdr.msg_iov = &iovecs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_hdr.msg_name = &sender_addrs[i];
+        headers[i].msg_hdr.msg_namelen = sizeof(sender_addrs[i]);
+    }
+
+    // the event loop only calls this once the socket is readable, so never block
+    const int received = recvmmsg(n->sockfd, headers, max, MSG_DONTWAIT, NULL);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        perror("recvmmsg failed");
+        return -1;
+    }
+
+    int decoded = 0;
+    for (int i = 0; i < received; i++) {
+        if (decode_message(buffers[i], headers[i].msg_len, &msgs[decoded]) < 0) {
+            fprintf(stderr, "Dropping malformed message from %s:%d\n", inet_ntoa(sender_addrs[i].sin_addr),
+                    ntohs(sender_addrs[i].sin_port));
+            continue;
+        }
+        decoded++;
+    }
+
+    return decoded;
+}
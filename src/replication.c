@@ -0,0 +1,452 @@
+#include "replication.h"
+#include "event_loop.h"
+#include "handoff.h"
+#include "location_cache.h"
+#include "message_pool.h"
+#include "metadata_store.h"
+#include "rpc.h"
+#include "sha1.h"
+#include "stabilization.h"
+#include "threads.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// changes waiting for the next REPLICATE message
+static pthread_mutex_t outbox_lock = PTHREAD_MUTEX_INITIALIZER;
+static Message outbox;
+static bool flush_armed; // a flush timer is pending
+
+// successors that hold a full copy of n->files, kept up to date by REPLICATE since
+static pthread_mutex_t synced_lock = PTHREAD_MUTEX_INITIALIZER;
+static Peer *synced[SUCCESSOR_LIST_SIZE];
+static int synced_count;
+
+// ranges whose owners keep their copies here, by owner
+typedef struct {
+    uint8_t from[HASH_SIZE];
+    uint8_t to[HASH_SIZE]; // the owner
+    uint64_t seen_us; // 0 for an unused slot
+} ReplicaRange;
+
+static pthread_mutex_t ranges_lock = PTHREAD_MUTEX_INITIALIZER;
+static ReplicaRange ranges[REPLICA_RANGES];
+
+// sync in flight
+typedef struct {
+    Node *node;
+    Peer *target;
+} Sync;
+
+int replica_targets(Node *n, Peer **targets) {
+    int count = 0;
+    pthread_mutex_lock(&n->ring_lock);
+    for (int i = 0; i < n->successor_count && count < n->replication - 1; i++) {
+        if (n->successor_list[i] == n->self) {
+            break; // fewer nodes than replicas
+        }
+        targets[count++] = n->successor_list[i];
+    }
+    pthread_mutex_unlock(&n->ring_lock);
+    return count;
+}
+
+// forgets that target holds a full copy, the next sync_replicas sends it one again
+static void forget_synced(const Peer *target) {
+    pthread_mutex_lock(&synced_lock);
+    for (int i = 0; i < synced_count; i++) {
+        if (synced[i] == target) {
+            synced[i] = synced[--synced_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&synced_lock);
+}
+
+static void on_replicate_reply(Node *n, const RpcStatus status, const Message *response, void *arg) {
+    (void) n;
+    (void) response;
+    if (status != RPC_OK) {
+        forget_synced((Peer *) arg);
+    }
+}
+
+static void send_replicate(Node *n, Message *msg) {
+    Peer *targets[SUCCESSOR_LIST_SIZE];
+    const int count = replica_targets(n, targets);
+    for (int i = 0; i < count; i++) {
+        msg->request_id = generate_id();
+        if (rpc_call_async(n, targets[i]->ip, targets[i]->port, msg, RPC_DEADLINE_MS, on_replicate_reply,
+                           targets[i]) != RPC_OK) {
+            forget_synced(targets[i]);
+        }
+    }
+}
+
+// takes the gathered changes out of the outbox, returns false if there are none
+static bool take_outbox(Message *msg) {
+    const bool pending = outbox.data_len > 0;
+    if (pending) {
+        memcpy(msg, &outbox, sizeof(Message));
+        outbox.data_len = 0;
+    }
+    return pending;
+}
+
+static void flush_outbox(void *arg) {
+    Node *n = (Node *) arg;
+    Message msg;
+    pthread_mutex_lock(&outbox_lock);
+    flush_armed = false;
+    const bool pending = take_outbox(&msg);
+    pthread_mutex_unlock(&outbox_lock);
+    if (pending) {
+        send_replicate(n, &msg);
+    }
+}
+
+static void append(Node *n, const uint8_t *record, const size_t len) {
+    if (n->replication < 2 || n->successor == n->self) {
+        return; // nobody to copy to, a successor that shows up is synced
+    }
+
+    Message full;
+    pthread_mutex_lock(&outbox_lock);
+    const bool send_full = outbox.data_len + len > sizeof(outbox.data) && take_outbox(&full);
+    if (outbox.type == 0) {
+        outbox.type = MSG_REPLICATE;
+        memcpy(outbox.id, n->id, HASH_SIZE);
+        strcpy(outbox.ip, n->ip);
+        outbox.port = n->port;
+    }
+    memcpy(outbox.data + outbox.data_len, record, len);
+    outbox.data_len += len;
+    if (!flush_armed) {
+        flush_armed = true;
+        add_timer(REPLICATE_FLUSH_MS, flush_outbox, n);
+    }
+    pthread_mutex_unlock(&outbox_lock);
+
+    if (send_full) {
+        send_replicate(n, &full);
+    }
+}
+
+size_t encode_put_record(const FileEntry *entry, uint8_t *buf, const size_t space) {
+    const size_t len = REPLICATE_RECORD_HEADER + REPLICATE_PUT_HEADER + entry->path_len;
+    if (len > space) {
+        return 0;
+    }
+    buf[0] = REPLICATE_PUT;
+    memcpy(buf + 1, entry->id, HASH_SIZE);
+    uint8_t *p = buf + REPLICATE_RECORD_HEADER;
+    memcpy(p, &entry->owner->addr.sin_addr.s_addr, 4); // already in network byte order
+    memcpy(p + 4, &entry->owner->addr.sin_port, 2);
+    const uint16_t path_len = htons(entry->path_len);
+    memcpy(p + 6, &path_len, 2);
+    memcpy(p + REPLICATE_PUT_HEADER, entry->path, entry->path_len);
+    return len;
+}
+
+int decode_record(const uint8_t **p, const uint8_t *end, const uint8_t **id, FileEntry **entry) {
+    const uint8_t *record = *p;
+    if (end - record < REPLICATE_RECORD_HEADER) {
+        return 0;
+    }
+    *id = record + 1;
+    *entry = NULL;
+    if (record[0] == REPLICATE_REMOVE) {
+        *p = record + REPLICATE_RECORD_HEADER;
+        return REPLICATE_REMOVE;
+    }
+
+    const uint8_t *put = record + REPLICATE_RECORD_HEADER;
+    uint16_t path_len;
+    if (record[0] != REPLICATE_PUT || end - put < REPLICATE_PUT_HEADER) {
+        return 0;
+    }
+    memcpy(&path_len, put + 6, 2);
+    path_len = ntohs(path_len);
+    if (end - put - REPLICATE_PUT_HEADER < path_len || path_len >= MAX_FILEPATH) {
+        return 0;
+    }
+    char path[MAX_FILEPATH];
+    memcpy(path, put + REPLICATE_PUT_HEADER, path_len);
+    path[path_len] = '\0';
+
+    char ip[16];
+    struct in_addr addr;
+    uint16_t port;
+    memcpy(&addr.s_addr, put, 4);
+    memcpy(&port, put + 4, 2);
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    *entry = create_file_entry(*id, path, intern_peer(ip, ntohs(port)));
+    *p = put + REPLICATE_PUT_HEADER + path_len;
+    return REPLICATE_PUT;
+}
+
+void replicate_put(Node *n, const FileEntry *entry) {
+    uint8_t record[sizeof(((Message *) 0)->data)];
+    const size_t len = encode_put_record(entry, record, sizeof(record));
+    if (len == 0) {
+        return; // reaches the replicas with their next sync
+    }
+    append(n, record, len);
+}
+
+void replicate_remove(Node *n, const uint8_t *id) {
+    uint8_t record[REPLICATE_RECORD_HEADER];
+    record[0] = REPLICATE_REMOVE;
+    memcpy(record + 1, id, HASH_SIZE);
+    append(n, record, sizeof(record));
+}
+
+void apply_replicate(Node *n, const Message *msg) {
+    const uint8_t *p = (const uint8_t *) msg->data;
+    const uint8_t *end = p + msg->data_len;
+    const uint8_t *id;
+    FileEntry *entry;
+    int op;
+
+    pthread_mutex_lock(&n->files_lock);
+    while ((op = decode_record(&p, end, &id, &entry)) != 0) {
+        if (op == REPLICATE_REMOVE) {
+            if (file_table_remove(&n->replicas, id) == 0) {
+                metadata_store_remove(n->store, STORE_REPLICAS, id);
+            }
+            location_cache_invalidate(id);
+        } else if (entry != NULL && file_table_insert(&n->replicas, entry) < 0) {
+            free(entry);
+        } else if (entry != NULL) {
+            metadata_store_put(n->store, STORE_REPLICAS, entry);
+        }
+    }
+    pthread_mutex_unlock(&n->files_lock);
+
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    memcpy(response.id, n->id, HASH_SIZE);
+    send_reply(n, msg, &response);
+}
+
+static void *sync_thread(void *arg) {
+    Sync *sync = (Sync *) arg;
+    Node *n = sync->node;
+    Peer *target = sync->target;
+    free(sync);
+
+    Message msg = {0};
+    msg.request_id = generate_id();
+    msg.type = MSG_REPLICA_SYNC;
+    memcpy(msg.id, n->id, HASH_SIZE);
+    strcpy(msg.ip, n->ip);
+    msg.port = n->port;
+    const Peer *predecessor = get_predecessor(n);
+    if (predecessor != NULL && predecessor != n->self) {
+        memcpy(msg.data, predecessor->id, HASH_SIZE);
+        msg.data_len = HASH_SIZE;
+    }
+
+    // the target has to expect the segments before they are sent
+    Message *response = NULL;
+    if (rpc_call(n, target->ip, target->port, &msg, &response, RPC_DEADLINE_MS) != RPC_OK) {
+        forget_synced(target);
+        return NULL;
+    }
+    release_message(response);
+
+    // copies are encoded and sent without the lock, changes made meanwhile follow as REPLICATE
+    pthread_mutex_lock(&n->files_lock);
+    FileEntry **entries = (FileEntry **) malloc((n->files.count + 1) * sizeof(FileEntry *));
+    size_t count = 0, pos = 0;
+    const FileEntry *entry;
+    bool copied = entries != NULL;
+    while (copied && (entry = file_table_next(&n->files, &pos)) != NULL) {
+        entries[count] = create_file_entry(entry->id, entry->path, entry->owner);
+        copied = entries[count] != NULL;
+        count += copied;
+    }
+    pthread_mutex_unlock(&n->files_lock);
+
+    if (!copied || send_file_entries(n, target, &msg, entries, count) < 0) {
+        perror("Failed to send the replicas");
+        forget_synced(target);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    return NULL;
+}
+
+void sync_replicas(Node *n) {
+    Peer *targets[SUCCESSOR_LIST_SIZE];
+    const int count = replica_targets(n, targets);
+
+    pthread_mutex_lock(&synced_lock);
+    Peer *started[SUCCESSOR_LIST_SIZE];
+    int started_count = 0;
+    for (int i = 0; i < count; i++) {
+        bool known = false;
+        for (int j = 0; j < synced_count && !known; j++) {
+            known = synced[j] == targets[i];
+        }
+        if (!known) {
+            started[started_count++] = targets[i];
+        }
+    }
+    // nodes that dropped out of the set are synced again if they come back
+    memcpy(synced, targets, count * sizeof(Peer *));
+    synced_count = count;
+    pthread_mutex_unlock(&synced_lock);
+
+    for (int i = 0; i < started_count; i++) {
+        Sync *sync = (Sync *) malloc(sizeof(Sync));
+        pthread_t tid;
+        if (sync == NULL) {
+            perror("malloc");
+            forget_synced(started[i]);
+            continue;
+        }
+        sync->node = n;
+        sync->target = started[i];
+        if (pthread_create(&tid, NULL, sync_thread, sync) != 0) {
+            perror("pthread_create");
+            forget_synced(started[i]);
+            free(sync);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
+
+void accept_replica_sync(Node *n, const Message *msg) {
+    if (register_request(&download_queue, msg->request_id) < 0) {
+        return; // without a reply the sender tries again on a later tick
+    }
+
+    // the copies of the sender's range are replaced, not merged with, so its deletions are not kept.
+    // Cleared before the reply: a REPLICATE sent once the sender has it is applied to the new copies
+    if (msg->data_len >= HASH_SIZE) {
+        const uint8_t *from = (const uint8_t *) msg->data;
+        FileEntry **entries;
+        pthread_mutex_lock(&n->files_lock);
+        const size_t count = file_table_take_range(&n->replicas, from, msg->id, &entries);
+        for (size_t i = 0; i < count; i++) {
+            metadata_store_remove(n->store, STORE_REPLICAS, entries[i]->id);
+            location_cache_invalidate(entries[i]->id);
+            free(entries[i]);
+        }
+        pthread_mutex_unlock(&n->files_lock);
+        free(entries);
+        note_replica_range(from, msg->id);
+    }
+
+    // the reply tells the sender that its segments will be expected
+    Message response = {0};
+    response.request_id = msg->request_id;
+    response.type = MSG_REPLY;
+    memcpy(response.id, n->id, HASH_SIZE);
+    send_reply(n, msg, &response);
+
+    if (receive_file_entries(n, msg->request_id, STORE_REPLICAS) < 0) {
+        fprintf(stderr, "%s:%d went quiet while sending its replicas\n", msg->ip, msg->port);
+    }
+    unregister_request(&download_queue, msg->request_id);
+}
+
+void promote_replicas(Node *n) {
+    const Peer *predecessor = get_predecessor(n);
+    if (predecessor == NULL) {
+        return;
+    }
+
+    FileEntry **entries;
+    size_t promoted = 0;
+    pthread_mutex_lock(&n->files_lock);
+    const size_t count = file_table_take_range(&n->replicas, predecessor->id, n->id, &entries);
+    for (size_t i = 0; i < count; i++) {
+        metadata_store_remove(n->store, STORE_REPLICAS, entries[i]->id);
+        if (file_table_insert(&n->files, entries[i]) < 0) {
+            free(entries[i]);
+            continue;
+        }
+        metadata_store_put(n->store, STORE_FILES, entries[i]);
+        replicate_put(n, entries[i]);
+        promoted++;
+    }
+    pthread_mutex_unlock(&n->files_lock);
+    free(entries);
+
+    if (promoted > 0) {
+        printf("Took over %zu entries from the replicas of a former predecessor\n", promoted);
+    }
+}
+
+void note_replica_range(const uint8_t *from, const uint8_t *to) {
+    pthread_mutex_lock(&ranges_lock);
+    // the slot of the same owner, otherwise the one not seen for the longest time
+    ReplicaRange *slot = &ranges[0];
+    for (int i = 0; i < REPLICA_RANGES; i++) {
+        if (ranges[i].seen_us != 0 && memcmp(ranges[i].to, to, HASH_SIZE) == 0) {
+            slot = &ranges[i];
+            break;
+        }
+        if (ranges[i].seen_us < slot->seen_us) {
+            slot = &ranges[i];
+        }
+    }
+    memcpy(slot->from, from, HASH_SIZE);
+    memcpy(slot->to, to, HASH_SIZE);
+    slot->seen_us = monotonic_us();
+    pthread_mutex_unlock(&ranges_lock);
+}
+
+void prune_replicas(Node *n) {
+    const Peer *predecessor = get_predecessor(n);
+    if (predecessor == NULL) {
+        return; // the replicas about to be promoted are not known
+    }
+
+    // the range of the predecessor is kept even if it went quiet, it is promoted once the predecessor is replaced
+    ReplicaRange live[REPLICA_RANGES];
+    int live_count = 0;
+    const uint64_t now = monotonic_us();
+    pthread_mutex_lock(&ranges_lock);
+    for (int i = 0; i < REPLICA_RANGES; i++) {
+        if (ranges[i].seen_us != 0 && (now - ranges[i].seen_us < REPLICA_RANGE_TTL_MS * 1000ULL ||
+                                       memcmp(ranges[i].to, predecessor->id, HASH_SIZE) == 0)) {
+            live[live_count++] = ranges[i];
+        }
+    }
+    pthread_mutex_unlock(&ranges_lock);
+
+    size_t dropped = 0, pos = 0;
+    const FileEntry *entry;
+    pthread_mutex_lock(&n->files_lock);
+    while ((entry = file_table_next(&n->replicas, &pos)) != NULL) {
+        bool kept = is_in_half_open_interval(entry->id, predecessor->id, n->id);
+        for (int i = 0; i < live_count && !kept; i++) {
+            kept = is_in_half_open_interval(entry->id, live[i].from, live[i].to);
+        }
+        if (kept) {
+            continue;
+        }
+        uint8_t id[HASH_SIZE];
+        memcpy(id, entry->id, HASH_SIZE);
+        file_table_remove(&n->replicas, id);
+        metadata_store_remove(n->store, STORE_REPLICAS, id);
+        location_cache_invalidate(id);
+        pos--;
+        dropped++;
+    }
+    pthread_mutex_unlock(&n->files_lock);
+
+    if (dropped > 0) {
+        printf("Dropped %zu replicas of ranges no longer copied to this node\n", dropped);
+    }
+}
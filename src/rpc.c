@@ -0,0 +1,240 @@
+#include "rpc.h"
+#include "threads.h"
+#include "utils.h"
+#include "event_loop.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// reply sent for a request, kept so that retransmissions get the same answer
+typedef struct {
+    bool used;
+    char ip[16]; // requester
+    int port;
+    Message reply;
+} CachedReply;
+
+// asynchronous call waiting for its reply
+typedef struct AsyncCall {
+    Node *node;
+    Message request;
+    Peer *peer;
+    uint64_t deadline;
+    uint64_t sent_at;
+    uint64_t rto;
+    int attempt;
+    Timer *timer; // retransmission or deadline timer
+    RpcCallback cb;
+    void *arg;
+    struct AsyncCall *next; // next call in the same bucket
+} AsyncCall;
+
+static CachedReply reply_cache[RPC_REPLY_CACHE];
+static pthread_mutex_t reply_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// returns the retransmission timeout towards peer, bounded by the RPC limits
+static uint64_t rpc_rto(Peer *peer) {
+    return peer_rto(peer, RPC_INITIAL_RTO_MS * 1000ULL, RPC_MIN_RTO_MS * 1000ULL, RPC_MAX_RTO_MS * 1000ULL);
+}
+
+RpcStatus rpc_call_open(const Node *n, const char *ip, const int port, const Message *request, Message **response,
+                        const int deadline_ms) {
+    const uint64_t deadline = monotonic_us() + (uint64_t) deadline_ms * 1000ULL;
+    Peer *peer = intern_peer(ip, port);
+    const uint64_t rto = rpc_rto(peer);
+
+    if (register_request(&reply_queue, request->request_id) < 0) {
+        return RPC_SEND_FAILED;
+    }
+
+    for (int attempt = 0; attempt <= RPC_MAX_RETRIES; attempt++) {
+        const uint64_t sent_at = monotonic_us();
+        if (sent_at >= deadline) {
+            break;
+        }
+        if (send_to_peer(n, peer, request) < 0) {
+            unregister_request(&reply_queue, request->request_id);
+            return RPC_SEND_FAILED;
+        }
+
+        // exponential backoff, bounded by the request's deadline
+        uint64_t wait = rto << attempt;
+        if (wait > RPC_MAX_RTO_MS * 1000ULL) {
+            wait = RPC_MAX_RTO_MS * 1000ULL;
+        }
+        if (wait > deadline - sent_at) {
+            wait = deadline - sent_at;
+        }
+
+        Message *reply = pop_message_timeout(&reply_queue, request->request_id, (int) ((wait + 999) / 1000));
+        if (reply != NULL) {
+            // a reply after a retransmission cannot be matched to one send (Karn's algorithm)
+            if (attempt == 0) {
+                peer_rtt_sample(peer, monotonic_us() - sent_at);
+            }
+            *response = reply;
+            return RPC_OK;
+        }
+    }
+
+    unregister_request(&reply_queue, request->request_id);
+    return RPC_TIMEOUT;
+}
+
+RpcStatus rpc_call(const Node *n, const char *ip, const int port, const Message *request, Message **response,
+                   const int deadline_ms) {
+    const RpcStatus status = rpc_call_open(n, ip, port, request, response, deadline_ms);
+    if (status == RPC_OK) {
+        rpc_close(request->request_id);
+    }
+    return status;
+}
+
+RpcStatus rpc_wait(const uint32_t request_id, Message **response, const int timeout_ms) {
+    *response = pop_message_timeout(&reply_queue, request_id, timeout_ms);
+    return *response != NULL ? RPC_OK : RPC_TIMEOUT;
+}
+
+void rpc_close(const uint32_t request_id) {
+    unregister_request(&reply_queue, request_id);
+}
+
+static AsyncCall *async_calls[RPC_ASYNC_BUCKETS];
+static pthread_mutex_t async_calls_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t async_bucket(const uint32_t request_id) {
+    return request_id * 2654435761u >> 24 & (RPC_ASYNC_BUCKETS - 1);
+}
+
+// unlinks and returns the call of request_id, async_calls_mutex must be held
+static AsyncCall *take_async_call(const uint32_t request_id) {
+    AsyncCall **link = &async_calls[async_bucket(request_id)];
+    while (*link != NULL && (*link)->request.request_id != request_id) {
+        link = &(*link)->next;
+    }
+    AsyncCall *call = *link;
+    if (call != NULL) {
+        *link = call->next;
+    }
+    return call;
+}
+
+// returns how long to wait for the reply to the current attempt of call
+static uint64_t async_wait(const AsyncCall *call) {
+    uint64_t wait = call->rto << call->attempt;
+    if (wait > RPC_MAX_RTO_MS * 1000ULL) {
+        wait = RPC_MAX_RTO_MS * 1000ULL;
+    }
+    if (wait > call->deadline - call->sent_at) {
+        wait = call->deadline - call->sent_at;
+    }
+    return wait;
+}
+
+static void on_async_timeout(void *arg) {
+    AsyncCall *call = (AsyncCall *) arg;
+
+    pthread_mutex_lock(&async_calls_mutex);
+    take_async_call(call->request.request_id);
+    pthread_mutex_unlock(&async_calls_mutex);
+
+    call->sent_at = monotonic_us();
+    if (++call->attempt <= RPC_MAX_RETRIES && call->sent_at < call->deadline &&
+        send_to_peer(call->node, call->peer, &call->request) >= 0) {
+        pthread_mutex_lock(&async_calls_mutex);
+        const size_t bucket = async_bucket(call->request.request_id);
+        call->next = async_calls[bucket];
+        async_calls[bucket] = call;
+        call->timer = add_timer((async_wait(call) + 999) / 1000, on_async_timeout, call);
+        pthread_mutex_unlock(&async_calls_mutex);
+        return;
+    }
+
+    call->cb(call->node, RPC_TIMEOUT, NULL, call->arg);
+    free(call);
+}
+
+RpcStatus rpc_call_async(Node *n, const char *ip, const int port, const Message *request, const int deadline_ms,
+                         const RpcCallback cb, void *arg) {
+    AsyncCall *call = (AsyncCall *) malloc(sizeof(AsyncCall));
+    if (call == NULL) {
+        perror("malloc");
+        return RPC_SEND_FAILED;
+    }
+    call->node = n;
+    memcpy(&call->request, request, sizeof(Message));
+    Peer *peer = intern_peer(ip, port);
+    call->peer = peer;
+    call->sent_at = monotonic_us();
+    call->deadline = call->sent_at + (uint64_t) deadline_ms * 1000ULL;
+    call->rto = rpc_rto(peer);
+    call->attempt = 0;
+    call->cb = cb;
+    call->arg = arg;
+
+    // the call has to be findable before the reply can arrive
+    pthread_mutex_lock(&async_calls_mutex);
+    const size_t bucket = async_bucket(request->request_id);
+    call->next = async_calls[bucket];
+    async_calls[bucket] = call;
+    call->timer = add_timer((async_wait(call) + 999) / 1000, on_async_timeout, call);
+    pthread_mutex_unlock(&async_calls_mutex);
+
+    // a failed send is retried like a lost datagram, the timer owns the call from here on
+    send_to_peer(n, peer, request);
+    return RPC_OK;
+}
+
+bool rpc_complete(Node *n, const Message *reply) {
+    (void) n;
+    pthread_mutex_lock(&async_calls_mutex);
+    AsyncCall *call = take_async_call(reply->request_id);
+    pthread_mutex_unlock(&async_calls_mutex);
+    if (call == NULL) {
+        return false;
+    }
+
+    cancel_timer(call->timer);
+    if (call->attempt == 0) {
+        peer_rtt_sample(call->peer, monotonic_us() - call->sent_at);
+    }
+    call->cb(call->node, RPC_OK, reply, call->arg);
+    free(call);
+    return true;
+}
+
+static CachedReply *reply_slot(const uint32_t request_id) {
+    return &reply_cache[request_id * 2654435761u >> 24 & (RPC_REPLY_CACHE - 1)];
+}
+
+int send_reply(const Node *n, const Message *request, const Message *response) {
+    pthread_mutex_lock(&reply_cache_mutex);
+    CachedReply *slot = reply_slot(response->request_id);
+    slot->used = true;
+    strcpy(slot->ip, request->ip);
+    slot->port = request->port;
+    memcpy(&slot->reply, response, sizeof(Message));
+    pthread_mutex_unlock(&reply_cache_mutex);
+
+    return send_message(n, request->ip, request->port, response);
+}
+
+bool resend_reply(const Node *n, const Message *request) {
+    Message reply;
+    bool found = false;
+
+    pthread_mutex_lock(&reply_cache_mutex);
+    const CachedReply *slot = reply_slot(request->request_id);
+    if (slot->used && slot->reply.request_id == request->request_id && slot->port == request->port &&
+        strcmp(slot->ip, request->ip) == 0) {
+        memcpy(&reply, &slot->reply, sizeof(Message));
+        found = true;
+    }
+    pthread_mutex_unlock(&reply_cache_mutex);
+
+    if (found) {
+        send_message(n, request->ip, request->port, &reply);
+    }
+    return found;
+}
@@ -1,32 +1,97 @@
 #include "stabilization.h"
+#include "anti_entropy.h"
 #include "file_entry.h"
+#include "handoff.h"
 #include "protocol.h"
 #include "sha1.h"
 #include "utils.h"
+#include "rpc.h"
+#include "message_pool.h"
+#include "maintenance.h"
+#include "id160.h"
+#include "location_cache.h"
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <threads.h>
 
+// computes the start of every finger interval of the local node once, n + 2^i mod 2^160
+static void init_finger_starts(Node *n) {
+    n->finger_start = malloc(M * sizeof(*n->finger_start));
+    if (n->finger_start == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    uint160 id, start;
+    id160_from_bytes(&id, n->id);
+    for (int i = 0; i < M; i++) {
+        id160_add_pow2(&start, &id, i);
+        id160_to_bytes(n->finger_start[i], &start);
+    }
+}
+
 // create new chord ring
 void create_ring(Node *n) {
+    init_finger_starts(n);
+    pthread_mutex_lock(&n->ring_lock);
     n->predecessor = NULL;
-    n->successor = n;
+    pthread_mutex_unlock(&n->ring_lock);
+    n->successor = n->self;
+    n->successor_count = 0;
     printf("New ring created.\n");
 }
 
+// takes over the entries of (predecessor, n] that source holds, returns once its handoff ended
+static void fetch_files(Node *n, const Peer *source) {
+    Message msg = {0};
+    msg.request_id = generate_id();
+    msg.type = MSG_GET_FILES;
+    memcpy(msg.id, n->id, HASH_SIZE);
+    strcpy(msg.ip, n->ip);
+    msg.port = n->port;
+    msg.data_len = 0;
+
+    if (register_request(&download_queue, msg.request_id) < 0 || send_to_peer(n, source, &msg) < 0) {
+        // nothing could be received, or the source failed to respond
+        unregister_request(&download_queue, msg.request_id);
+        return;
+    }
+
+    if (receive_file_entries(n, msg.request_id, STORE_FILES) < 0) {
+        fprintf(stderr, "%s:%d went quiet during the handoff, some files may be missing\n", source->ip,
+                source->port);
+        note_incomplete_handoff(n->id, n->id); // the predecessor, and so the range, may not be known yet
+    }
+    unregister_request(&download_queue, msg.request_id);
+}
+
+typedef struct {
+    Node *node;
+    Peer *source;
+} Fetch;
+
+static void *fetch_thread(void *arg) {
+    Fetch *fetch = (Fetch *) arg;
+    fetch_files(fetch->node, fetch->source);
+    free(fetch);
+    return NULL;
+}
+
 // join an existing chord ring
 void join_ring(Node *n, const char *existing_ip, const int existing_port) {
+    init_finger_starts(n);
+
     // check if existing node is reachable
-    Message msg;
+    Message msg = {0};
     msg.request_id = generate_id();
-    strcpy(msg.type, MSG_HEARTBEAT);
+    msg.type = MSG_HEARTBEAT;
     memcpy(msg.id, n->id, HASH_SIZE);
     strcpy(msg.ip, n->ip);
     msg.port = n->port;
-    strcpy(msg.data, "");
+    msg.data_len = 0;
 
     if (send_message(n, existing_ip, existing_port, &msg) < 0) {
         printf("Unable to reach the existing node at %s:%d\n", existing_ip, existing_port);
@@ -36,72 +101,182 @@ void join_ring(Node *n, const char *existing_ip, const int existing_port) {
 
     // send a JOIN message to the existing node
     msg.request_id = generate_id();
-    strcpy(msg.type, MSG_JOIN);
+    msg.type = MSG_JOIN;
     memcpy(msg.id, n->id, HASH_SIZE);
     strcpy(msg.ip, n->ip);
     msg.port = n->port;
-    strcpy(msg.data, "");
-    send_message(n, existing_ip, existing_port, &msg);
+    msg.data_len = 0;
 
     // the existing node will respond with the new node's successor
-    const Message *response = pop_message(&reply_queue, msg.request_id);
-    if (response == NULL) {
+    Message *response = NULL;
+    if (rpc_call(n, existing_ip, existing_port, &msg, &response, RPC_DEADLINE_MS) != RPC_OK) {
         printf("Failed to join the ring at %s:%d\n", existing_ip, existing_port);
         fflush(stdout);
         exit(EXIT_FAILURE);
     }
 
-    // create a new node for the successor
-    Node *successor = create_node(response->ip, response->port);
+    Peer *successor = intern_peer(response->ip, response->port);
+    release_message(response);
 
     // set the new node's successor to the one returned by the existing node
+    pthread_mutex_lock(&n->ring_lock);
     n->predecessor = NULL;
+    pthread_mutex_unlock(&n->ring_lock);
+    set_successor(n, successor);
+
+    // retrieve the files metadata from the successor
+    fetch_files(n, n->successor);
+
+    printf("Joined the ring at %s:%d\n", n->successor->ip, n->successor->port);
+}
+
+void set_successor(Node *n, Peer *successor) {
+    pthread_mutex_lock(&n->ring_lock);
+    const int kept = n->successor_count < SUCCESSOR_LIST_SIZE ? n->successor_count : SUCCESSOR_LIST_SIZE - 1;
+    memmove(&n->successor_list[1], &n->successor_list[0], kept * sizeof(Peer *));
+    n->successor_list[0] = successor;
+    n->successor_count = kept + 1;
     n->successor = successor;
+    pthread_mutex_unlock(&n->ring_lock);
+    report_churn();
+}
 
-    // start retrieving the files metadata from the successor
-    Message msg2;
-    msg2.request_id = generate_id();
-    strcpy(msg2.type, MSG_GET_FILES);
-    memcpy(msg2.id, n->id, HASH_SIZE);
-    strcpy(msg2.ip, n->ip);
-    msg2.port = n->port;
-    strcpy(msg2.data, "");
-
-    if (send_message(n, n->successor->ip, n->successor->port, &msg2) < 0) {
-        // the successor failed to respond
-        printf("Joined the ring at %s:%d\n", n->successor->ip, n->successor->port);
+void node_failed(Node *n, Peer *dead) {
+    if (dead == n->self) {
         return;
     }
+    peer_set_alive(dead, false);
 
-    char *buf = malloc(4096);
-    size_t buf_size = 4096;
-    size_t file_data_size = 0;
+    pthread_mutex_lock(&n->ring_lock);
+    int count = 0;
+    for (int i = 0; i < n->successor_count; i++) {
+        if (n->successor_list[i] != dead) {
+            n->successor_list[count++] = n->successor_list[i];
+        }
+    }
+    n->successor_count = count;
+    // fail over to the next live entry, or stand alone if none is left
+    n->successor = count > 0 ? n->successor_list[0] : n->self;
+
+    // fingers falling back to the successor route around the dead node until the next round
+    for (int i = 0; i < M; i++) {
+        if (n->finger[i] == dead) {
+            n->finger[i] = n->successor;
+        }
+    }
+    if (n->predecessor == dead) {
+        n->predecessor = NULL;
+    }
+    pthread_mutex_unlock(&n->ring_lock);
+    report_churn();
+}
 
-    // receive the file metadata from the successor
-    while ((response = pop_message(&download_queue, msg2.request_id)) != NULL && strcmp(response->type, MSG_FILE_END) !=
-           0) {
-        const size_t segment_start = response->segment_index * sizeof(response->data);
-        const size_t segment_end = segment_start + response->data_len;
+Peer *get_predecessor(Node *n) {
+    pthread_mutex_lock(&n->ring_lock);
+    Peer *predecessor = n->predecessor;
+    pthread_mutex_unlock(&n->ring_lock);
+    return predecessor;
+}
 
-        if (segment_end > buf_size) {
-            buf = realloc(buf, segment_end);
-            buf_size = segment_end;
-        }
+// encodes peers into buf as SUCCESSOR_ENTRY_SIZE entries, as many as fit, returns the length
+static size_t encode_peers(Peer *const *peers, const int count, uint8_t *buf, const size_t size) {
+    size_t len = 0;
+    for (int i = 0; i < count && len + SUCCESSOR_ENTRY_SIZE <= size; i++) {
+        memcpy(buf + len, &peers[i]->addr.sin_addr.s_addr, 4); // already in network byte order
+        memcpy(buf + len + 4, &peers[i]->addr.sin_port, 2);
+        len += SUCCESSOR_ENTRY_SIZE;
+    }
+    return len;
+}
+
+static Peer *decode_peer(const uint8_t *entry) {
+    struct in_addr addr;
+    memcpy(&addr.s_addr, entry, 4);
+    char ip[16];
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    return intern_peer(ip, entry[4] << 8 | entry[5]);
+}
 
-        memcpy(buf + segment_start, response->data, response->data_len);
+size_t encode_successor_list(Node *n, uint8_t *buf, const size_t size) {
+    pthread_mutex_lock(&n->ring_lock);
+    const size_t len = encode_peers(n->successor_list, n->successor_count, buf, size);
+    pthread_mutex_unlock(&n->ring_lock);
+    return len;
+}
+
+size_t encode_replicas(const FileLookup *result, uint8_t *buf, const size_t size) {
+    return result->replica_count > 1 ? encode_peers(result->replicas + 1, result->replica_count - 1, buf, size) : 0;
+}
+
+// rebuilds the successor list as our successor followed by the list it sent, minus ourselves
+static void merge_successor_list(Node *n, const Message *response) {
+    Peer *list[SUCCESSOR_LIST_SIZE];
+    int count = 0;
+
+    pthread_mutex_lock(&n->ring_lock);
+    if (n->successor == n->self) {
+        pthread_mutex_unlock(&n->ring_lock);
+        return;
+    }
+    list[count++] = n->successor;
+    for (size_t off = 0; off + SUCCESSOR_ENTRY_SIZE <= response->data_len && count < SUCCESSOR_LIST_SIZE;
+         off += SUCCESSOR_ENTRY_SIZE) {
+        Peer *entry_peer = decode_peer((const uint8_t *) response->data + off);
+        if (entry_peer == n->self) {
+            break; // the list came round the whole ring
+        }
+        list[count++] = entry_peer;
+    }
+    memcpy(n->successor_list, list, count * sizeof(Peer *));
+    n->successor_count = count;
+    pthread_mutex_unlock(&n->ring_lock);
+}
 
-        if (response->segment_index + 1 == response->total_segments) {
-            file_data_size = segment_end;
+// x is the successor's predecessor (an empty address means it has none yet)
+static void on_stabilize_reply(Node *n, const RpcStatus status, const Message *response, void *arg) {
+    Peer *target = (Peer *) arg;
+    if (status != RPC_OK) {
+        fprintf(stderr, "Successor %s:%d did not answer STABILIZE\n", target->ip, target->port);
+        // fail over to the next entry of the successor list right away
+        node_failed(n, target);
+        if (n->successor != n->self) {
+            stabilize(n);
         }
+        return;
     }
 
-    if (file_data_size > 0 && response->segment_index + 1 == response->total_segments) {
-        deserialize_file_entries(n, buf, file_data_size);
+    // the list is only meaningful if target is still our successor
+    if (target == n->successor) {
+        merge_successor_list(n, response);
     }
 
-    printf("Joined the ring at %s:%d\n", n->successor->ip, n->successor->port);
+    if (response->ip[0] != '\0') {
+        Peer *x = intern_peer(response->ip, response->port);
+
+        // if x is in the interval (n, successor), then update the successor
+        if (is_in_interval(x->id, n->id, n->successor->id)) {
+            set_successor(n, x);
+            // x may have joined through the old successor at the same time as this node and been handed
+            // entries of (predecessor, n], they are fetched back without blocking the loop
+            Fetch *fetch = (Fetch *) malloc(sizeof(Fetch));
+            pthread_t tid;
+            if (fetch == NULL) {
+                perror("malloc");
+            } else {
+                fetch->node = n;
+                fetch->source = x;
+                if (pthread_create(&tid, NULL, fetch_thread, fetch) != 0) {
+                    perror("pthread_create");
+                    free(fetch);
+                } else {
+                    pthread_detach(tid);
+                }
+            }
+        }
+    }
 
-    free(buf);
+    // notify the new successor to update its predecessor
+    notify(n, n->successor);
 }
 
 /*
@@ -109,128 +284,237 @@ void join_ring(Node *n, const char *existing_ip, const int existing_port) {
  * verifies it to be itself. If not, its verified that the new
  * node lies between itself and successor. Therefore, the new
  * node is set as the new successor. The new node is also notified
- * of its new predecessor.
+ * of its new predecessor. The reply, which also carries the
+ * successor's own successor list, is handled asynchronously.
  */
 void stabilize(Node *n) {
     // send a STABILIZE message to the successor
-    Message msg;
+    Message msg = {0};
     msg.request_id = generate_id();
-    strcpy(msg.type, MSG_STABILIZE);
+    msg.type = MSG_STABILIZE;
     memcpy(msg.id, n->id, HASH_SIZE);
     strcpy(msg.ip, n->ip);
     msg.port = n->port;
-    strcpy(msg.data, "");
-    send_message(n, n->successor->ip, n->successor->port, &msg);
+    msg.data_len = 0;
 
-    // receive the successor's predecessor to verify
-    const Message *response = pop_message(&reply_queue, msg.request_id);
-
-    // x is the successor's predecessor
-    Node *x = create_node(response->ip, response->port);
-
-    // if x is in the interval (n, successor), then update the successor
-    if (is_in_interval(x->id, n->id, n->successor->id)) {
-        n->successor = x;
-    }
-
-    // notify the new successor to update its predecessor
-    notify(n->successor, n);
+    Peer *successor = n->successor;
+    rpc_call_async(n, successor->ip, successor->port, &msg, RPC_DEADLINE_MS, on_stabilize_reply, successor);
 }
 
-void notify(Node *n, Node *n_prime) {
-    // send a NOTIFY message to n
-    Message msg;
+void notify(const Node *n, const Peer *successor) {
+    // send a NOTIFY message to the successor
+    Message msg = {0};
     msg.request_id = generate_id();
-    strcpy(msg.type, MSG_NOTIFY);
-    memcpy(msg.id, n_prime->id, HASH_SIZE);
-    strcpy(msg.ip, n_prime->ip);
-    msg.port = n_prime->port;
-    strcpy(msg.data, "");
-
-    // notify that n_prime might be its new predecessor
-    send_message(n_prime, n->ip, n->port, &msg);
+    msg.type = MSG_NOTIFY;
+    memcpy(msg.id, n->id, HASH_SIZE);
+    strcpy(msg.ip, n->ip);
+    msg.port = n->port;
+    msg.data_len = 0;
 
-    if (n->predecessor == NULL || is_in_interval(n->id, n->predecessor->id, n->id)) {
-        n->predecessor = n_prime;
-    }
+    // notify that n might be its new predecessor
+    send_to_peer(n, successor, &msg);
 }
 
-/*
- * Called periodically. Refreshes finger table entries.
- * next is the index of the next finger to fix.
- */
-void fix_fingers(Node *n, int *next) {
-    *next = (*next + 1) % M;
-    Node *finger = find_successor(n, n->finger[*next]->id);
-    n->finger[*next] = finger;
+// called periodically. make sure predecessor is still alive
+static void on_heartbeat_reply(Node *n, const RpcStatus status, const Message *response, void *arg) {
+    (void) response;
+    // if the predecessor does not respond, it has failed -> set it to NULL
+    if (status != RPC_OK) {
+        pthread_mutex_lock(&n->ring_lock);
+        const bool failed = n->predecessor == (Peer *) arg;
+        if (failed) {
+            n->predecessor = NULL;
+        }
+        pthread_mutex_unlock(&n->ring_lock);
+        if (failed) {
+            peer_set_alive((Peer *) arg, false);
+            report_churn();
+        }
+    }
 }
 
-// called periodically. make sure predecessor is still alive
 void check_predecessor(Node *n) {
-    if (n->predecessor == NULL) {
+    Peer *predecessor = get_predecessor(n);
+    if (predecessor == NULL) {
         return;
     }
 
     // send a heartbeat message to the predecessor
-    Message msg;
+    Message msg = {0};
     msg.request_id = generate_id();
-    strcpy(msg.type, MSG_HEARTBEAT);
+    msg.type = MSG_HEARTBEAT;
     memcpy(msg.id, n->id, HASH_SIZE);
     strcpy(msg.ip, n->ip);
     msg.port = n->port;
-    strcpy(msg.data, "");
+    msg.data_len = 0;
 
-    // if the predecessor does not respond, it has failed -> set it to NULL
-    if (send_message(n, n->predecessor->ip, n->predecessor->port, &msg) < 0) {
-        n->predecessor = NULL;
-    }
+    rpc_call_async(n, predecessor->ip, predecessor->port, &msg, RPC_DEADLINE_MS, on_heartbeat_reply, predecessor);
 }
 
-// ask node n to find the successor of id
-Node *find_successor(Node *n, const uint8_t *id) {
-    if (memcmp(id, n->id, HASH_SIZE) > 0 && memcmp(id, n->successor->id, HASH_SIZE) <= 0) {
-        return n->successor;
-    }
-
-    const Node *current = closest_preceding_node(n, id);
-    return find_successor_remote(n, current, id);
+// time left of budget_ms since started_us
+static uint32_t time_left(const uint64_t started_us, const uint32_t budget_ms) {
+    const uint64_t elapsed_ms = (monotonic_us() - started_us) / 1000;
+    return elapsed_ms < budget_ms ? (uint32_t) (budget_ms - elapsed_ms) : 0;
 }
 
-Node *find_successor_remote(const Node *n, const Node *n0, const uint8_t *id) {
-    // Avoid sending message to itself
-    if (n0 == n) {
-        return n->successor;
-    }
-
-    // send a FIND_SUCCESSOR message to the current node
-    Message msg;
+/*
+ * Sends FIND_SUCCESSOR to n0 and waits up to deadline_ms, a reply carrying a cached location or the
+ * replicas of a file fills result. *reachable tells whether n0 answered, even if only that it failed.
+ */
+static Peer *ask_successor(const Node *n, const Peer *n0, const uint8_t *id, const uint8_t flags,
+                           const uint32_t deadline_ms, FileLookup *result, bool *reachable) {
+    Message msg = {0};
     msg.request_id = generate_id();
-    strcpy(msg.type, MSG_FIND_SUCCESSOR);
+    msg.type = MSG_FIND_SUCCESSOR;
+    msg.flags = flags;
     memcpy(msg.id, id, HASH_SIZE);
     strcpy(msg.ip, n->ip);
     msg.port = n->port;
-    strcpy(msg.data, "");
-
-    send_message(n, n0->ip, n0->port, &msg);
+    const uint32_t budget = htonl(deadline_ms);
+    memcpy(msg.data, &budget, 4);
+    msg.data_len = 4;
 
     // receive the successor's info
-    const Message *response = pop_message(&reply_queue, msg.request_id);
-
-    Node *successor = n->successor;
-    memcpy(successor->id, response->id, HASH_SIZE);
-    strcpy(successor->ip, response->ip);
-    successor->port = response->port;
+    Message *response = NULL;
+    *reachable = rpc_call(n, n0->ip, n0->port, &msg, &response, (int) deadline_ms) == RPC_OK;
+    if (!*reachable) {
+        return NULL;
+    }
 
+    Peer *successor = NULL;
+    if (response->flags & MSG_FLAG_FAILED) {
+        // n0 is alive, the lookup failed past it
+    } else if (result != NULL && response->flags & MSG_FLAG_LOCATION && response->data_len < sizeof(result->found.filepath)) {
+        FileInfo *found = &result->found;
+        memcpy(found->id, id, HASH_SIZE);
+        memcpy(found->filepath, response->data, response->data_len);
+        found->filepath[response->data_len] = '\0';
+        const char *filename = strrchr(found->filepath, '/');
+        strncpy(found->filename, filename != NULL ? filename + 1 : found->filepath, sizeof(found->filename) - 1);
+        found->filename[sizeof(found->filename) - 1] = '\0';
+        strcpy(found->owner_ip, response->ip);
+        found->owner_port = response->port;
+        result->hit = true;
+    } else {
+        successor = intern_peer(response->ip, response->port);
+        if (result != NULL) {
+            // the responsible node is followed by the other replicas
+            result->replicas[0] = successor;
+            result->replica_count = 1;
+            for (size_t off = 0; off + SUCCESSOR_ENTRY_SIZE <= response->data_len &&
+                                 result->replica_count < SUCCESSOR_LIST_SIZE; off += SUCCESSOR_ENTRY_SIZE) {
+                result->replicas[result->replica_count++] = decode_peer((const uint8_t *) response->data + off);
+            }
+        }
+    }
+    release_message(response);
     return successor;
 }
 
+Peer *find_successor(Node *n, const uint8_t *id) {
+    return find_successor_within(n, id, RPC_DEADLINE_MS);
+}
+
+Peer *find_successor_within(Node *n, const uint8_t *id, const uint32_t budget_ms) {
+    const uint64_t started_us = monotonic_us();
+    for (int attempt = 0; attempt <= SUCCESSOR_LIST_SIZE; attempt++) {
+        Peer *successor = n->successor;
+        if (is_in_half_open_interval(id, n->id, successor->id)) {
+            return successor;
+        }
+
+        Peer *current = closest_preceding_node(n, id);
+        if (current == n->self) {
+            return n->successor;
+        }
+        const uint32_t left = time_left(started_us, budget_ms);
+        if (left < LOOKUP_MIN_HOP_MS) {
+            return NULL;
+        }
+        bool reachable;
+        Peer *result = ask_successor(n, current, id, 0, left, NULL, &reachable);
+        if (result != NULL || reachable) {
+            return result;
+        }
+        // only a hop that does not answer at all is forgotten, and the lookup retried around it
+        node_failed(n, current);
+    }
+    return NULL;
+}
+
+// the responsible node for an ID in (n, successor] and its replicas are the first k nodes of the successor list
+static void local_replicas(Node *n, FileLookup *result) {
+    pthread_mutex_lock(&n->ring_lock);
+    result->replicas[0] = n->successor;
+    result->replica_count = 1;
+    for (int i = 1; i < n->successor_count && result->replica_count < n->replication; i++) {
+        result->replicas[result->replica_count++] = n->successor_list[i];
+    }
+    // a list that stops short came round the whole ring: with fewer nodes than replicas this one holds a copy too
+    if (result->replicas[0] != n->self && result->replica_count < n->replication &&
+        n->successor_count < SUCCESSOR_LIST_SIZE) {
+        result->replicas[result->replica_count++] = n->self;
+    }
+    pthread_mutex_unlock(&n->ring_lock);
+}
+
+void lookup_file(Node *n, const uint8_t *id, FileLookup *result) {
+    lookup_file_within(n, id, result, RPC_DEADLINE_MS);
+}
+
+void lookup_file_within(Node *n, const uint8_t *id, FileLookup *result, const uint32_t budget_ms) {
+    const uint64_t started_us = monotonic_us();
+    result->replica_count = 0;
+    Peer *refresh;
+    if ((result->hit = location_cache_get(id, &result->found, &refresh))) {
+        if (refresh != NULL) {
+            location_cache_refresh(n, result->found.filename, refresh);
+        }
+        return;
+    }
+
+    for (int attempt = 0; attempt <= SUCCESSOR_LIST_SIZE; attempt++) {
+        Peer *current = closest_preceding_node(n, id);
+        if (is_in_half_open_interval(id, n->id, n->successor->id) || current == n->self) {
+            local_replicas(n, result);
+            return;
+        }
+        const uint32_t left = time_left(started_us, budget_ms);
+        if (left < LOOKUP_MIN_HOP_MS) {
+            return;
+        }
+        bool reachable;
+        if (ask_successor(n, current, id, MSG_FLAG_LOCATION, left, result, &reachable) != NULL) {
+            return;
+        }
+        if (result->hit) {
+            location_cache_put(&result->found, current);
+            return;
+        }
+        if (reachable) {
+            return; // the lookup failed past current, which is alive
+        }
+        node_failed(n, current);
+    }
+}
+
+Peer *find_successor_remote(const Node *n, const Peer *n0, const uint8_t *id) {
+    // Avoid sending message to itself
+    if (n0 == n->self) {
+        return n->successor;
+    }
+    bool reachable;
+    return ask_successor(n, n0, id, 0, RPC_DEADLINE_MS, NULL, &reachable);
+}
+
 // search the local finger table for the highest predecessor of id
-Node *closest_preceding_node(Node *n, const uint8_t *id) {
+Peer *closest_preceding_node(const Node *n, const uint8_t *id) {
     // search the finger table in reverse order to find the closest node
     for (int i = M - 1; i >= 0; i--) {
-        if (is_in_interval(n->finger[i]->id, n->id, id)) {
-            return n->finger[i];
+        Peer *finger = n->finger[i]; // node_failed may replace it meanwhile
+        if (is_in_interval(finger->id, n->id, id)) {
+            return finger;
         }
     }
-    return n;
+    return n->self;
 }
@@ -2,6 +2,13 @@
 #include "node.h"
 #include "stabilization.h"
 #include "file_entry.h"
+#include "message_pool.h"
+#include "workers.h"
+#include "event_loop.h"
+#include "maintenance.h"
+#include "bulk.h"
+#include "location_cache.h"
+#include "anti_entropy.h"
 #include <ctype.h>
 #include <pthread.h>
 #include <signal.h>
@@ -10,29 +17,109 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 
 MessageQueue reply_queue;
 MessageQueue download_queue;
+MessageQueue ack_queue;
 
-void *node_thread(void *arg) {
-    Node *n = (Node *) arg;
-    while (1) {
-        stabilize(n);
-        fix_fingers(n, &(int){0});
-        check_predecessor(n);
-        sleep(15);
+// drains the datagrams queued on the node's socket, runs on the event loop
+static void on_datagrams(const int fd, const uint32_t events, void *arg) {
+    (void) fd;
+    (void) events;
+    Node *node = (Node *) arg;
+    Message msgs[RECV_BATCH];
+
+    // one syscall per batch, whatever is left makes the socket ready again
+    const int count = receive_messages(node, msgs, RECV_BATCH);
+    for (int i = 0; i < count; i++) {
+        // only hand-offs to waiting requests run here, everything else goes to a worker pool
+        const HandlerClass handler_class = get_handler_class(msgs[i].type);
+        if (handler_class == HANDLER_INLINE) {
+            handle_requests(node, &msgs[i]);
+        } else if (submit_message(handler_class, &msgs[i]) < 0) {
+            fprintf(stderr, "Dropped %s message, workers are overloaded\n", message_type_name(msgs[i].type));
+        }
     }
 }
 
-void *listener_thread(void *arg) {
+void *event_loop_thread(void *arg) {
     Node *node = (Node *) arg;
-    Message msg;
+    if (event_loop_add_fd(node->sockfd, EPOLLIN, on_datagrams, node) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    event_loop_run();
+    return NULL;
+}
 
-    while (1) {
-        if (receive_message(node, &msg) > 0) {
-            handle_requests(node, &msg);
+// prints the result of one name of find -m / find -f as it arrives
+static void print_found(const char *filename, const FileInfo *info, const bool failed, void *arg) {
+    (void) arg;
+    if (info != NULL) {
+        printf("File '%s' found at %s:%d\n", filename, info->owner_ip, info->owner_port);
+    } else if (failed) {
+        printf("Lookup of '%s' failed\n", filename);
+    } else {
+        printf("File '%s' not found\n", filename);
+    }
+}
+
+// looks up the filenames separated by spaces in args, or listed one per line in the file args names
+static void find_names(Node *node, char *args, const bool from_file) {
+    char **names = NULL;
+    size_t count = 0, capacity = 0;
+    FILE *list = NULL;
+    char line[MAX_FILENAME + 2];
+    char *name = NULL;
+
+    if (from_file) {
+        args[strcspn(args, " ")] = '\0';
+        if ((list = fopen(args, "r")) == NULL) {
+            perror("Failed to open the list of filenames");
+            return;
         }
+    } else {
+        name = strtok(args, " ");
     }
+
+    while (from_file ? fgets(line, sizeof(line), list) != NULL : name != NULL) {
+        if (from_file) {
+            line[strcspn(line, "\r\n")] = '\0';
+            name = line;
+        }
+        if (strlen(name) > 0) {
+            if (count == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 64;
+                char **grown = (char **) realloc(names, capacity * sizeof(char *));
+                if (grown == NULL) {
+                    perror("realloc");
+                    break;
+                }
+                names = grown;
+            }
+            if ((names[count] = strdup(name)) == NULL) {
+                perror("strdup");
+                break;
+            }
+            count++;
+        }
+        if (!from_file) {
+            name = strtok(NULL, " ");
+        }
+    }
+    if (list != NULL) {
+        fclose(list);
+    }
+
+    size_t failed = 0;
+    const int found = find_many(node, (const char *const *) names, count, print_found, NULL, &failed);
+    if (found >= 0) {
+        printf("%d of %zu files found, %zu lookups failed\n", found, count, failed);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
 }
 
 // main thread (blocking)
@@ -54,6 +141,20 @@ void handle_user_commands(Node *node) {
             } else {
                 printf("Output directory set to %s\n", new_outdir);
             }
+        } else if (strncmp(command, "store -r", 8) == 0) {
+            char dirpath[512] = "";
+            sscanf(command, "store -r %511s", dirpath);
+            if (strlen(dirpath) == 0) {
+                printf("Invalid directory\n");
+                continue;
+            }
+            size_t failed = 0;
+            const int stored = store_tree(node, dirpath, &failed);
+            if (stored < 0) {
+                printf("Failed to walk %s\n", dirpath);
+            } else {
+                printf("%d files stored successfully, %zu failed\n", stored, failed);
+            }
         } else if (strncmp(command, "store", 5) == 0) {
             char filepath[512];
             sscanf(command, "store %511s", filepath);
@@ -67,6 +168,8 @@ void handle_user_commands(Node *node) {
             }
             confirm_file_stored(node, filepath);
             printf("File stored successfully\n");
+        } else if (strncmp(command, "find -m ", 8) == 0 || strncmp(command, "find -f ", 8) == 0) {
+            find_names(node, command + 8, command[6] == 'f');
         } else if (strncmp(command, "find", 4) == 0) {
             char filename[256];
             sscanf(command, "find %255s", filename);
@@ -74,7 +177,7 @@ void handle_user_commands(Node *node) {
                 printf("Invalid filename\n");
                 continue;
             }
-            FileEntry *file = find_file(node, filename);
+            FileInfo *file = find_file(node, filename);
             if (file == NULL) {
                 printf("File '%s' not found\n", filename);
             } else {
@@ -94,18 +197,21 @@ void handle_user_commands(Node *node) {
                 } else {
                     printf("Download canceled.\n");
                 }
+                free(file);
             }
         } else if (strcmp(command, "uploaded") == 0) {
-            FileEntry *cur = node->uploaded_files;
-            if (cur == NULL) {
+            pthread_mutex_lock(&node->files_lock);
+            if (node->uploaded_files.count == 0) {
                 printf("No files uploaded yet.\n");
             } else {
                 printf("Files uploaded:\n");
-                while (cur != NULL) {
-                    printf("  %s\n", cur->filename);
-                    cur = cur->next;
+                size_t pos = 0;
+                const FileEntry *cur;
+                while ((cur = file_table_next(&node->uploaded_files, &pos)) != NULL) {
+                    printf("  %s\n", file_entry_name(cur));
                 }
             }
+            pthread_mutex_unlock(&node->files_lock);
         } else if (strncmp(command, "delete", 6) == 0) {
             char filename[256];
             sscanf(command, "delete %255s", filename);
@@ -118,13 +224,59 @@ void handle_user_commands(Node *node) {
             } else {
                 printf("File deleted successfully\n");
             }
+        } else if (strcmp(command, "stats") == 0) {
+            printf("Messages handled:\n");
+            for (int type = 0; type < MSG_TYPE_COUNT; type++) {
+                printf("  %-16s %lu\n", message_type_name(type), get_message_count(type));
+            }
+            printf("  %-16s %lu\n", message_type_name(MSG_TYPE_COUNT), get_message_count(MSG_TYPE_COUNT));
+            printf("Message pool: %zu/%d in use, %lu dropped\n", message_pool_in_use(), MESSAGE_POOL_SIZE,
+                   message_pool_drops());
+            LocationCacheStats cache;
+            get_location_cache_stats(&cache);
+            printf("Location cache: %zu/%d entries, %lu hits, %lu misses, %lu refreshes\n", cache.entries,
+                   LOCATION_CACHE_SIZE, cache.hits, cache.misses, cache.refreshes);
+            AntiEntropyStats anti_entropy;
+            get_anti_entropy_stats(&anti_entropy);
+            printf("Anti-entropy: %lu rounds, %lu subtrees compared, %lu entries repaired\n", anti_entropy.rounds,
+                   anti_entropy.subtrees, anti_entropy.repaired);
+        } else if (strcmp(command, "status") == 0) {
+            MaintenanceStatus status;
+            get_maintenance_status(&status);
+            printf("Node %s:%d\n", node->ip, node->port);
+            printf("  successor   %s:%d\n", node->successor->ip, node->successor->port);
+            pthread_mutex_lock(&node->ring_lock);
+            for (int i = 1; i < node->successor_count; i++) {
+                printf("  backup %d    %s:%d\n", i, node->successor_list[i]->ip, node->successor_list[i]->port);
+            }
+            pthread_mutex_unlock(&node->ring_lock);
+            const Peer *predecessor = get_predecessor(node);
+            if (predecessor != NULL) {
+                printf("  predecessor %s:%d\n", predecessor->ip, predecessor->port);
+            } else {
+                printf("  predecessor none\n");
+            }
+            printf("  peers       %d known\n", peer_count());
+            pthread_mutex_lock(&node->files_lock);
+            printf("  entries     %zu, %zu replicas (k = %d)\n", node->files.count, node->replicas.count,
+                   node->replication);
+            pthread_mutex_unlock(&node->files_lock);
+            printf("  fingers     %d distinct nodes, %lu rounds (last: %d lookups, %d changes)\n",
+                   status.distinct_fingers, status.rounds, status.last_lookups, status.last_changes);
+            printf("  maintenance every %lu ms, %s\n", (unsigned long) status.interval_ms,
+                   status.converged ? "converged" : "converging");
         } else if (strcmp(command, "help") == 0 || strcmp(command, "?") == 0) {
             printf("Available commands:\n");
             printf("  outdir <directory> - set the output directory for downloaded files\n");
             printf("  store <filepath> - store a file in the network\n");
+            printf("  store -r <directory> - store every file under a directory\n");
             printf("  find <filename> - find a file in the network\n");
+            printf("  find -m <filename>... - find several files at once\n");
+            printf("  find -f <listfile> - find the files named in a list, one per line\n");
             printf("  uploaded - list all files uploaded by the user\n");
             printf("  delete <filename> - delete a file uploaded by the user\n");
+            printf("  status - show the ring neighbours and whether the finger table has converged\n");
+            printf("  stats - show how many messages of each type were handled and the message pool usage\n");
             printf("  help/? - show this help message\n");
             printf("  exit - exit the program\n");
         } else if (strcmp(command, "exit") == 0) {
@@ -0,0 +1,754 @@
+#define _GNU_SOURCE // splice
+#include "transfer.h"
+#include "threads.h"
+#include "utils.h"
+#include "rpc.h"
+#include "message_pool.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef enum {
+    SEGMENT_UNSENT,
+    SEGMENT_IN_FLIGHT,
+    SEGMENT_LOST, // waiting for retransmission
+    SEGMENT_ACKED
+} SegmentState;
+
+typedef struct {
+    uint64_t sent_at; // time of the last transmission (us)
+    uint32_t tx_seq; // transmission counter value of the last transmission
+    uint8_t state; // SegmentState
+    bool retransmitted; // RTT samples are only taken from segments sent once (Karn's algorithm)
+} SegmentInfo;
+
+// sender side state of one file transfer
+typedef struct {
+    Node *n;
+    char ip[16]; // receiver
+    int port;
+    Message header; // template for the FILE_DATA segments
+    int fd;
+    uint32_t total;
+    SegmentInfo *segments;
+    uint32_t base; // lowest segment not acknowledged yet
+    uint32_t next; // lowest segment never sent
+    uint32_t in_flight;
+    uint32_t lost;
+    uint32_t retransmit_cursor; // no lost segment lies below this index
+    uint32_t tx_seq; // incremented on every transmission
+    uint32_t highest_acked_seq; // highest tx_seq acknowledged so far
+    uint32_t recovery_seq; // losses of segments sent before this do not shrink the window again
+    double cwnd;
+    double ssthresh;
+    uint64_t srtt, rttvar, rto, min_rtt; // microseconds
+} Transfer;
+
+static size_t segment_size() {
+    return sizeof(((Message *) 0)->data);
+}
+
+// Jacobson/Karels estimator: RTO = SRTT + 4 * RTTVAR
+static void transfer_update_rtt(Transfer *t, const uint64_t sample) {
+    if (t->srtt == 0) {
+        t->srtt = sample;
+        t->rttvar = sample / 2;
+    } else {
+        const uint64_t delta = sample > t->srtt ? sample - t->srtt : t->srtt - sample;
+        t->rttvar = (3 * t->rttvar + delta) / 4;
+        t->srtt = (7 * t->srtt + sample) / 8;
+    }
+    if (t->min_rtt == 0 || sample < t->min_rtt) {
+        t->min_rtt = sample;
+    }
+    t->rto = t->srtt + 4 * t->rttvar;
+    if (t->rto < TRANSFER_MIN_RTO_MS * 1000ULL) {
+        t->rto = TRANSFER_MIN_RTO_MS * 1000ULL;
+    } else if (t->rto > TRANSFER_MAX_RTO_MS * 1000ULL) {
+        t->rto = TRANSFER_MAX_RTO_MS * 1000ULL;
+    }
+}
+
+// halves the window once per round trip worth of losses
+static void transfer_on_loss(Transfer *t, const SegmentInfo *info) {
+    if (info->tx_seq < t->recovery_seq) {
+        return;
+    }
+    t->ssthresh = t->cwnd / 2 < 2 ? 2 : t->cwnd / 2;
+    t->cwnd = t->ssthresh;
+    t->recovery_seq = t->tx_seq + 1;
+}
+
+// picks the next segment to transmit: lost segments first, then new ones
+static bool transfer_next_segment(Transfer *t, uint32_t *index) {
+    if (t->lost > 0) {
+        uint32_t i = t->retransmit_cursor > t->base ? t->retransmit_cursor : t->base;
+        for (; i < t->next; i++) {
+            if (t->segments[i].state == SEGMENT_LOST) {
+                t->retransmit_cursor = i + 1;
+                *index = i;
+                return true;
+            }
+        }
+    }
+    if (t->next < t->total) {
+        *index = t->next++;
+        return true;
+    }
+    return false;
+}
+
+// sends as many segments as the congestion window allows, SEND_BATCH per syscall
+static int transfer_send_window(Transfer *t) {
+    Message batch[SEND_BATCH];
+    int count = 0;
+    uint32_t index;
+
+    while (t->in_flight < (uint32_t) t->cwnd && transfer_next_segment(t, &index)) {
+        Message *segment = &batch[count++];
+        memcpy(segment, &t->header, offsetof(Message, data));
+        segment->segment_index = index;
+
+        const ssize_t bytes_read = pread(t->fd, segment->data, segment_size(), (off_t) index * segment_size());
+        if (bytes_read < 0) {
+            perror("pread");
+            return -1;
+        }
+        segment->data_len = bytes_read;
+
+        SegmentInfo *info = &t->segments[index];
+        if (info->state == SEGMENT_LOST) {
+            t->lost--;
+        }
+        info->retransmitted = info->state != SEGMENT_UNSENT;
+        info->state = SEGMENT_IN_FLIGHT;
+        info->sent_at = monotonic_us();
+        info->tx_seq = ++t->tx_seq;
+        t->in_flight++;
+
+        if (count == SEND_BATCH) {
+            if (send_messages(t->n, t->ip, t->port, batch, count) < 0) {
+                return -1;
+            }
+            count = 0;
+        }
+    }
+
+    if (count > 0 && send_messages(t->n, t->ip, t->port, batch, count) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// marks a segment as acknowledged, returns true if it was not acknowledged before
+static bool transfer_mark_acked(Transfer *t, const uint32_t index) {
+    SegmentInfo *info = &t->segments[index];
+    if (info->state == SEGMENT_ACKED) {
+        return false;
+    }
+    if (info->state == SEGMENT_IN_FLIGHT) {
+        t->in_flight--;
+    } else if (info->state == SEGMENT_LOST) {
+        t->lost--;
+    }
+    info->state = SEGMENT_ACKED;
+    if (info->tx_seq > t->highest_acked_seq) {
+        t->highest_acked_seq = info->tx_seq;
+    }
+    return true;
+}
+
+// applies a FILE_ACK, returns the number of newly acknowledged segments
+static uint32_t transfer_on_ack(Transfer *t, const Message *ack) {
+    if (ack->data_len < TRANSFER_ACK_HEADER) {
+        return 0;
+    }
+
+    uint32_t cumulative, echo;
+    memcpy(&cumulative, ack->data, sizeof(cumulative));
+    memcpy(&echo, ack->data + 4, sizeof(echo));
+    cumulative = ntohl(cumulative);
+    echo = ntohl(echo);
+    if (cumulative > t->total) {
+        cumulative = t->total;
+    }
+
+    uint32_t newly_acked = 0;
+    bool echo_acked = false;
+
+    for (uint32_t i = t->base; i < cumulative; i++) {
+        if (transfer_mark_acked(t, i)) {
+            newly_acked++;
+            echo_acked |= i == echo;
+        }
+    }
+
+    const uint8_t *bitmap = (const uint8_t *) ack->data + TRANSFER_ACK_HEADER;
+    const size_t bitmap_bits = (ack->data_len - TRANSFER_ACK_HEADER) * 8;
+    for (size_t bit = 0; bit < bitmap_bits; bit++) {
+        const uint64_t index = (uint64_t) cumulative + 1 + bit;
+        if (index >= t->total) {
+            break;
+        }
+        if (bitmap[bit / 8] & (1u << (bit % 8)) && transfer_mark_acked(t, (uint32_t) index)) {
+            newly_acked++;
+            echo_acked |= index == echo;
+        }
+    }
+
+    if (echo_acked && !t->segments[echo].retransmitted) {
+        transfer_update_rtt(t, monotonic_us() - t->segments[echo].sent_at);
+    }
+
+    while (t->base < t->total && t->segments[t->base].state == SEGMENT_ACKED) {
+        t->base++;
+    }
+
+    // anything sent well before an acknowledged transmission and still missing is presumed lost
+    bool loss = false;
+    for (uint32_t i = t->base; i < t->next; i++) {
+        SegmentInfo *info = &t->segments[i];
+        if (info->state == SEGMENT_IN_FLIGHT && info->tx_seq + TRANSFER_REORDER_THRESHOLD < t->highest_acked_seq) {
+            info->state = SEGMENT_LOST;
+            t->in_flight--;
+            t->lost++;
+            if (i < t->retransmit_cursor) {
+                t->retransmit_cursor = i;
+            }
+            if (!loss && info->tx_seq >= t->recovery_seq) {
+                transfer_on_loss(t, info);
+                loss = true;
+            }
+        }
+    }
+
+    if (newly_acked > 0 && !loss) {
+        // a growing RTT means a queue is building up somewhere: stop growing before it overflows
+        const bool queueing = t->min_rtt > 0 && t->srtt > 2 * t->min_rtt + 1000;
+        if (t->cwnd < t->ssthresh) {
+            if (queueing) {
+                t->ssthresh = t->cwnd;
+            } else {
+                t->cwnd += newly_acked; // slow start
+            }
+        } else if (!queueing) {
+            t->cwnd += (double) newly_acked / t->cwnd; // congestion avoidance
+        }
+        if (t->cwnd > TRANSFER_MAX_WINDOW) {
+            t->cwnd = TRANSFER_MAX_WINDOW;
+        }
+    }
+
+    return newly_acked;
+}
+
+// nothing was acknowledged for a whole RTO: everything in flight is presumed lost
+static void transfer_on_timeout(Transfer *t) {
+    for (uint32_t i = t->base; i < t->next; i++) {
+        if (t->segments[i].state == SEGMENT_IN_FLIGHT) {
+            t->segments[i].state = SEGMENT_LOST;
+            t->lost++;
+        }
+    }
+    t->in_flight = 0;
+    t->retransmit_cursor = t->base;
+    t->ssthresh = t->cwnd / 2 < 2 ? 2 : t->cwnd / 2;
+    t->cwnd = 2;
+    t->recovery_seq = t->tx_seq + 1;
+    t->rto = t->rto * 2 > TRANSFER_MAX_RTO_MS * 1000ULL ? TRANSFER_MAX_RTO_MS * 1000ULL : t->rto * 2;
+}
+
+static void *transfer_thread(void *arg) {
+    Transfer *t = (Transfer *) arg;
+    const uint32_t request_id = t->header.request_id;
+    int timeouts = 0;
+    int status = 0;
+
+    while (t->base < t->total) {
+        if (transfer_send_window(t) < 0) {
+            status = -1;
+            break;
+        }
+
+        const int timeout_ms = t->rto / 1000 > 0 ? (int) (t->rto / 1000) : 1;
+        Message *ack = pop_message_timeout(&ack_queue, request_id, timeout_ms);
+        if (ack == NULL) {
+            if (++timeouts > TRANSFER_MAX_TIMEOUTS) {
+                fprintf(stderr, "Transfer to %s:%d timed out\n", t->ip, t->port);
+                status = -1;
+                break;
+            }
+            transfer_on_timeout(t);
+            continue;
+        }
+
+        // apply every ACK that is already queued before refilling the window
+        do {
+            if (transfer_on_ack(t, ack) > 0) {
+                timeouts = 0;
+            }
+            release_message(ack);
+        } while ((ack = pop_message_timeout(&ack_queue, request_id, 0)) != NULL);
+    }
+
+    Message end;
+    memcpy(&end, &t->header, sizeof(Message));
+    end.type = MSG_FILE_END;
+    end.total_segments = t->total;
+    set_message_text(&end, status == 0 ? "Transfer complete" : "Transfer interrupted");
+    send_message(t->n, t->ip, t->port, &end);
+
+    unregister_request(&ack_queue, request_id);
+    close(t->fd);
+    free(t->segments);
+    free(t);
+    return NULL;
+}
+
+// sender side state of one TCP stream transfer
+typedef struct {
+    int listen_fd;
+    int fd;
+    off_t size;
+    struct in_addr requester; // only this address may connect
+} Stream;
+
+// writes all of len bytes to a socket
+static int send_all(const int sockfd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        const ssize_t sent = send(sockfd, p, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// reads exactly len bytes from a socket
+static int recv_all(const int sockfd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        const ssize_t received = recv(sockfd, p, len, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += received;
+        len -= received;
+    }
+    return 0;
+}
+
+// waits for the requester to connect, then lets the kernel copy the file straight into the socket
+static int stream_accept(const Stream *s) {
+    struct pollfd pfd = {.fd = s->listen_fd, .events = POLLIN};
+
+    while (1) {
+        const int ready = poll(&pfd, 1, STREAM_ACCEPT_TIMEOUT_MS);
+        if (ready <= 0) {
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        const int conn = accept(s->listen_fd, (struct sockaddr *) &peer, &peer_len);
+        if (conn < 0) {
+            continue;
+        }
+        if (peer.sin_addr.s_addr != s->requester.s_addr) {
+            close(conn); // somebody else found the port
+            continue;
+        }
+        return conn;
+    }
+}
+
+static void *stream_thread(void *arg) {
+    Stream *s = (Stream *) arg;
+
+    const int conn = stream_accept(s);
+    close(s->listen_fd);
+    if (conn < 0) {
+        fprintf(stderr, "Requester never connected to the data channel\n");
+    } else {
+        const uint32_t size_hi = htonl((uint32_t) ((uint64_t) s->size >> 32));
+        const uint32_t size_lo = htonl((uint32_t) s->size);
+        uint8_t size_header[8];
+        memcpy(size_header, &size_hi, 4);
+        memcpy(size_header + 4, &size_lo, 4);
+
+        off_t offset = 0;
+        if (send_all(conn, size_header, sizeof(size_header)) == 0) {
+            while (offset < s->size) {
+                const off_t remaining = s->size - offset;
+                const ssize_t sent = sendfile(conn, s->fd, &offset, remaining < STREAM_CHUNK ? remaining : STREAM_CHUNK);
+                if (sent <= 0) {
+                    if (sent < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    perror("sendfile");
+                    break;
+                }
+            }
+        }
+        close(conn);
+    }
+
+    close(s->fd);
+    free(s);
+    return NULL;
+}
+
+// opens a TCP data channel for the file and announces it, returns -1 to fall back to datagrams
+static int start_stream_transfer(Node *n, const Message *request, const FileInfo *file_entry, const int fd,
+                                 const off_t size) {
+    Stream *s = calloc(1, sizeof(Stream));
+    if (s == NULL || inet_pton(AF_INET, request->ip, &s->requester) != 1) {
+        free(s);
+        return -1;
+    }
+
+    s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0; // let the kernel pick a port
+    addr.sin_addr.s_addr = inet_addr(n->ip);
+    socklen_t addr_len = sizeof(addr);
+
+    if (s->listen_fd < 0 || bind(s->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(s->listen_fd, 1) < 0 || getsockname(s->listen_fd, (struct sockaddr *) &addr, &addr_len) < 0) {
+        perror("Failed to open data channel");
+        if (s->listen_fd >= 0) {
+            close(s->listen_fd);
+        }
+        free(s);
+        return -1;
+    }
+    s->fd = fd;
+    s->size = size;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, stream_thread, s) != 0) {
+        perror("pthread_create");
+        close(s->listen_fd);
+        free(s);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    Message response = {0};
+    response.request_id = request->request_id;
+    response.type = MSG_REPLY;
+    response.flags = MSG_FLAG_STREAM;
+    memcpy(response.id, file_entry->id, HASH_SIZE);
+    strcpy(response.ip, n->ip);
+    response.port = ntohs(addr.sin_port);
+    set_message_text(&response, "Starting download");
+    send_reply(n, request, &response);
+
+    return 0;
+}
+
+int start_file_transfer(Node *n, const Message *request, const FileInfo *file_entry) {
+    const int fd = open(file_entry->filepath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Failed to open file");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // large files skip the datagram path entirely when the requester can take a stream
+    if (request->flags & MSG_FLAG_STREAM && st.st_size >= STREAM_THRESHOLD &&
+        start_stream_transfer(n, request, file_entry, fd, st.st_size) == 0) {
+        return 0;
+    }
+
+    Transfer *t = calloc(1, sizeof(Transfer));
+    const uint32_t total = (st.st_size + segment_size() - 1) / segment_size();
+    if (t == NULL || (t->segments = calloc(total > 0 ? total : 1, sizeof(SegmentInfo))) == NULL) {
+        perror("calloc");
+        free(t);
+        close(fd);
+        return -1;
+    }
+
+    t->n = n;
+    strcpy(t->ip, request->ip);
+    t->port = request->port;
+    t->fd = fd;
+    t->total = total;
+    t->cwnd = TRANSFER_INITIAL_WINDOW;
+    t->ssthresh = TRANSFER_MAX_WINDOW;
+    t->rto = TRANSFER_INITIAL_RTO_MS * 1000ULL;
+
+    Message *header = &t->header;
+    header->request_id = request->request_id;
+    header->type = MSG_FILE_DATA;
+    memcpy(header->id, file_entry->id, HASH_SIZE);
+    strcpy(header->ip, file_entry->owner_ip);
+    header->port = file_entry->owner_port;
+    header->total_segments = total;
+
+    Message response = {0};
+    memcpy(&response, header, offsetof(Message, data));
+    response.type = MSG_REPLY;
+    set_message_text(&response, "Starting download");
+    if (register_request(&ack_queue, request->request_id) < 0) {
+        close(fd);
+        free(t->segments);
+        free(t);
+        return -1;
+    }
+    send_reply(n, request, &response);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, transfer_thread, t) != 0) {
+        perror("pthread_create");
+        unregister_request(&ack_queue, request->request_id);
+        response.type = MSG_FILE_END;
+        set_message_text(&response, "Transfer interrupted");
+        send_message(n, t->ip, t->port, &response);
+        close(fd);
+        free(t->segments);
+        free(t);
+        return 0; // the requester was already told about the failure
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
+
+// reports what has been received so far: cumulative index plus a bitmap of the segments after it
+static void send_transfer_ack(const Node *n, const char *ip, const int port, const uint32_t request_id,
+                              const bool *received_segments, const uint32_t total_segments, const uint32_t cumulative,
+                              const uint32_t highest, const uint32_t echo) {
+    Message ack;
+    ack.request_id = request_id;
+    ack.type = MSG_FILE_ACK;
+    memcpy(ack.id, n->id, HASH_SIZE);
+    strcpy(ack.ip, n->ip);
+    ack.port = n->port;
+    ack.segment_index = echo;
+    ack.total_segments = total_segments;
+
+    const uint32_t cumulative_be = htonl(cumulative);
+    const uint32_t echo_be = htonl(echo);
+    memcpy(ack.data, &cumulative_be, sizeof(cumulative_be));
+    memcpy(ack.data + 4, &echo_be, sizeof(echo_be));
+
+    size_t bitmap_bits = highest >= cumulative + 1 ? highest - cumulative : 0;
+    if (bitmap_bits > (sizeof(ack.data) - TRANSFER_ACK_HEADER) * 8) {
+        bitmap_bits = (sizeof(ack.data) - TRANSFER_ACK_HEADER) * 8;
+    }
+    uint8_t *bitmap = (uint8_t *) ack.data + TRANSFER_ACK_HEADER;
+    memset(bitmap, 0, (bitmap_bits + 7) / 8);
+    for (size_t bit = 0; bit < bitmap_bits; bit++) {
+        if (received_segments[cumulative + 1 + bit]) {
+            bitmap[bit / 8] |= 1u << (bit % 8);
+        }
+    }
+    ack.data_len = TRANSFER_ACK_HEADER + (bitmap_bits + 7) / 8;
+
+    send_message(n, ip, port, &ack);
+}
+
+int receive_file_transfer(const Node *n, const char *sender_ip, const int sender_port, const uint32_t request_id,
+                          const uint32_t total_segments, bool *received_segments, const int fd) {
+    uint32_t received = 0;
+    uint32_t cumulative = 0; // every segment below this index was received
+    uint32_t highest = 0;
+    uint32_t since_ack = 0;
+    int idle = 0;
+    int status = -1;
+
+    if (total_segments == 0) {
+        return 0;
+    }
+
+    Message *segment = NULL;
+    while (1) {
+        if (segment == NULL) {
+            segment = pop_message_timeout(&download_queue, request_id, TRANSFER_IDLE_MS);
+        }
+        if (segment == NULL) {
+            if (++idle > TRANSFER_MAX_TIMEOUTS) {
+                fprintf(stderr, "Timeout waiting for segments.\n");
+                break;
+            }
+            // nothing arrived for a while: repeat our state so the sender retransmits what is missing
+            send_transfer_ack(n, sender_ip, sender_port, request_id, received_segments, total_segments, cumulative,
+                              highest, UINT32_MAX);
+            continue;
+        }
+        idle = 0;
+
+        if (segment->type == MSG_FILE_END) {
+            fprintf(stderr, "Download incomplete. %s.\n", segment->data);
+            release_message(segment);
+            break;
+        }
+
+        const uint32_t index = segment->segment_index;
+        bool ack_now = index != cumulative; // out of order or duplicate: tell the sender right away
+        if (index < total_segments && !received_segments[index]) {
+            if (pwrite(fd, segment->data, segment->data_len, (off_t) index * sizeof(segment->data)) < 0) {
+                perror("pwrite");
+                release_message(segment);
+                break;
+            }
+            received_segments[index] = true;
+            received++;
+            since_ack++;
+            if (index > highest) {
+                highest = index;
+            }
+            while (cumulative < total_segments && received_segments[cumulative]) {
+                cumulative++;
+            }
+        }
+        release_message(segment);
+
+        if (received == total_segments) {
+            // the final ACK is repeated since the sender keeps retransmitting until it gets one
+            for (int i = 0; i < 3; i++) {
+                send_transfer_ack(n, sender_ip, sender_port, request_id, received_segments, total_segments,
+                                  cumulative, highest, index);
+            }
+            status = 0;
+            break;
+        }
+
+        // acknowledge every TRANSFER_ACK_EVERY segments, or as soon as the queue runs dry
+        segment = pop_message_timeout(&download_queue, request_id, 0);
+        if (ack_now || since_ack >= TRANSFER_ACK_EVERY || (segment == NULL && since_ack > 0)) {
+            send_transfer_ack(n, sender_ip, sender_port, request_id, received_segments, total_segments, cumulative,
+                              highest, index);
+            since_ack = 0;
+        }
+    }
+
+    return status;
+}
+
+int receive_stream_transfer(const char *owner_ip, const int data_port, const int fd) {
+    const int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // a stalled owner must not block the download forever
+    const struct timeval timeout = {.tv_sec = STREAM_ACCEPT_TIMEOUT_MS / 1000, .tv_usec = 0};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(data_port);
+    addr.sin_addr.s_addr = inet_addr(owner_ip);
+
+    uint8_t size_header[8];
+    if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        recv_all(sockfd, size_header, sizeof(size_header)) < 0) {
+        perror("Failed to open data channel");
+        close(sockfd);
+        return -1;
+    }
+
+    uint32_t size_hi, size_lo;
+    memcpy(&size_hi, size_header, 4);
+    memcpy(&size_lo, size_header + 4, 4);
+    const uint64_t size = (uint64_t) ntohl(size_hi) << 32 | ntohl(size_lo);
+
+    uint64_t received = 0;
+    int pipefd[2];
+    const bool use_splice = pipe(pipefd) == 0;
+
+    // socket -> pipe -> file without passing through user space
+    while (use_splice && received < size) {
+        const uint64_t remaining = size - received;
+        const ssize_t in_pipe = splice(sockfd, NULL, pipefd[1], NULL, remaining < STREAM_CHUNK ? remaining : STREAM_CHUNK,
+                                       SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe <= 0) {
+            if (in_pipe < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        ssize_t drained = 0;
+        while (drained < in_pipe) {
+            loff_t offset = (loff_t) (received + drained);
+            const ssize_t moved = splice(pipefd[0], NULL, fd, &offset, in_pipe - drained, SPLICE_F_MOVE);
+            if (moved <= 0) {
+                if (moved < 0 && errno == EINTR) {
+                    continue;
+                }
+                perror("splice");
+                close(pipefd[0]);
+                close(pipefd[1]);
+                close(sockfd);
+                return -1;
+            }
+            drained += moved;
+        }
+        received += in_pipe;
+    }
+    if (use_splice) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+
+    // fall back to large reads where splice is unavailable (or failed before moving anything)
+    if (received < size && (!use_splice || errno == EINVAL)) {
+        char *buf = malloc(STREAM_CHUNK);
+        while (buf != NULL && received < size) {
+            const uint64_t remaining = size - received;
+            const ssize_t bytes_read = recv(sockfd, buf, remaining < STREAM_CHUNK ? remaining : STREAM_CHUNK, 0);
+            if (bytes_read <= 0) {
+                if (bytes_read < 0 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (pwrite(fd, buf, bytes_read, (off_t) received) != bytes_read) {
+                perror("pwrite");
+                break;
+            }
+            received += bytes_read;
+        }
+        free(buf);
+    }
+
+    close(sockfd);
+
+    if (received != size) {
+        fprintf(stderr, "Download incomplete. Data channel closed after %lu of %lu bytes.\n",
+                (unsigned long) received, (unsigned long) size);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include "workers.h"
+#include "message_pool.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bounded FIFO of messages shared by the threads of one pool
+typedef struct {
+    Message *queue[WORKER_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    Node *node;
+} WorkerPool;
+
+static WorkerPool control_pool = {.mutex = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER};
+static WorkerPool bulk_pool = {.mutex = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER};
+
+static void *worker_thread(void *arg) {
+    WorkerPool *pool = (WorkerPool *) arg;
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->count == 0) {
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        }
+        Message *msg = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % WORKER_QUEUE_SIZE;
+        pool->count--;
+        pthread_mutex_unlock(&pool->mutex);
+
+        handle_requests(pool->node, msg);
+        release_message(msg);
+    }
+    return NULL; // workers run until the process exits
+}
+
+static int start_pool(WorkerPool *pool, Node *n, const int threads) {
+    pool->node = n;
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_thread, pool) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+int start_workers(Node *n, const int control_workers, const int bulk_workers) {
+    if (start_pool(&control_pool, n, control_workers) < 0 || start_pool(&bulk_pool, n, bulk_workers) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int submit_message(const HandlerClass handler_class, const Message *msg) {
+    WorkerPool *pool = handler_class == HANDLER_BULK ? &bulk_pool : &control_pool;
+
+    Message *copy = acquire_message();
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, msg, sizeof(Message));
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->count == WORKER_QUEUE_SIZE) {
+        // overloaded: dropping here is no worse than the socket buffer overflowing, senders retry
+        pthread_mutex_unlock(&pool->mutex);
+        release_message(copy);
+        return -1;
+    }
+    pool->queue[(pool->head + pool->count) % WORKER_QUEUE_SIZE] = copy;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}